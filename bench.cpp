@@ -0,0 +1,204 @@
+#include "include/lambdas.h"
+#include "include/output_buffer.h"
+#include "include/reduction_context.h"
+#include "include/term_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct workload
+{
+    std::string name;
+    std::string term;
+    /**
+     * Reduction stops after this many steps even if the term is not in normal form
+     */
+    size_t      step_limit;
+};
+
+/**
+ * Best times of all repetitions of a workload, in nanoseconds
+ */
+struct measurement
+{
+    uint64_t    parse_ns{UINT64_MAX};
+    uint64_t    substitutions_ns{UINT64_MAX};
+    uint64_t    reduce_ns{UINT64_MAX};
+    uint64_t    deep_copy_ns{UINT64_MAX};
+    uint64_t    print_ns{UINT64_MAX};
+    size_t      steps{0};
+    bool        normal_form{false};
+    size_t      printed_bytes{0};
+};
+
+/**
+ * (a + b) * (c + d) on Church numerals
+ */
+static inline
+std::string church_arithmetic(size_t a, size_t b, size_t c, size_t d)
+{
+    return church_mult + " (" + church_plus + " " + church_numeral(a) + " " + church_numeral(b) + ") ("
+           + church_plus + " " + church_numeral(c) + " " + church_numeral(d) + ")";
+}
+
+static inline
+std::string factorial(size_t n)
+{
+    std::string const step = "(\\r.\\n." + church_is_zero + " n " + church_numeral(1)
+                             + " (" + church_mult + " n (r (" + church_pred + " n))))";
+    return y_combinator + " " + step + " " + church_numeral(n);
+}
+
+/**
+ * A variable applied to width redexes side by side
+ */
+static inline
+std::string wide_term(size_t width)
+{
+    std::string result = "y";
+    for (size_t i = 0; i < width; ++i)
+        result += " ((\\x.x x) z)";
+    return result;
+}
+
+static inline
+std::vector<workload> make_workloads()
+{
+    return {
+        {"church_arithmetic", church_arithmetic(7, 8, 9, 10), 1000000},
+        {"y_factorial", factorial(3), 1000000},
+        {"deep_nesting", identity_chain(5000), 1000000},
+        {"wide_term", wide_term(2000), 1000000},
+    };
+}
+
+using bench_clock = std::chrono::steady_clock;
+
+[[nodiscard]]
+static inline
+uint64_t elapsed_ns(bench_clock::time_point start)
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count());
+}
+
+/**
+ * Parses, renames, reduces, copies and prints the term once, keeping the best time of every phase
+ */
+static inline
+void run_once(reduction_context& context, workload const& work, measurement& best)
+{
+    context.reset();
+
+    auto start = bench_clock::now();
+    auto term = context.parse(work.term);
+    best.parse_ns = std::min(best.parse_ns, elapsed_ns(start));
+
+    start = bench_clock::now();
+    context.run_substitutions(*term);
+    best.substitutions_ns = std::min(best.substitutions_ns, elapsed_ns(start));
+
+    start = bench_clock::now();
+    bool reducible = true;
+    while (context.steps() < work.step_limit
+           && (reducible = context.reduce(*term)))
+    {}
+    best.reduce_ns = std::min(best.reduce_ns, elapsed_ns(start));
+    best.steps = context.steps();
+    best.normal_form = !reducible;
+
+    {
+        node_arena<rendering_userdata>::scope arena_guard(context.allocator());
+        start = bench_clock::now();
+        auto copy = term->deep_copy();
+        best.deep_copy_ns = std::min(best.deep_copy_ns, elapsed_ns(start));
+    }
+
+    output_buffer out(output_buffer::in_memory);
+    start = bench_clock::now();
+    out.append(*term).put('\n');
+    best.print_ns = std::min(best.print_ns, elapsed_ns(start));
+    best.printed_bytes = out.release().size();
+}
+
+static inline
+void write_json(std::ostream& out, std::vector<workload> const& workloads,
+                std::vector<measurement> const& results, size_t repeat)
+{
+    out << "{\n  \"repeat\": " << repeat << ",\n  \"workloads\": [";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        auto const& r = results[i];
+        double const steps_per_s = r.reduce_ns == 0 ? 0.0 : r.steps * 1e9 / r.reduce_ns;
+
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\n"
+            << "      \"name\": \"" << workloads[i].name << "\",\n"
+            << "      \"input_bytes\": " << workloads[i].term.size() << ",\n"
+            << "      \"parse_ns\": " << r.parse_ns << ",\n"
+            << "      \"run_substitutions_ns\": " << r.substitutions_ns << ",\n"
+            << "      \"reduce_ns\": " << r.reduce_ns << ",\n"
+            << "      \"steps\": " << r.steps << ",\n"
+            << "      \"normal_form\": " << (r.normal_form ? "true" : "false") << ",\n"
+            << "      \"steps_per_s\": " << static_cast<uint64_t>(steps_per_s) << ",\n"
+            << "      \"deep_copy_ns\": " << r.deep_copy_ns << ",\n"
+            << "      \"print_ns\": " << r.print_ns << ",\n"
+            << "      \"printed_bytes\": " << r.printed_bytes << "\n"
+            << "    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+static inline
+void print_usage(char const* argv0)
+{
+    std::cerr << "Usage: " << argv0 << " [--repeat=N] [workload...]\n"
+              << "Times parsing, renaming, reduction, copying and printing of the named\n"
+              << "workloads, or of all of them, and prints the best of N runs as JSON.\n"
+              << "Workloads:";
+    for (auto const& work : make_workloads())
+        std::cerr << ' ' << work.name;
+    std::cerr << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    auto workloads = make_workloads();
+    std::vector<workload> selected;
+    size_t repeat = 5;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg(argv[i]);
+        std::string_view const repeat_prefix = "--repeat=";
+
+        if (arg.substr(0, repeat_prefix.size()) == repeat_prefix)
+            repeat = std::max<size_t>(std::stoul(std::string(arg.substr(repeat_prefix.size()))), 1);
+        else
+        {
+            auto it = std::find_if(workloads.begin(), workloads.end(),
+                                   [arg] (workload const& work) { return work.name == arg; });
+            if (it == workloads.end())
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+            selected.push_back(*it);
+        }
+    }
+
+    if (selected.empty())
+        selected = workloads;
+
+    reduction_context context;
+    std::vector<measurement> results(selected.size());
+    for (size_t i = 0; i < selected.size(); ++i)
+        for (size_t run = 0; run < repeat; ++run)
+            run_once(context, selected[i], results[i]);
+
+    write_json(std::cout, selected, results, repeat);
+    return 0;
+}
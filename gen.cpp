@@ -0,0 +1,156 @@
+#include "include/output_buffer.h"
+#include "include/term_generator.h"
+
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+
+enum class generator_kind
+{
+    RANDOM,
+    CHURCH,
+    SHAPED,
+    STEPS
+};
+
+struct generator_options
+{
+    generator_kind                      kind{generator_kind::RANDOM};
+    term_shape                          shape{term_shape::BALANCED};
+    size_t                              size{0};
+    size_t                              count{1};
+    uint64_t                            seed{0};
+    random_term_parameters              params;
+    /**
+     * m and k of task2, to print every term as a task2 input
+     */
+    std::optional<std::pair<size_t, size_t>> task;
+};
+
+[[nodiscard]]
+static inline
+bool parse_options(int argc, char** argv, generator_options& options)
+{
+    if (argc < 3)
+        return false;
+
+    std::string_view const kind(argv[1]);
+    if (kind == "random")
+        options.kind = generator_kind::RANDOM;
+    else if (kind == "church")
+        options.kind = generator_kind::CHURCH;
+    else if (kind == "steps")
+        options.kind = generator_kind::STEPS;
+    else if (kind == "balanced" || kind == "left-spine" || kind == "right-spine")
+    {
+        options.kind = generator_kind::SHAPED;
+        options.shape = kind == "balanced" ? term_shape::BALANCED
+                        : kind == "left-spine" ? term_shape::LEFT_SPINE
+                        : term_shape::RIGHT_SPINE;
+    }
+    else
+        return false;
+
+    options.size = std::stoul(argv[2]);
+
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string_view arg(argv[i]);
+        auto value = [arg] (std::string_view prefix) -> std::optional<std::string>
+        {
+            if (arg.substr(0, prefix.size()) != prefix)
+                return std::nullopt;
+            return std::string(arg.substr(prefix.size()));
+        };
+
+        if (auto v = value("--count="))
+            options.count = std::stoul(*v);
+        else if (auto v = value("--seed="))
+            options.seed = std::stoull(*v);
+        else if (auto v = value("--binders="))
+            options.params.binder_density = std::stod(*v);
+        else if (auto v = value("--redexes="))
+            options.params.redex_density = std::stod(*v);
+        else if (auto v = value("--max-depth="))
+            options.params.max_depth = std::stoul(*v);
+        else if (auto v = value("--task="))
+        {
+            auto const comma = v->find(',');
+            if (comma == std::string::npos)
+                return false;
+            options.task.emplace(std::stoul(v->substr(0, comma)), std::stoul(v->substr(comma + 1)));
+        }
+        else
+            return false;
+    }
+
+    return true;
+}
+
+static inline
+void print_usage(char const* argv0)
+{
+    std::cerr << "Usage: " << argv0 << " KIND N [options]\n"
+              << "Prints closed lambda terms, one per line. KIND and N are one of:\n"
+              << "  random N        random term of about N nodes\n"
+              << "  church N        Church numeral N\n"
+              << "  balanced N      complete application tree of N variables, rounded up to a power of two\n"
+              << "  left-spine N    x x ... x with N variables\n"
+              << "  right-spine N   x (x (... x)) with N variables\n"
+              << "  steps N         term reduced in exactly N steps by normal order reduction\n"
+              << "Options:\n"
+              << "  --count=C       print C terms, random ones are all different\n"
+              << "  --seed=S        seed of random terms\n"
+              << "  --binders=P     chance of a random node to be an abstraction\n"
+              << "  --redexes=P     chance of a random application to be a redex\n"
+              << "  --max-depth=D   depth limit of random terms\n"
+              << "  --task=M,K      print each term after a line 'M K', as task2 input" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    generator_options options;
+    try
+    {
+        if (!parse_options(argc, argv, options))
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    catch (std::logic_error const&)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    random_term_generator random_terms(options.seed, options.params);
+    output_buffer out;
+
+    for (size_t i = 0; i < options.count; ++i)
+    {
+        if (options.task)
+            out.append(std::to_string(options.task->first)).put(' ')
+               .append(std::to_string(options.task->second)).put('\n');
+
+        switch (options.kind)
+        {
+        case generator_kind::RANDOM:
+            out.append(random_terms.generate(options.size));
+            break;
+        case generator_kind::CHURCH:
+            out.append(church_numeral(options.size));
+            break;
+        case generator_kind::SHAPED:
+            out.append(shaped_term(options.shape, options.size));
+            break;
+        case generator_kind::STEPS:
+            out.append(identity_chain(options.size));
+            break;
+        }
+        out.put('\n');
+    }
+
+    return out.flush() ? 0 : 1;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "lambdas.h"
+#include "output_buffer.h"
+
+/**
+ * Appends the nodes and edges of the tree in Graphviz dot syntax, in
+ * pre-order with an explicit stack. A binder is written with its
+ * abstraction and a referral target once for every referral to it.
+ */
+template<typename UD>
+void append_dot(output_buffer& out, ast_record<UD> const& root)
+{
+    auto append_variable = [&out] (ast_record<UD> const& rec)
+    {
+        auto& node = std::get<0>(rec.node);
+        out.append("\tx").append_address(&rec)
+           .append(" [label=\"").append(*node.symbols, node.id).append("\" color=\"#000d16\"];\n");
+    };
+
+    preorder_walk(root, [&out, &append_variable] (ast_record<UD> const& rec)
+    {
+        switch (rec.node.index())
+        {
+        case 0:
+            append_variable(rec);
+            break;
+        case 1:
+        {
+            auto& node = std::get<1>(rec.node);
+            if (node.tag == node_tag::APPLICATION)
+            {
+                out.append("\tx").append_address(&rec)
+                   .append(" [label=\"Apply\" color=\"#021d28\"];\n");
+            }
+            else
+            {
+                out.append("\tx").append_address(&rec)
+                   .append(" [label=\"Forall\" color=\"#807b77\"];\n");
+            }
+            for (auto const& arg : node.args)
+                out.append("\tx").append_address(&rec).append(" -> x").append_address(arg.get()).append(";\n");
+
+            // preorder_walk does not visit binders
+            if (node.tag == node_tag::FORALL)
+                append_variable(*node.args[0]);
+            break;
+        }
+        case 2:
+        {
+            auto& node = std::get<2>(rec.node);
+            out.append("\tx").append_address(&rec)
+               .append(" [label=\"Referral\" color=\"#b1bac1\"];\n");
+
+            out.append("\t").append_address(&rec).append(" -> ").append_address(node.get()).append(";\n");
+            break;
+        }
+        default:
+            assert(false && "Unreachable code expected!");
+            break;
+        }
+
+        return walk_action::DESCEND;
+    });
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define CHAR_SCANNER_X86 1
+#endif
+
+/**
+ * Byte classes of the lambda grammar for parsing_context.
+ *
+ * Single bytes are classified by a table. Runs of whitespace and of variable
+ * name characters are measured 16 bytes at a time with SSE2, or 32 with AVX2
+ * when the CPU has it, and with the table on other targets and in the tail
+ * of the input.
+ */
+class char_scanner
+{
+public:
+    enum char_class : uint8_t
+    {
+        OTHER           = 0,
+        SPACE           = 1u << 0u,
+        VARNAME_START   = 1u << 1u,
+        VARNAME         = 1u << 2u,
+    };
+
+    [[nodiscard]]
+    static bool is(char c, char_class cls)
+    {
+        return (classes[static_cast<unsigned char>(c)] & cls) != 0;
+    }
+
+    /**
+     * @return  length of the whitespace prefix of str, as std::isspace in the C locale
+     */
+    [[nodiscard]]
+    static size_t count_spaces(std::string_view str)
+    {
+        if (str.empty() || !is(str[0], SPACE))
+            return 0;
+
+        size_t const wide = scanners.spaces(str.data(), str.size());
+        return wide + count_tail(str.substr(wide), SPACE);
+    }
+
+    /**
+     * @return  length of the prefix of str made of variable name characters
+     */
+    [[nodiscard]]
+    static size_t count_varname(std::string_view str)
+    {
+        size_t const wide = scanners.varname(str.data(), str.size());
+        return wide + count_tail(str.substr(wide), VARNAME);
+    }
+
+private:
+    constexpr static std::array<uint8_t, 256> make_classes()
+    {
+        std::array<uint8_t, 256> result{};
+        for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r'})
+            result[c] = SPACE;
+        for (unsigned c = 'a'; c <= 'z'; ++c)
+            result[c] = VARNAME_START | VARNAME;
+        for (unsigned c = '0'; c <= '9'; ++c)
+            result[c] = VARNAME;
+        result['\''] = VARNAME;
+        return result;
+    }
+
+    static std::array<uint8_t, 256> const classes;
+
+    static size_t count_tail(std::string_view str, char_class cls)
+    {
+        size_t i = 0;
+        while (i < str.size() && is(str[i], cls))
+            i++;
+        return i;
+    }
+
+    /**
+     * Measure a run over whole chunks only, stopping at the chunk
+     * where the run ends or the last whole chunk
+     */
+    using scan_fn = size_t (*)(char const* data, size_t size);
+
+    struct scanner_set
+    {
+        scan_fn spaces;
+        scan_fn varname;
+    };
+
+    static size_t no_scan(char const*, size_t)
+    {
+        return 0;
+    }
+
+#ifdef CHAR_SCANNER_X86
+    /**
+     * Bytes of chunk in [lo, hi] with signed compares only: shifting lo
+     * to -128 leaves the range as the values below -128 + (hi - lo + 1)
+     */
+    static __m128i in_range_sse2(__m128i chunk, char lo, char hi)
+    {
+        auto const shifted = _mm_add_epi8(chunk, _mm_set1_epi8(static_cast<char>(0x80 - lo)));
+        return _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(0x80 + (hi - lo + 1))));
+    }
+
+    static unsigned spaces_mask_sse2(__m128i chunk)
+    {
+        auto const blank = _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' '));
+        return static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(blank, in_range_sse2(chunk, '\t', '\r'))));
+    }
+
+    static unsigned varname_mask_sse2(__m128i chunk)
+    {
+        auto const quote = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\''));
+        auto const mask = _mm_or_si128(_mm_or_si128(in_range_sse2(chunk, 'a', 'z'),
+                                                    in_range_sse2(chunk, '0', '9')),
+                                       quote);
+        return static_cast<unsigned>(_mm_movemask_epi8(mask));
+    }
+
+    template<unsigned (*mask_of)(__m128i)>
+    static size_t scan_sse2(char const* data, size_t size)
+    {
+        size_t i = 0;
+        for (; i + 16 <= size; i += 16)
+        {
+            auto const chunk = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+            unsigned const outside = ~mask_of(chunk) & 0xffffu;
+            if (outside != 0)
+                return i + static_cast<size_t>(__builtin_ctz(outside));
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i in_range_avx2(__m256i chunk, char lo, char hi)
+    {
+        auto const shifted = _mm256_add_epi8(chunk, _mm256_set1_epi8(static_cast<char>(0x80 - lo)));
+        return _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(0x80 + (hi - lo + 1))), shifted);
+    }
+
+    __attribute__((target("avx2")))
+    static unsigned spaces_mask_avx2(__m256i chunk)
+    {
+        auto const blank = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' '));
+        return static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(blank, in_range_avx2(chunk, '\t', '\r'))));
+    }
+
+    __attribute__((target("avx2")))
+    static unsigned varname_mask_avx2(__m256i chunk)
+    {
+        auto const quote = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\''));
+        auto const mask = _mm256_or_si256(_mm256_or_si256(in_range_avx2(chunk, 'a', 'z'),
+                                                          in_range_avx2(chunk, '0', '9')),
+                                          quote);
+        return static_cast<unsigned>(_mm256_movemask_epi8(mask));
+    }
+
+    template<unsigned (*mask_of)(__m256i)>
+    __attribute__((target("avx2")))
+    static size_t scan_avx2(char const* data, size_t size)
+    {
+        size_t i = 0;
+        for (; i + 32 <= size; i += 32)
+        {
+            auto const chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data + i));
+            unsigned const outside = ~mask_of(chunk);
+            if (outside != 0)
+                return i + static_cast<size_t>(__builtin_ctz(outside));
+        }
+        return i;
+    }
+#endif
+
+    static scanner_set select_scanners()
+    {
+#ifdef CHAR_SCANNER_X86
+        // Runs during static initialization, the CPU model may be unknown yet
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return {scan_avx2<spaces_mask_avx2>, scan_avx2<varname_mask_avx2>};
+
+        return {scan_sse2<spaces_mask_sse2>, scan_sse2<varname_mask_sse2>};
+#else
+        return {no_scan, no_scan};
+#endif
+    }
+
+    inline static scanner_set const scanners = select_scanners();
+};
+
+inline constexpr std::array<uint8_t, 256> char_scanner::classes = char_scanner::make_classes();
@@ -0,0 +1,740 @@
+#pragma once
+
+#include "lambdas.h"
+
+#include <cstdint>
+#include <ostream>
+#include <memory>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+/**
+ * Nameless term representation.
+ *
+ * Bound variables are De Bruijn indices, free variables keep their symbols.
+ * A referral shares its target between several occurrences: the target is
+ * a term of the context where it was created, and shift is the number of
+ * binders between that context and the occurrence.
+ */
+struct db_term;
+
+using db_term_ptr = std::unique_ptr<db_term>;
+
+struct db_index
+{
+    size_t index;
+};
+
+struct db_abstraction
+{
+    db_term_ptr body;
+};
+
+struct db_application
+{
+    db_term_ptr args[2];
+};
+
+struct db_referral
+{
+    std::shared_ptr<db_term>    target;
+    size_t                      shift;
+};
+
+using db_node = std::variant<db_index, variable_t, db_abstraction, db_application, db_referral>;
+
+struct db_term
+{
+    explicit db_term(db_node node)
+            : node(std::move(node))
+    {}
+
+    db_term(db_term const&) = delete;
+    db_term& operator=(db_term const&) = delete;
+
+    /**
+     * Tears the subterms down with an explicit stack, as binary_operation does
+     */
+    ~db_term()
+    {
+        std::vector<db_term_ptr> terms;
+        std::vector<std::shared_ptr<db_term>> shared;
+
+        auto detach = [&terms, &shared] (db_node& node)
+        {
+            switch (node.index())
+            {
+            case 2:
+            {
+                auto& body = std::get<2>(node).body;
+                if (body && body->node.index() > 1)
+                    terms.push_back(std::move(body));
+                break;
+            }
+            case 3:
+                for (auto& arg : std::get<3>(node).args)
+                    if (arg && arg->node.index() > 1)
+                        terms.push_back(std::move(arg));
+                break;
+            case 4:
+                shared.push_back(std::move(std::get<4>(node).target));
+                break;
+            default:
+                break;
+            }
+        };
+
+        detach(node);
+        while (!terms.empty() || !shared.empty())
+        {
+            if (!terms.empty())
+            {
+                auto term = std::move(terms.back());
+                terms.pop_back();
+                detach(term->node);
+                continue;
+            }
+
+            auto ptr = std::move(shared.back());
+            shared.pop_back();
+            if (ptr && sole_owner(ptr))
+                detach(ptr->node);
+        }
+    }
+
+    db_node node;
+};
+
+template<typename... Args>
+db_term_ptr make_db_term(Args&&... args)
+{
+    return std::make_unique<db_term>(db_node{std::forward<Args>(args)...});
+}
+
+/**
+ * Depth-first walk over a db_term with an explicit stack, the counterpart
+ * of walk: visitor.enter(term) may change term before the walk descends,
+ * visitor.between(term) runs between the operands of an application and
+ * visitor.leave(term) after the children of a descended node. Referrals
+ * are walked through.
+ *
+ * @return  false if the visitor stopped the walk
+ */
+template<typename Term, typename Visitor>
+bool db_walk(Term& root, Visitor&& visitor)
+{
+    struct frame
+    {
+        Term*   term;
+        uint8_t stage;
+    };
+
+    pooled_stack<frame> frames;
+    auto& stack = frames.items;
+    stack.push_back({&root, 0});
+
+    while (!stack.empty())
+    {
+        size_t const top = stack.size() - 1;
+        Term& term = *stack[top].term;
+
+        switch (stack[top].stage++)
+        {
+        case 0:
+        {
+            auto action = visitor.enter(term);
+            if (action == walk_action::STOP)
+                return false;
+
+            if (action == walk_action::SKIP
+                || term.node.index() < 2)
+            {
+                stack.pop_back();
+                break;
+            }
+
+            switch (term.node.index())
+            {
+            case 2:
+                stack[top].stage = 2;
+                stack.push_back({std::get<2>(term.node).body.get(), 0});
+                break;
+            case 3:
+                stack.push_back({std::get<3>(term.node).args[0].get(), 0});
+                break;
+            case 4:
+                stack[top].stage = 2;
+                stack.push_back({std::get<4>(term.node).target.get(), 0});
+                break;
+            default:
+                assert(false && "Unexpected node type!");
+                stack.pop_back();
+            }
+            break;
+        }
+        case 1:
+            visitor.between(term);
+            stack.push_back({std::get<3>(term.node).args[1].get(), 0});
+            break;
+        case 2:
+            visitor.leave(term);
+            stack.pop_back();
+            break;
+        default:
+            assert(false && "Unexpected walk stage");
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Bound variables are found through the binder levels of each name,
+ * innermost last, so shadowed names need no search of the enclosing binders
+ */
+template<typename UD>
+db_term_ptr to_de_bruijn(ast_record<UD> const& root)
+{
+    struct converter : walk_visitor
+    {
+        walk_action enter(ast_record<UD> const& rec)
+        {
+            switch (rec.node.index())
+            {
+            case 0:
+            {
+                auto& var = std::get<0>(rec.node);
+                auto it = levels.find(var.id);
+                if (it != levels.end() && !it->second.empty())
+                    terms.push_back(make_db_term(db_index{depth - 1 - it->second.back()}));
+                else
+                    terms.push_back(make_db_term(var));
+                break;
+            }
+            case 1:
+            {
+                auto& op = std::get<1>(rec.node);
+                if (op.tag == node_tag::FORALL)
+                {
+                    assert(op.args[0]->node.index() == 0);
+                    levels[std::get<0>(op.args[0]->node).id].push_back(depth++);
+                }
+                break;
+            }
+            default:
+                // Names are unique after renaming, so a referral target can be expanded in place
+                break;
+            }
+
+            return walk_action::DESCEND;
+        }
+
+        void leave(ast_record<UD> const& rec)
+        {
+            if (rec.node.index() != 1)
+                return;
+
+            auto& op = std::get<1>(rec.node);
+            auto rhs = std::move(terms.back());
+            terms.pop_back();
+
+            if (op.tag == node_tag::FORALL)
+            {
+                levels[std::get<0>(op.args[0]->node).id].pop_back();
+                depth--;
+                terms.push_back(make_db_term(db_abstraction{std::move(rhs)}));
+                return;
+            }
+
+            auto lhs = std::move(terms.back());
+            terms.pop_back();
+            terms.push_back(make_db_term(db_application{{std::move(lhs), std::move(rhs)}}));
+        }
+
+        std::unordered_map<symbol_id, std::vector<size_t>> levels;
+        size_t                                              depth{0};
+        std::vector<db_term_ptr>                            terms;
+    } visitor;
+
+    walk(root, visitor);
+    assert(visitor.terms.size() == 1);
+    return std::move(visitor.terms.back());
+}
+
+/**
+ * Binders of the scope a referral target was made in, the ones hidden by
+ * the referral's shift are kept aside until the target is left
+ */
+struct db_scope
+{
+    void enter_referral(db_referral const& ref)
+    {
+        assert(ref.shift <= names.size());
+        hidden.emplace_back(names.end() - ref.shift, names.end());
+        names.resize(names.size() - ref.shift);
+    }
+
+    void leave_referral()
+    {
+        names.insert(names.end(), hidden.back().begin(), hidden.back().end());
+        hidden.pop_back();
+    }
+
+    [[nodiscard]]
+    symbol_id bound(size_t index) const
+    {
+        assert(index < names.size());
+        return names[names.size() - 1 - index];
+    }
+
+    std::vector<symbol_id>              names;
+    std::vector<std::vector<symbol_id>> hidden;
+};
+
+/**
+ * Names the binder at depth d as generated symbol d; referral targets
+ * do not see the binders hidden by their shift, so no capture is possible
+ */
+template<typename UD>
+ast_record_ptr<UD> from_de_bruijn(db_term const& term, symbol_table const& symbols)
+{
+    struct converter : walk_visitor
+    {
+        walk_action enter(db_term const& term)
+        {
+            switch (term.node.index())
+            {
+            case 0:
+                records.push_back(make_record<UD>(variable_t{scope.bound(std::get<0>(term.node).index), &symbols}));
+                break;
+            case 1:
+                records.push_back(make_record<UD>(std::get<1>(term.node)));
+                break;
+            case 2:
+                scope.names.push_back(symbol_table::generated(scope.names.size()));
+                break;
+            case 4:
+                scope.enter_referral(std::get<4>(term.node));
+                break;
+            default:
+                break;
+            }
+
+            return walk_action::DESCEND;
+        }
+
+        void leave(db_term const& term)
+        {
+            switch (term.node.index())
+            {
+            case 2:
+            {
+                auto const name = scope.names.back();
+                scope.names.pop_back();
+
+                auto body = std::move(records.back());
+                records.pop_back();
+                records.push_back(make_record<UD>(binary_operation(node_tag::FORALL,
+                                                                   make_record<UD>(variable_t{name, &symbols}),
+                                                                   std::move(body))));
+                break;
+            }
+            case 3:
+            {
+                auto rhs = std::move(records.back());
+                records.pop_back();
+                auto lhs = std::move(records.back());
+                records.pop_back();
+                records.push_back(make_record<UD>(binary_operation(node_tag::APPLICATION, std::move(lhs), std::move(rhs))));
+                break;
+            }
+            case 4:
+                scope.leave_referral();
+                break;
+            default:
+                break;
+            }
+        }
+
+        symbol_table const&             symbols;
+        db_scope                        scope;
+        std::vector<ast_record_ptr<UD>> records;
+    } visitor{{}, symbols, {}, {}};
+
+    db_walk(term, visitor);
+    assert(visitor.records.size() == 1);
+    return std::move(visitor.records.back());
+}
+
+/**
+ * Prints the term in the format of ast_record's operator<<
+ * with binders named as in from_de_bruijn
+ */
+static inline
+void print_de_bruijn(std::ostream& out, db_term const& term, symbol_table const& symbols)
+{
+    struct printer : walk_visitor
+    {
+        walk_action enter(db_term const& term)
+        {
+            switch (term.node.index())
+            {
+            case 0:
+                symbols.print(out, scope.bound(std::get<0>(term.node).index));
+                break;
+            case 1:
+                out << std::get<1>(term.node);
+                break;
+            case 2:
+            {
+                auto const name = symbol_table::generated(scope.names.size());
+                out << "(\\";
+                symbols.print(out, name) << '.';
+                scope.names.push_back(name);
+                break;
+            }
+            case 3:
+                out << '(';
+                break;
+            case 4:
+                scope.enter_referral(std::get<4>(term.node));
+                break;
+            default:
+                assert(false && "Unexpected node type!");
+            }
+
+            return walk_action::DESCEND;
+        }
+
+        void between(db_term const&)
+        {
+            out << ' ';
+        }
+
+        void leave(db_term const& term)
+        {
+            switch (term.node.index())
+            {
+            case 2:
+                scope.names.pop_back();
+                out << ')';
+                break;
+            case 3:
+                out << ')';
+                break;
+            case 4:
+                scope.leave_referral();
+                break;
+            default:
+                break;
+            }
+        }
+
+        std::ostream&       out;
+        symbol_table const& symbols;
+        db_scope            scope;
+    } visitor{{}, out, symbols, {}};
+
+    db_walk(term, visitor);
+}
+
+/**
+ * Adds shift to every index of term which is free at the given cutoff
+ */
+static inline
+void db_shift(db_term& term, size_t shift, size_t cutoff = 0)
+{
+    struct shifter : walk_visitor
+    {
+        walk_action enter(db_term& term)
+        {
+            switch (term.node.index())
+            {
+            case 0:
+            {
+                auto& index = std::get<0>(term.node).index;
+                if (index >= cutoff)
+                    index += shift;
+                break;
+            }
+            case 2:
+                cutoff++;
+                break;
+            case 4:
+                assert(false && "Shifting through a referral");
+                return walk_action::SKIP;
+            default:
+                break;
+            }
+
+            return walk_action::DESCEND;
+        }
+
+        void leave(db_term& term)
+        {
+            if (term.node.index() == 2)
+                cutoff--;
+        }
+
+        size_t shift;
+        size_t cutoff;
+    } visitor{{}, shift, cutoff};
+
+    db_walk(term, visitor);
+}
+
+/**
+ * Deep copy without referrals, free indices at the cutoff are shifted
+ */
+[[nodiscard]]
+static inline
+db_term_ptr db_shifted_copy(db_term const& term, size_t shift, size_t cutoff = 0)
+{
+    struct copier : walk_visitor
+    {
+        /**
+         * Shift of the indices free in the copied term or referral target
+         * being walked, the cutoff counts the binders entered in it
+         */
+        struct shifting
+        {
+            size_t shift;
+            size_t cutoff;
+        };
+
+        walk_action enter(db_term const& term)
+        {
+            auto& current = scopes.back();
+            switch (term.node.index())
+            {
+            case 0:
+            {
+                auto const index = std::get<0>(term.node).index;
+                copies.push_back(make_db_term(db_index{index >= current.cutoff ? index + current.shift : index}));
+                break;
+            }
+            case 1:
+                copies.push_back(make_db_term(std::get<1>(term.node)));
+                break;
+            case 2:
+                current.cutoff++;
+                break;
+            case 4:
+                // The target is copied with the shift of the referral, then shifted as a whole
+                scopes.push_back({std::get<4>(term.node).shift, 0});
+                break;
+            default:
+                break;
+            }
+
+            return walk_action::DESCEND;
+        }
+
+        void leave(db_term const& term)
+        {
+            switch (term.node.index())
+            {
+            case 2:
+            {
+                scopes.back().cutoff--;
+                auto body = std::move(copies.back());
+                copies.pop_back();
+                copies.push_back(make_db_term(db_abstraction{std::move(body)}));
+                break;
+            }
+            case 3:
+            {
+                auto rhs = std::move(copies.back());
+                copies.pop_back();
+                auto lhs = std::move(copies.back());
+                copies.pop_back();
+                copies.push_back(make_db_term(db_application{{std::move(lhs), std::move(rhs)}}));
+                break;
+            }
+            case 4:
+            {
+                scopes.pop_back();
+                auto const& outer = scopes.back();
+                if (outer.shift != 0)
+                    db_shift(*copies.back(), outer.shift, outer.cutoff);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        std::vector<shifting>       scopes;
+        std::vector<db_term_ptr>    copies;
+    } visitor;
+
+    visitor.scopes.push_back({shift, cutoff});
+    db_walk(term, visitor);
+    assert(visitor.copies.size() == 1);
+    return std::move(visitor.copies.back());
+}
+
+/**
+ * Replaces every referral under term_ptr with its shifted copy
+ */
+static inline
+void db_resolve_referrals(db_term_ptr& term_ptr)
+{
+    pooled_stack<db_term_ptr*> pending;
+    auto& stack = pending.items;
+    stack.push_back(&term_ptr);
+
+    while (!stack.empty())
+    {
+        db_term_ptr& cur = *stack.back();
+        stack.pop_back();
+
+        switch (cur->node.index())
+        {
+        case 0:
+        case 1:
+            break;
+        case 2:
+            stack.push_back(&std::get<2>(cur->node).body);
+            break;
+        case 3:
+        {
+            auto& app = std::get<3>(cur->node);
+            stack.push_back(&app.args[1]);
+            stack.push_back(&app.args[0]);
+            break;
+        }
+        case 4:
+        {
+            auto& ref = std::get<4>(cur->node);
+            cur = db_shifted_copy(*ref.target, ref.shift);
+            break;
+        }
+        default:
+            assert(false && "Unexpected node type!");
+        }
+    }
+}
+
+/**
+ * Substitutes index depth with a referral to arg and lowers the indices
+ * bound outside of the contracted abstraction
+ */
+static inline
+void db_substitute(db_term& term, size_t depth, std::shared_ptr<db_term> const& arg)
+{
+    struct substituter : walk_visitor
+    {
+        walk_action enter(db_term& term)
+        {
+            switch (term.node.index())
+            {
+            case 0:
+            {
+                auto& index = std::get<0>(term.node).index;
+                if (index == depth)
+                {
+                    // The node is a referral now, its target is not substituted in
+                    term.node = db_referral{arg, depth};
+                    return walk_action::SKIP;
+                }
+                if (index > depth)
+                    index--;
+                break;
+            }
+            case 2:
+                depth++;
+                break;
+            case 4:
+                assert(false && "Unresolved referral");
+                return walk_action::SKIP;
+            default:
+                break;
+            }
+
+            return walk_action::DESCEND;
+        }
+
+        void leave(db_term& term)
+        {
+            if (term.node.index() == 2)
+                depth--;
+        }
+
+        size_t                          depth;
+        std::shared_ptr<db_term> const& arg;
+    } visitor{{}, depth, arg};
+
+    db_walk(term, visitor);
+}
+
+[[nodiscard]]
+static inline
+bool db_is_abstraction(db_term const& term)
+{
+    db_term const* current = &term;
+    while (current->node.index() == 4)
+        current = std::get<4>(current->node).target.get();
+
+    return current->node.index() == 2;
+}
+
+/**
+ * One normal order step with the sharing of the named reducer:
+ * the function of a redex is unshared, its argument becomes a referral
+ * and redexes inside a referral are contracted for every occurrence at once.
+ * The leftmost outermost redex is searched for with a stack of pending terms,
+ * left operands on top.
+ */
+static inline
+bool db_reduce(db_term& term)
+{
+    pooled_stack<db_term*> pending;
+    auto& stack = pending.items;
+    stack.push_back(&term);
+
+    while (!stack.empty())
+    {
+        db_term& cur = *stack.back();
+        stack.pop_back();
+
+        switch (cur.node.index())
+        {
+        case 0:
+        case 1:
+            break;
+        case 2:
+            stack.push_back(std::get<2>(cur.node).body.get());
+            break;
+        case 3:
+        {
+            auto& app = std::get<3>(cur.node);
+            if (db_is_abstraction(*app.args[0]))
+            {
+                db_resolve_referrals(app.args[0]);
+
+                std::shared_ptr<db_term> arg = std::move(app.args[1]);
+                auto& body = std::get<2>(app.args[0]->node).body;
+                db_substitute(*body, 0, arg);
+
+                auto newnode = std::move(body->node);
+                cur.node = std::move(newnode);
+                return true;
+            }
+
+            stack.push_back(app.args[1].get());
+            stack.push_back(app.args[0].get());
+            break;
+        }
+        case 4:
+            stack.push_back(std::get<4>(cur.node).target.get());
+            break;
+        default:
+            assert(false && "Unexpected node type!");
+            return false;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,746 @@
+#pragma once
+
+#include "lambdas.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+[[nodiscard]]
+constexpr size_t fingerprint_mix(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6u) + (seed >> 2u));
+}
+
+/**
+ * Parts of the canonical fingerprint, see fingerprint
+ * @index   De Bruijn index of a bound variable
+ */
+[[nodiscard]]
+constexpr size_t bound_fingerprint(size_t index)
+{
+    return fingerprint_mix(1, index);
+}
+
+[[nodiscard]]
+constexpr size_t free_fingerprint(size_t symbol_hash)
+{
+    return fingerprint_mix(2, symbol_hash);
+}
+
+[[nodiscard]]
+constexpr size_t abstraction_fingerprint(size_t body)
+{
+    return fingerprint_mix(3, body);
+}
+
+[[nodiscard]]
+constexpr size_t application_fingerprint(size_t function, size_t argument)
+{
+    return fingerprint_mix(fingerprint_mix(4, function), argument);
+}
+
+struct term_fingerprint
+{
+    size_t  hash;
+    size_t  nodes;
+    /**
+     * No free variables, not even global ones
+     */
+    bool    closed;
+
+    /**
+     * Fingerprints of alpha-equivalent terms are equal, equal ones may still
+     * belong to different terms
+     */
+    friend bool operator==(term_fingerprint const& lhs, term_fingerprint const& rhs)
+    {
+        return lhs.hash == rhs.hash && lhs.nodes == rhs.nodes && lhs.closed == rhs.closed;
+    }
+
+    friend bool operator!=(term_fingerprint const& lhs, term_fingerprint const& rhs)
+    {
+        return !(lhs == rhs);
+    }
+};
+
+/**
+ * What fingerprint_walk knows of a subterm
+ */
+struct subterm_info
+{
+    constexpr static size_t no_binder = std::numeric_limits<size_t>::max();
+
+    /**
+     * Fingerprint hash of the subterm where it stands: a variable bound above
+     * it is hashed by its distance to the binder, so this is the hash of the
+     * subterm alone only if it is self_contained
+     */
+    size_t  hash;
+    size_t  nodes;
+    /**
+     * Level of the outermost binder above the subterm which it refers to,
+     * no_binder for none
+     */
+    size_t  min_level;
+    /**
+     * Some variable is bound nowhere
+     */
+    bool    free_names;
+    /**
+     * No redex inside, looking through referrals
+     */
+    bool    normal;
+
+    /**
+     * No variable is bound above the subterm
+     */
+    [[nodiscard]]
+    bool self_contained() const
+    {
+        return min_level == no_binder;
+    }
+};
+
+/**
+ * Default callbacks of fingerprint_walk
+ */
+struct fingerprint_visitor
+{
+    /**
+     * Info of a referral target known beforehand, the target is not walked then
+     */
+    template<typename Record>
+    std::optional<subterm_info> known(Record&)
+    {
+        return std::nullopt;
+    }
+
+    /**
+     * Info of a self-contained subterm known beforehand, asked for every
+     * subterm before it is walked; the subterm is not walked then
+     */
+    template<typename Record>
+    std::optional<subterm_info> cached(Record&)
+    {
+        return std::nullopt;
+    }
+
+    /**
+     * Called once the subterm is done, after all of its children; it may
+     * replace the record held by owner
+     * @owner   pointer holding rec, null for the root and for referral targets
+     * @level   number of binders above rec
+     */
+    template<typename Record, typename Owner>
+    void subterm(Record&, Owner*, subterm_info const&, size_t)
+    {}
+};
+
+/**
+ * Post-order walk computing the subterm_info of every subterm bottom-up with
+ * an explicit stack, linear in the size of the term. A referral target is
+ * walked once for each number of binders above its occurrences, once in all
+ * if it is self-contained: the De Bruijn indices of its variables bound
+ * outside depend on nothing else, as the names of a renamed term are unique.
+ * @return  info of root
+ */
+template<typename Record, typename Visitor>
+subterm_info fingerprint_walk(Record& root, Visitor&& visitor)
+{
+    using owner_t = std::remove_reference_t<decltype(std::get<1>(root.node).args[0])>;
+
+    struct frame
+    {
+        Record*     rec;
+        owner_t*    owner;
+        uint8_t     stage;
+    };
+
+    // Binder levels of every name, innermost last
+    std::unordered_map<symbol_id, std::vector<size_t>> levels;
+    size_t level = 0;
+    // Infos of referral targets by the number of binders above the referral
+    std::unordered_map<Record const*, std::vector<std::pair<size_t, subterm_info>>> targets;
+
+    pooled_stack<frame> frames;
+    auto& stack = frames.items;
+    std::vector<subterm_info> infos;
+    stack.push_back({&root, nullptr, 0});
+
+    auto finish = [&] (subterm_info const& info)
+    {
+        auto const [rec, owner, stage] = stack.back();
+        stack.pop_back();
+        visitor.subterm(*rec, owner, info, level);
+    };
+
+    while (!stack.empty())
+    {
+        size_t const top = stack.size() - 1;
+        Record& rec = *stack[top].rec;
+
+        if (stack[top].stage == 0)
+            if (auto info = visitor.cached(rec))
+            {
+                assert(info->self_contained());
+                infos.push_back(*info);
+                finish(*info);
+                continue;
+            }
+
+        switch (rec.node.index())
+        {
+        case 0:
+        {
+            auto& var = std::get<0>(rec.node);
+            auto it = levels.find(var.id);
+            if (it != levels.end() && !it->second.empty())
+            {
+                size_t const binder = it->second.back();
+                infos.push_back({bound_fingerprint(level - 1 - binder), 1, binder, false, true});
+            }
+            else
+                infos.push_back({free_fingerprint(var.symbols->hash(var.id)), 1,
+                                 subterm_info::no_binder, true, true});
+
+            finish(infos.back());
+            break;
+        }
+        case 1:
+        {
+            auto& op = std::get<1>(rec.node);
+            if (op.tag == node_tag::FORALL)
+            {
+                auto const binder = std::get<0>(op.args[0]->node).id;
+                if (stack[top].stage++ == 0)
+                {
+                    levels[binder].push_back(level++);
+                    stack.push_back({op.args[1].get(), &op.args[1], 0});
+                    break;
+                }
+
+                levels[binder].pop_back();
+                level--;
+                auto& body = infos.back();
+                body = {abstraction_fingerprint(body.hash), body.nodes + 2,
+                        body.min_level >= level ? subterm_info::no_binder : body.min_level,
+                        body.free_names, body.normal};
+                finish(body);
+                break;
+            }
+
+            if (stack[top].stage < 2)
+            {
+                auto& arg = op.args[stack[top].stage++];
+                stack.push_back({arg.get(), &arg, 0});
+                break;
+            }
+
+            auto const rhs = infos.back();
+            infos.pop_back();
+            auto& lhs = infos.back();
+            lhs = {application_fingerprint(lhs.hash, rhs.hash),
+                   lhs.nodes + rhs.nodes + 1,
+                   std::min(lhs.min_level, rhs.min_level),
+                   lhs.free_names || rhs.free_names,
+                   lhs.normal && rhs.normal && !op.args[0]->has_node_tag(node_tag::FORALL)};
+            finish(lhs);
+            break;
+        }
+        case 2:
+        {
+            auto* target = std::get<2>(rec.node).get();
+            if (stack[top].stage++ != 0)
+            {
+                targets[target].emplace_back(level, infos.back());
+                finish(infos.back());
+                break;
+            }
+
+            std::optional<subterm_info> info = visitor.known(*target);
+            if (!info)
+                if (auto it = targets.find(target); it != targets.end())
+                    for (auto const& [seen_at, seen] : it->second)
+                        if (seen_at == level || seen.self_contained())
+                            info = seen;
+
+            if (info)
+            {
+                infos.push_back(*info);
+                finish(*info);
+            }
+            else
+                stack.push_back({target, nullptr, 0});
+            break;
+        }
+        default:
+            assert(false && "Unexpected node type!");
+            infos.push_back({0, 0, subterm_info::no_binder, false, false});
+            finish(infos.back());
+        }
+    }
+
+    assert(infos.size() == 1);
+    return infos.back();
+}
+
+/**
+ * What cache_fingerprints knows of a subterm, kept in its userdata as
+ * print_cache. The hash is kept only if the subterm was self-contained where
+ * it was walked, the hash of the others depends on the binders above them:
+ * for them it is only known that they are not closed.
+ *
+ * Whoever changes a node in place forgets the caches of the node and of its
+ * ancestors, reduction_context::contract forgets the ones below the redex.
+ * Copies of a rendering node do not take its cache, those of a
+ * fingerprint_userdata node do: a self-contained cache holds wherever the
+ * subterm stands, the others are not reused. It is kept in every node, so
+ * the size is cut to 32 bits to keep it as big as two words.
+ */
+struct fingerprint_cache
+{
+    void store(subterm_info const& info)
+    {
+        hash = info.hash;
+        nodes = static_cast<uint32_t>(std::min<size_t>(info.nodes, std::numeric_limits<uint32_t>::max()));
+        known = true;
+        // A bigger size does not fit, such a subterm is taken as not closed
+        self_contained = info.self_contained() && nodes == info.nodes;
+        free_names = info.free_names;
+        normal = info.normal;
+    }
+
+    /**
+     * Info of the subterm if it is the same wherever the subterm stands
+     */
+    [[nodiscard]]
+    std::optional<subterm_info> reusable() const
+    {
+        if (!known || !self_contained)
+            return std::nullopt;
+        return subterm_info{hash, nodes, subterm_info::no_binder, free_names, normal};
+    }
+
+    size_t      hash{0};
+    uint32_t    nodes{0};
+    bool        known{false};
+    bool        self_contained{false};
+    bool        free_names{false};
+    bool        normal{false};
+};
+
+/**
+ * Fills the fingerprint_cache of root and of every subterm in one bottom-up
+ * pass, subterms known already are not walked again
+ * @return  info of root
+ */
+template<typename UD>
+subterm_info cache_fingerprints(ast_record<UD> const& root)
+{
+    struct cacher : fingerprint_visitor
+    {
+        std::optional<subterm_info> cached(ast_record<UD> const& rec)
+        {
+            return rec.userdata.print_cache.reusable();
+        }
+
+        void subterm(ast_record<UD> const& rec, ast_record_ptr<UD> const*, subterm_info const& info, size_t)
+        {
+            rec.userdata.print_cache.store(info);
+        }
+    } visitor;
+
+    return fingerprint_walk(root, visitor);
+}
+
+/**
+ * Fingerprint of root if it has no free variables, O(1) once root's
+ * fingerprint_cache is known
+ */
+template<typename UD>
+std::optional<term_fingerprint> closed_fingerprint(ast_record<UD> const& root)
+{
+    auto const& cache = root.userdata.print_cache;
+    if (!cache.known)
+        cache_fingerprints(root);
+
+    if (!cache.self_contained || cache.free_names)
+        return std::nullopt;
+    return term_fingerprint{cache.hash, cache.nodes, true};
+}
+
+/**
+ * Forgets the fingerprint_cache of rec and of its subtree which is not behind a referral
+ */
+template<typename UD>
+void forget_fingerprints(ast_record<UD>& rec)
+{
+    preorder_walk(rec, [] (ast_record<UD>& cur)
+    {
+        cur.userdata.print_cache.known = false;
+        return cur.node.index() == 2 ? walk_action::SKIP : walk_action::DESCEND;
+    });
+}
+
+/**
+ * The canonical alpha-invariant hash of a term, used by every tool which
+ * compares terms: bound variables are hashed by their De Bruijn index and
+ * free ones by symbol, so alpha-equivalent terms get the same hash.
+ * Referrals are looked through. One fingerprint_walk, linear in the size of
+ * the term; terms with fingerprint_userdata keep it, see there.
+ */
+template<typename UD>
+term_fingerprint fingerprint(ast_record<UD> const& root)
+{
+    auto const info = fingerprint_walk(root, fingerprint_visitor{});
+    return {info.hash, info.nodes, !info.free_names};
+}
+
+/**
+ * Alpha-equivalence with free variables compared by symbol, in one walk
+ * over both terms with an explicit stack. Referrals are looked through,
+ * a target reached from both sides under the same binders is not walked.
+ * @env_lhs and @env_rhs hold the enclosing binders, innermost last.
+ */
+template<typename UD>
+bool alpha_equivalent(ast_record<UD> const& lhs, ast_record<UD> const& rhs,
+                      std::vector<symbol_id>& env_lhs, std::vector<symbol_id>& env_rhs)
+{
+    /**
+     * Pair of subterms to compare and the number of binders above them
+     */
+    struct frame
+    {
+        ast_record<UD> const*   lhs;
+        ast_record<UD> const*   rhs;
+        size_t                  depth;
+    };
+
+    // Positions in the environment of every binder of a name, innermost last
+    using levels_t = std::unordered_map<symbol_id, std::vector<size_t>>;
+
+    auto unwind = [] (levels_t& levels, std::vector<symbol_id>& env, size_t size)
+    {
+        for (; env.size() > size; env.pop_back())
+            levels[env.back()].pop_back();
+    };
+
+    auto bind = [] (levels_t& levels, std::vector<symbol_id>& env, symbol_id name)
+    {
+        levels[name].push_back(env.size());
+        env.push_back(name);
+    };
+
+    /**
+     * Distance from the variable to its binder, 0 for the innermost one, or nullopt if it is free
+     */
+    auto distance = [] (levels_t const& levels, std::vector<symbol_id> const& env, symbol_id name)
+            -> std::optional<size_t>
+    {
+        auto it = levels.find(name);
+        if (it == levels.end() || it->second.empty())
+            return std::nullopt;
+        return env.size() - 1 - it->second.back();
+    };
+
+    size_t const base_lhs = env_lhs.size();
+    size_t const base_rhs = env_rhs.size();
+    levels_t levels_lhs, levels_rhs;
+    for (size_t i = 0; i < base_lhs; ++i)
+        levels_lhs[env_lhs[i]].push_back(i);
+    for (size_t i = 0; i < base_rhs; ++i)
+        levels_rhs[env_rhs[i]].push_back(i);
+
+    pooled_stack<frame> pending;
+    auto& stack = pending.items;
+    stack.push_back({&lhs, &rhs, 0});
+    bool equivalent = true;
+
+    while (equivalent && !stack.empty())
+    {
+        auto [l, r, depth] = stack.back();
+        stack.pop_back();
+        unwind(levels_lhs, env_lhs, base_lhs + depth);
+        unwind(levels_rhs, env_rhs, base_rhs + depth);
+
+        while (l->node.index() == 2)
+            l = std::get<2>(l->node).get();
+        while (r->node.index() == 2)
+            r = std::get<2>(r->node).get();
+
+        if (l == r && env_lhs == env_rhs)
+            continue;
+
+        if (l->node.index() != r->node.index())
+        {
+            equivalent = false;
+            break;
+        }
+
+        switch (l->node.index())
+        {
+        case 0:
+        {
+            auto const lhs_id = std::get<0>(l->node).id;
+            auto const rhs_id = std::get<0>(r->node).id;
+            auto const lhs_distance = distance(levels_lhs, env_lhs, lhs_id);
+            auto const rhs_distance = distance(levels_rhs, env_rhs, rhs_id);
+
+            if (lhs_distance || rhs_distance)
+                equivalent = lhs_distance == rhs_distance;
+            else
+                equivalent = lhs_id == rhs_id;
+            break;
+        }
+        case 1:
+        {
+            auto& lhs_op = std::get<1>(l->node);
+            auto& rhs_op = std::get<1>(r->node);
+            if (lhs_op.tag != rhs_op.tag)
+            {
+                equivalent = false;
+                break;
+            }
+
+            if (lhs_op.tag == node_tag::APPLICATION)
+            {
+                stack.push_back({lhs_op.args[1].get(), rhs_op.args[1].get(), depth});
+                stack.push_back({lhs_op.args[0].get(), rhs_op.args[0].get(), depth});
+                break;
+            }
+
+            bind(levels_lhs, env_lhs, std::get<0>(lhs_op.args[0]->node).id);
+            bind(levels_rhs, env_rhs, std::get<0>(rhs_op.args[0]->node).id);
+            stack.push_back({lhs_op.args[1].get(), rhs_op.args[1].get(), depth + 1});
+            break;
+        }
+        default:
+            assert(false && "Unexpected node type!");
+            equivalent = false;
+        }
+    }
+
+    unwind(levels_lhs, env_lhs, base_lhs);
+    unwind(levels_rhs, env_rhs, base_rhs);
+    return equivalent;
+}
+
+template<typename UD>
+bool alpha_equivalent(ast_record<UD> const& lhs, ast_record<UD> const& rhs)
+{
+    if (&lhs == &rhs)
+        return true;
+
+    std::vector<symbol_id> env_lhs, env_rhs;
+    return alpha_equivalent(lhs, rhs, env_lhs, env_rhs);
+}
+
+/**
+ * alpha_equivalent of terms whose fingerprints are kept by the caller:
+ * different fingerprints tell the terms apart in O(1), only equal ones
+ * are compared by the walk
+ */
+template<typename UD>
+bool alpha_equivalent(ast_record<UD> const& lhs, term_fingerprint const& lhs_print,
+                      ast_record<UD> const& rhs, term_fingerprint const& rhs_print)
+{
+    if (lhs_print != rhs_print)
+        return false;
+    if (&lhs == &rhs)
+        return true;
+
+    std::vector<symbol_id> env_lhs, env_rhs;
+    return alpha_equivalent(lhs, rhs, env_lhs, env_rhs);
+}
+
+/**
+ * Keeps the fingerprint of each node, filled by the first fingerprint
+ * call on the node or on one of its ancestors. Terms of this userdata are
+ * not changed in place, or the changes forget the caches as
+ * fingerprint_cache says.
+ */
+struct fingerprint_userdata
+{
+    explicit fingerprint_userdata([[maybe_unused]] ast_record<fingerprint_userdata>* owner)
+    {
+        assert(&owner->userdata == this);
+    };
+
+    mutable fingerprint_cache   print_cache;
+};
+
+/**
+ * fingerprint of a term keeping the fingerprints of its subterms, O(1) once
+ * the term, or an ancestor binding none of its free variables, has been
+ * fingerprinted
+ */
+inline term_fingerprint fingerprint(ast_record<fingerprint_userdata> const& root)
+{
+    auto const& cache = root.userdata.print_cache;
+    if (cache.known && cache.self_contained)
+        return {cache.hash, cache.nodes, !cache.free_names};
+
+    // Names bound above a subterm walked on its own are taken as free, so only closed subterms are reused
+    struct cacher : fingerprint_visitor
+    {
+        std::optional<subterm_info> cached(ast_record<fingerprint_userdata> const& rec)
+        {
+            auto info = rec.userdata.print_cache.reusable();
+            if (info && info->free_names)
+                return std::nullopt;
+            return info;
+        }
+
+        void subterm(ast_record<fingerprint_userdata> const& rec, ast_record_ptr<fingerprint_userdata> const*,
+                     subterm_info const& info, size_t)
+        {
+            rec.userdata.print_cache.store(info);
+        }
+    } visitor;
+
+    auto const info = fingerprint_walk(root, visitor);
+    return {info.hash, info.nodes, !info.free_names};
+}
+
+/**
+ * alpha_equivalent telling terms with different kept fingerprints apart in O(1)
+ */
+inline bool alpha_equivalent(ast_record<fingerprint_userdata> const& lhs,
+                             ast_record<fingerprint_userdata> const& rhs)
+{
+    return alpha_equivalent(lhs, fingerprint(lhs), rhs, fingerprint(rhs));
+}
+
+/**
+ * Shares alpha-equivalent closed subterms in normal form.
+ *
+ * Every such subterm of at least min_nodes nodes is moved into the table and
+ * replaced with a referral, later copies are replaced with a referral to the
+ * first one. Only normal forms are shared since task2's reducer contracts
+ * redexes inside a referral for all of its occurrences at once; a closed
+ * normal form never changes, so sharing it does not change the reduction.
+ */
+template<typename UD>
+class hash_cons_table
+{
+public:
+    explicit hash_cons_table(size_t min_nodes = 16)
+            : min_nodes(min_nodes)
+    {}
+
+    /**
+     * Deduplicates the term against the table, children before their parents
+     * @return  Number of subterms replaced with a referral
+     */
+    size_t intern(ast_record_ptr<UD>& root)
+    {
+        struct sharer : fingerprint_visitor
+        {
+            std::optional<subterm_info> known(ast_record<UD>& target)
+            {
+                if (auto it = table.canonical.find(&target); it != table.canonical.end())
+                    return it->second;
+                return std::nullopt;
+            }
+
+            void subterm(ast_record<UD>&, ast_record_ptr<UD>* owner, subterm_info const& info, size_t)
+            {
+                if (owner != nullptr)
+                    table.share(*owner, info);
+            }
+
+            hash_cons_table&    table;
+        } visitor{{}, *this};
+
+        replaced = 0;
+        auto const info = fingerprint_walk(*root, visitor);
+        share(root, info);
+        return replaced;
+    }
+
+    /**
+     * Drops the entries which are not referred from any term anymore
+     */
+    size_t collect()
+    {
+        size_t dropped = 0;
+        for (auto it = entries.begin(); it != entries.end();)
+        {
+            if (sole_owner(it->second))
+            {
+                canonical.erase(it->second.get());
+                it = entries.erase(it);
+                dropped++;
+            }
+            else
+                ++it;
+        }
+
+        return dropped;
+    }
+
+    [[nodiscard]]
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+    /**
+     * Drops every entry, terms keep the nodes they refer to
+     */
+    void clear()
+    {
+        entries.clear();
+        canonical.clear();
+    }
+
+private:
+    void share(ast_record_ptr<UD>& rec_ptr, subterm_info const& info)
+    {
+        if (!info.normal
+            || info.nodes < min_nodes
+            || !info.self_contained())
+            return;
+
+        if (rec_ptr->node.index() == 2 && canonical.count(std::get<2>(rec_ptr->node).get()))
+            return;
+
+        auto range = entries.equal_range(info.hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            // Same hash, the node counts tell most other terms apart before the walk
+            if (canonical.at(it->second.get()).nodes == info.nodes
+                && alpha_equivalent(*it->second, *rec_ptr))
+            {
+                rec_ptr = make_record<UD>(ast_node<UD>{it->second});
+                replaced++;
+                return;
+            }
+        }
+
+        if (rec_ptr->node.index() == 2)
+        {
+            // Already shared by the reducer, the target itself becomes the entry
+            auto const& target = std::get<2>(rec_ptr->node);
+            canonical.emplace(target.get(), info);
+            entries.emplace(info.hash, target);
+            return;
+        }
+
+        std::shared_ptr<ast_record<UD>> stored = std::move(rec_ptr);
+        canonical.emplace(stored.get(), info);
+        entries.emplace(info.hash, stored);
+        rec_ptr = make_record<UD>(ast_node<UD>{std::move(stored)});
+    }
+
+    size_t                                                          min_nodes;
+    size_t                                                          replaced{0};
+    std::unordered_multimap<size_t, std::shared_ptr<ast_record<UD>>> entries;
+    std::unordered_map<ast_record<UD> const*, subterm_info>         canonical;
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <string_view>
+#include <vector>
+
+/**
+ * Whole input of a file descriptor as one string_view. Regular files are
+ * mapped to memory and parsed in place, anything else (pipes, terminals) is
+ * read into a buffer which grows as needed.
+ */
+class input_buffer
+{
+public:
+    explicit input_buffer(int fd = STDIN_FILENO)
+            : fd(fd)
+    {}
+
+    input_buffer(input_buffer const&) = delete;
+    input_buffer& operator=(input_buffer const&) = delete;
+
+    ~input_buffer()
+    {
+        if (mapping != MAP_FAILED)
+            munmap(mapping, mapping_size);
+    }
+
+    /**
+     * Reads everything up to the end of input, starting at the current offset
+     * @return  false if reading failed, errno tells why
+     */
+    bool load()
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            auto const offset = lseek(fd, 0, SEEK_CUR);
+            if (offset >= 0 && offset <= st.st_size)
+            {
+                mapping_size = static_cast<size_t>(st.st_size);
+                mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping != MAP_FAILED)
+                {
+                    madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+                    auto const skip = static_cast<size_t>(offset);
+                    contents = {static_cast<char const*>(mapping) + skip, mapping_size - skip};
+                    return true;
+                }
+            }
+        }
+
+        return read_all();
+    }
+
+    [[nodiscard]]
+    std::string_view view() const
+    {
+        return contents;
+    }
+
+private:
+    bool read_all()
+    {
+        size_t sz = 0;
+        buffer.resize(64 * 1024);
+
+        while (true)
+        {
+            if (sz == buffer.size())
+                buffer.resize(buffer.size() * 2);
+
+            auto const rd = read(fd, buffer.data() + sz, buffer.size() - sz);
+            if (rd < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+
+            if (rd == 0) break;
+
+            sz += static_cast<size_t>(rd);
+        }
+
+        contents = {buffer.data(), sz};
+        return true;
+    }
+
+    int                 fd;
+    void*               mapping{MAP_FAILED};
+    size_t              mapping_size{0};
+    std::vector<char>   buffer;
+    std::string_view    contents;
+};
+
+/**
+ * Input of task2: the numbers m and k, then the term on the first non-blank line after them
+ */
+struct task_input
+{
+    /**
+     * Number of reductions
+     */
+    size_t              m;
+    /**
+     * Output lambda after each k reductions
+     */
+    size_t              k;
+    std::string_view    term;
+    /**
+     * Input after the line of the term, where the next task of a batch starts
+     */
+    std::string_view    rest;
+};
+
+/**
+ * @return  false if m or k is missing
+ */
+[[nodiscard]]
+inline bool split_task_input(std::string_view input, task_input& result)
+{
+    auto read_number = [&input] (size_t& value)
+    {
+        while (!input.empty() && std::isspace(static_cast<unsigned char>(input.front())))
+            input.remove_prefix(1);
+
+        auto const [end, err] = std::from_chars(input.data(), input.data() + input.size(), value);
+        if (err != std::errc())
+            return false;
+
+        input.remove_prefix(static_cast<size_t>(end - input.data()));
+        return true;
+    };
+
+    if (!read_number(result.m) || !read_number(result.k))
+        return false;
+
+    // The rest of the line with k counts as the first line
+    while (!input.empty())
+    {
+        auto const line = input.substr(0, input.find('\n'));
+        for (char c : line)
+            if (!std::isspace(static_cast<unsigned char>(c)))
+            {
+                result.term = line;
+                result.rest = input.substr(std::min(line.size() + 1, input.size()));
+                return true;
+            }
+
+        input.remove_prefix(std::min(line.size() + 1, input.size()));
+    }
+
+    result.term = {};
+    result.rest = {};
+    return true;
+}
@@ -0,0 +1,1112 @@
+#pragma once
+
+#include "lambdas.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Optimal reduction with Lamping's algorithm.
+ *
+ * The term is encoded as an interaction net of abstractions, applications,
+ * fans, croissants, brackets, erasers and free variables. Every node but
+ * erasers and free variables has a level: the number of arguments around the
+ * subterm it comes from. Croissants and brackets are the oracle, a node going
+ * through a croissant gets one level lower and through a bracket one higher,
+ * as if it left or entered an argument. Nodes of one kind and level
+ * annihilate, an abstraction and an application of one level make a beta
+ * step and the others commute, the node with the higher level going through
+ * the other one. Beta steps never copy a subterm: a shared argument is
+ * duplicated incrementally, only as far as its uses differ.
+ *
+ * Read back walks the paths of the net with the context semantics of
+ * Gonthier, Abadi and Lévy: a context holds a stack for each level, fans
+ * push and pop the side they were entered at, croissants add and remove a
+ * level, brackets pair two levels and split them again. Reduction walks the
+ * same paths to find the redexes needed next.
+ *
+ * The uses of a variable are joined by a balanced tree of fans of its
+ * binder's level, each of them with one bracket node standing for the
+ * brackets of all the arguments between it and the binder, and a free
+ * variable is a node of its own at each use. The net is thus linear in the
+ * size of the term, and so are the paths from the uses up to the binders.
+ * Contexts only keep the levels something is known about, and read back
+ * looks for the binder of a use among the instances of its abstraction
+ * only.
+ */
+class interaction_net
+{
+public:
+    enum class node_kind : uint8_t
+    {
+        ROOT,
+        LAMBDA,
+        APPLICATION,
+        FAN,
+        CROISSANT,
+        BRACKET,
+        ERASER,
+        FREE
+    };
+
+    /**
+     * Node index * 4 + slot. Slot 0 is the principal port; abstractions have
+     * the body at 1 and the variable at 2, applications the argument at 1
+     * and the result at 2, fans their two auxiliary ports at 1 and 2,
+     * croissants and brackets their one at 1
+     */
+    using port = uint32_t;
+
+    constexpr static port unlinked = ~port{0};
+
+    struct reduction_stats
+    {
+        size_t  rounds{0};
+        size_t  interactions{0};
+        size_t  betas{0};
+    };
+
+    template<typename UD>
+    interaction_net(ast_record<UD> const& rec, symbol_table const& symbols)
+            : symbols(symbols)
+    {
+        size_t const root = alloc(node_kind::ROOT);
+        auto term = encode(rec);
+        link(make_port(root, 0), term.value);
+
+        // Nothing binds these, so each use becomes a free variable in place of its croissant
+        for (auto const& [id, uses] : term.variables)
+            for (size_t const croissant : uses)
+            {
+                port const use = nodes[croissant].ports[1];
+                nodes[croissant] = {node_kind::FREE, id, {unlinked, unlinked, unlinked}, 1};
+                link(make_port(croissant, 0), use);
+            }
+    }
+
+    /**
+     * Rewrites the active pairs needed for the normal form, all of them at
+     * once in each round, until there are none. Arguments are only reduced
+     * once the head normal form around them is reached, so a diverging
+     * argument which gets erased is never run.
+     *
+     * @return  false if two nodes met which the encoding of a term never
+     *          brings together; the net is left as it was then
+     */
+    bool normalize()
+    {
+        while (reduce_round())
+        {}
+
+        return consistent;
+    }
+
+    /**
+     * @return  null if the net is not normal or a path of it has no term
+     *          behind it, which takes a net broken like in normalize
+     */
+    template<typename UD>
+    ast_record_ptr<UD> read_back() const
+    {
+        struct frame
+        {
+            port                    at;
+            context_levels          levels;
+            /**
+             * Binder instances in scope
+             */
+            size_t                  binders;
+            bool                    entered;
+            node_tag                tag;
+            symbol_id               name;
+            port                    argument;
+        };
+
+        path_context context;
+        std::vector<binder_instance> binders;
+        // Indices in binders of the instances of each abstraction, innermost last
+        std::unordered_map<size_t, std::vector<size_t>> instances;
+        std::vector<frame> frames;
+        std::vector<ast_record_ptr<UD>> done;
+        frames.push_back({nodes[0].ports[0], {}, 0, false, node_tag::APPLICATION, 0, unlinked});
+
+        while (!frames.empty())
+        {
+            auto& current = frames.back();
+
+            if (current.entered && current.tag == node_tag::APPLICATION && current.argument != unlinked)
+            {
+                port const argument = std::exchange(current.argument, unlinked);
+                size_t const in_scope = current.binders;
+                auto levels = std::move(current.levels);
+                frames.push_back({argument, std::move(levels), in_scope, false, node_tag::APPLICATION, 0, unlinked});
+                continue;
+            }
+
+            if (current.entered)
+            {
+                auto rhs = std::move(done.back());
+                done.pop_back();
+                auto lhs = current.tag == node_tag::FORALL
+                           ? make_record<UD>(variable_t{current.name, &symbols})
+                           : std::move(done.back());
+                if (current.tag == node_tag::APPLICATION)
+                    done.pop_back();
+
+                done.push_back(make_record<UD>(binary_operation(current.tag, std::move(lhs), std::move(rhs))));
+                frames.pop_back();
+                continue;
+            }
+
+            while (binders.size() > current.binders)
+            {
+                instances[binders.back().node].pop_back();
+                binders.pop_back();
+            }
+            if (context.walk(*this, current.at, current.levels, nullptr) != walk_result::VALUE)
+                return {nullptr};
+
+            size_t const index = index_of(current.at);
+            auto const& value = nodes[index];
+            uint8_t const slot = slot_of(current.at);
+
+            if (value.kind == node_kind::FREE)
+            {
+                done.push_back(make_record<UD>(variable_t{value.data, &symbols}));
+                frames.pop_back();
+            }
+            else if (value.kind == node_kind::LAMBDA && slot == 2)
+            {
+                auto const* binder = find_binder(binders, instances, index, current.levels);
+                if (binder == nullptr)
+                    return {nullptr};
+
+                done.push_back(make_record<UD>(variable_t{binder->name, &symbols}));
+                frames.pop_back();
+            }
+            else if (value.kind == node_kind::LAMBDA && slot == 0)
+            {
+                // The same abstraction may be read again through a fan, under other binders
+                auto const name = symbol_table::generated(binders.size());
+                instances[index].push_back(binders.size());
+                binders.push_back({index, current.levels.below(value.data), name});
+
+                current.entered = true;
+                current.tag = node_tag::FORALL;
+                current.name = name;
+                auto levels = std::move(current.levels);
+                frames.push_back({value.ports[1], std::move(levels), binders.size(), false,
+                                  node_tag::APPLICATION, 0, unlinked});
+            }
+            else if (value.kind == node_kind::APPLICATION && slot == 2)
+            {
+                current.entered = true;
+                current.tag = node_tag::APPLICATION;
+                current.argument = value.ports[1];
+                auto levels = current.levels;
+                size_t const in_scope = current.binders;
+                frames.push_back({value.ports[0], std::move(levels), in_scope, false,
+                                  node_tag::APPLICATION, 0, unlinked});
+            }
+            else
+            {
+                return {nullptr};
+            }
+        }
+
+        return std::move(done.back());
+    }
+
+    [[nodiscard]]
+    reduction_stats const& stats() const
+    {
+        return stats_;
+    }
+
+private:
+    struct node
+    {
+        node_kind   kind;
+        /**
+         * Level of the node, symbol of a free variable
+         */
+        size_t      data;
+        port        ports[3];
+        /**
+         * Number of brackets of a chain this bracket stands for, one level
+         * above the other from the principal port on
+         */
+        uint32_t    span;
+    };
+
+    /**
+     * Value of a subterm and its free variables, each with the croissants
+     * of its uses
+     */
+    struct encoded
+    {
+        port                                                    value;
+        std::unordered_map<symbol_id, std::vector<size_t>>      variables;
+    };
+
+    /**
+     * The levels of a context which something is known about, the others
+     * are left out. A context deep in the net is thus only as large as what
+     * its path has been through.
+     */
+    class context_levels
+    {
+        using entry = std::pair<size_t, size_t>;
+
+    public:
+        /**
+         * Id of a level nothing is known about
+         */
+        constexpr static size_t unknown = 0;
+
+        [[nodiscard]]
+        size_t get(size_t level) const
+        {
+            auto it = find(level);
+            return it != known.end() && it->first == level ? it->second : unknown;
+        }
+
+        void set(size_t level, size_t id)
+        {
+            auto it = find(level);
+            bool const present = it != known.end() && it->first == level;
+            if (present && id == unknown)
+                known.erase(it);
+            else if (present)
+                it->second = id;
+            else if (id != unknown)
+                known.insert(it, {level, id});
+        }
+
+        /**
+         * Adds count unknown levels at level, the ones from there on go up
+         */
+        void insert(size_t level, size_t count)
+        {
+            for (auto it = find(level); it != known.end(); ++it)
+                it->first += count;
+        }
+
+        /**
+         * Removes count levels at level, the ones above go down
+         */
+        void erase(size_t level, size_t count)
+        {
+            auto it = known.erase(find(level), find(level + count));
+            for (; it != known.end(); ++it)
+                it->first -= count;
+        }
+
+        /**
+         * @return  one past the highest known level in [begin, end), begin
+         *          if none of them is known
+         */
+        [[nodiscard]]
+        size_t known_end(size_t begin, size_t end) const
+        {
+            auto it = find(end);
+            return it != known.begin() && std::prev(it)->first >= begin ? std::prev(it)->first + 1 : begin;
+        }
+
+        [[nodiscard]]
+        bool known_from(size_t level) const
+        {
+            return !known.empty() && known.back().first >= level;
+        }
+
+        [[nodiscard]]
+        context_levels below(size_t level) const
+        {
+            context_levels result;
+            result.known.assign(known.begin(), find(level));
+            return result;
+        }
+
+        /**
+         * @return  whether the levels below level are the ones of instance
+         */
+        [[nodiscard]]
+        bool agrees_below(context_levels const& instance, size_t level) const
+        {
+            return std::equal(known.begin(), find(level), instance.known.begin(), instance.known.end());
+        }
+
+    private:
+        [[nodiscard]]
+        std::vector<entry>::const_iterator find(size_t level) const
+        {
+            return std::lower_bound(known.begin(), known.end(), level,
+                                    [] (entry const& e, size_t l) { return e.first < l; });
+        }
+
+        std::vector<entry>::iterator find(size_t level)
+        {
+            return std::lower_bound(known.begin(), known.end(), level,
+                                    [] (entry const& e, size_t l) { return e.first < l; });
+        }
+
+        /**
+         * Level and id of its contents, by level
+         */
+        std::vector<entry>  known;
+    };
+
+    struct binder_instance
+    {
+        size_t                  node;
+        /**
+         * Levels of the context below the one of the abstraction, which
+         * tell its instances apart
+         */
+        context_levels          levels;
+        symbol_id               name;
+    };
+
+    enum class walk_result : uint8_t
+    {
+        VALUE,
+        ACTIVE_PAIR,
+        BROKEN
+    };
+
+    struct spine_entry
+    {
+        size_t                  app;
+        context_levels          levels;
+    };
+
+    /**
+     * Contents of context levels, interned so that equal ones have equal
+     * ids. A level is a stack of fan sides on top of either nothing known or
+     * a pair of two levels a bracket has merged.
+     */
+    class path_context
+    {
+        enum class cell_kind : uint8_t
+        {
+            LEFT,
+            RIGHT,
+            PAIR
+        };
+
+        struct cell
+        {
+            cell_kind   kind;
+            size_t      lhs;
+            size_t      rhs;
+            /**
+             * The cells with a left and a right side on top of this one, so
+             * that fans need no hashing
+             */
+            size_t      sides[2]{};
+
+            bool operator==(cell const& other) const
+            {
+                return kind == other.kind && lhs == other.lhs && rhs == other.rhs;
+            }
+        };
+
+        struct cell_hash
+        {
+            size_t operator()(cell const& c) const
+            {
+                return std::hash<size_t>()(c.lhs * 31 + c.rhs) * 3 + static_cast<size_t>(c.kind);
+            }
+        };
+
+    public:
+        constexpr static size_t unknown = context_levels::unknown;
+
+        /**
+         * Follows at through fans, croissants and brackets, and through the
+         * functions of applications when spine is given, to an abstraction,
+         * an application or a variable. Each application walked through is
+         * added to spine with the context of its argument.
+         *
+         * @return  ACTIVE_PAIR with at on the principal port of a node of a
+         *          pair on the way, BROKEN if a fan or a bracket entered at
+         *          its principal port finds no side or no pair on its level
+         */
+        walk_result walk(interaction_net const& net, port& at, context_levels& levels,
+                         std::vector<spine_entry>* spine)
+        {
+            while (true)
+            {
+                size_t const index = index_of(at);
+                auto const& current = net.nodes[index];
+                size_t const level = current.data;
+                bool const upwards = slot_of(at) != 0;
+
+                switch (current.kind)
+                {
+                case node_kind::FAN:
+                {
+                    size_t const side = levels.get(level);
+                    if (upwards)
+                    {
+                        levels.set(level, push(slot_of(at) == 1 ? cell_kind::LEFT : cell_kind::RIGHT, side));
+                        break;
+                    }
+
+                    if (side == unknown || cells[side].kind == cell_kind::PAIR)
+                        return walk_result::BROKEN;
+
+                    at = current.ports[cells[side].kind == cell_kind::LEFT ? 1 : 2];
+                    levels.set(level, cells[side].lhs);
+                    continue;
+                }
+                case node_kind::CROISSANT:
+                    if (upwards)
+                    {
+                        levels.insert(level, 1);
+                        break;
+                    }
+
+                    levels.erase(level, 1);
+                    at = current.ports[1];
+                    continue;
+                case node_kind::BRACKET:
+                    if (upwards)
+                    {
+                        fold(levels, level, current.span);
+                        break;
+                    }
+
+                    if (!unfold(levels, level, current.span))
+                        return walk_result::BROKEN;
+                    at = current.ports[1];
+                    continue;
+                case node_kind::APPLICATION:
+                    if (spine == nullptr || slot_of(at) != 2)
+                        return walk_result::VALUE;
+
+                    spine->push_back({index, levels});
+                    break;
+                default:
+                    return walk_result::VALUE;
+                }
+
+                // Left through the principal port, which may face another one
+                port const next = current.ports[0];
+                if (slot_of(next) == 0 && interacts(current.kind, net.nodes[index_of(next)].kind))
+                {
+                    at = make_port(index, 0);
+                    return walk_result::ACTIVE_PAIR;
+                }
+                at = next;
+            }
+        }
+
+    private:
+        /**
+         * A chain of span brackets entered at its auxiliary port pairs each
+         * level with the one above, from the top one down
+         */
+        void fold(context_levels& levels, size_t level, size_t span)
+        {
+            size_t merged = unknown;
+            for (size_t i = levels.known_end(level, level + span + 1); i-- > level;)
+                merged = i == level + span ? levels.get(i) : pair(levels.get(i), merged);
+
+            levels.erase(level + 1, span);
+            levels.set(level, merged);
+        }
+
+        /**
+         * And entered at its principal port splits them again, from the
+         * bottom one up. Unknown levels split into unknown ones, so this
+         * stops at the highest known level.
+         */
+        bool unfold(context_levels& levels, size_t level, size_t span)
+        {
+            for (size_t i = level; i < level + span && levels.known_from(i); ++i)
+            {
+                size_t const merged = levels.get(i);
+                if (merged != unknown && cells[merged].kind != cell_kind::PAIR)
+                    return false;
+
+                levels.insert(i + 1, 1);
+                levels.set(i, cells[merged].lhs);
+                levels.set(i + 1, cells[merged].rhs);
+            }
+
+            return true;
+        }
+
+        size_t pair(size_t lhs, size_t rhs)
+        {
+            // Splitting an unknown level gives two unknown ones
+            if (lhs == unknown && rhs == unknown)
+                return unknown;
+
+            return intern({cell_kind::PAIR, lhs, rhs});
+        }
+
+        size_t push(cell_kind side, size_t below)
+        {
+            size_t const slot = side == cell_kind::LEFT ? 0 : 1;
+            if (cells[below].sides[slot] == unknown)
+            {
+                cells[below].sides[slot] = cells.size();
+                cells.push_back({side, below, unknown});
+            }
+            return cells[below].sides[slot];
+        }
+
+        size_t intern(cell const& c)
+        {
+            auto [it, inserted] = ids.try_emplace(c, cells.size());
+            if (inserted)
+                cells.push_back(c);
+            return it->second;
+        }
+
+        std::vector<cell>                           cells{{cell_kind::PAIR, unknown, unknown}};
+        std::unordered_map<cell, size_t, cell_hash> ids;
+    };
+
+    [[nodiscard]]
+    constexpr static port make_port(size_t index, uint8_t slot)
+    {
+        return static_cast<port>(index * 4 + slot);
+    }
+
+    [[nodiscard]]
+    constexpr static size_t index_of(port p)
+    {
+        return p / 4;
+    }
+
+    [[nodiscard]]
+    constexpr static uint8_t slot_of(port p)
+    {
+        return p % 4;
+    }
+
+    [[nodiscard]]
+    constexpr static size_t arity(node_kind kind)
+    {
+        switch (kind)
+        {
+        case node_kind::LAMBDA:
+        case node_kind::APPLICATION:
+        case node_kind::FAN:
+            return 2;
+        case node_kind::CROISSANT:
+        case node_kind::BRACKET:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    [[nodiscard]]
+    constexpr static bool is_control(node_kind kind)
+    {
+        return kind == node_kind::FAN || kind == node_kind::CROISSANT || kind == node_kind::BRACKET;
+    }
+
+    size_t alloc(node_kind kind, size_t data = 0, uint32_t span = 1)
+    {
+        size_t index;
+        if (!free_nodes.empty())
+        {
+            index = free_nodes.back();
+            free_nodes.pop_back();
+        }
+        else
+        {
+            index = nodes.size();
+            nodes.emplace_back();
+        }
+
+        nodes[index] = {kind, data, {unlinked, unlinked, unlinked}, span};
+        return index;
+    }
+
+    void release(size_t index)
+    {
+        free_nodes.push_back(index);
+    }
+
+    [[nodiscard]]
+    port partner(port p) const
+    {
+        return nodes[index_of(p)].ports[slot_of(p)];
+    }
+
+    void link(port a, port b)
+    {
+        nodes[index_of(a)].ports[slot_of(a)] = b;
+        nodes[index_of(b)].ports[slot_of(b)] = a;
+    }
+
+    /**
+     * Links the ports which were connected to a and b, the nodes of a and b go away
+     */
+    void fuse(port a, port b)
+    {
+        link(partner(a), partner(b));
+    }
+
+    /**
+     * Lamping's encoding, post-order with an explicit stack. A variable is a
+     * croissant of its level; its uses are only collected up to its binder,
+     * which shares them.
+     */
+    template<typename UD>
+    encoded encode(ast_record<UD> const& root)
+    {
+        struct frame
+        {
+            ast_record<UD> const*   rec;
+            size_t                  level;
+            bool                    entered;
+        };
+
+        std::vector<frame> frames{{&root, 0, false}};
+        std::vector<encoded> done;
+
+        while (!frames.empty())
+        {
+            auto& current = frames.back();
+            size_t const level = current.level;
+
+            // A referral is read through, its target is encoded for each of them
+            auto const* rec = current.rec;
+            while (rec->node.index() == 2)
+                rec = std::get<2>(rec->node).get();
+
+            if (rec->node.index() == 0)
+            {
+                frames.pop_back();
+                size_t const croissant = alloc(node_kind::CROISSANT, level);
+                done.push_back({make_port(croissant, 1), {}});
+                done.back().variables[std::get<0>(rec->node).id].push_back(croissant);
+                continue;
+            }
+
+            auto const& op = std::get<1>(rec->node);
+            if (!current.entered)
+            {
+                current.entered = true;
+                if (op.tag == node_tag::APPLICATION)
+                    frames.push_back({op.args[1].get(), level + 1, false});
+                frames.push_back({op.args[op.tag == node_tag::APPLICATION ? 0 : 1].get(), level, false});
+                continue;
+            }
+
+            frames.pop_back();
+            if (op.tag == node_tag::APPLICATION)
+            {
+                auto argument = std::move(done.back());
+                done.pop_back();
+                encode_application(done.back(), argument, level);
+            }
+            else
+            {
+                assert(op.args[0]->node.index() == 0);
+                encode_abstraction(done.back(), std::get<0>(op.args[0]->node).id, level);
+            }
+        }
+
+        return std::move(done.back());
+    }
+
+    void encode_application(encoded& function, encoded& argument, size_t level)
+    {
+        // The smaller of each two goes into the larger one, so a use is moved a logarithmic number of times
+        if (function.variables.size() < argument.variables.size())
+            std::swap(function.variables, argument.variables);
+        for (auto& [id, uses] : argument.variables)
+        {
+            auto& merged = function.variables[id];
+            if (merged.size() < uses.size())
+                std::swap(merged, uses);
+            merged.insert(merged.end(), uses.begin(), uses.end());
+        }
+
+        size_t const app = alloc(node_kind::APPLICATION, level);
+        link(make_port(app, 0), function.value);
+        link(make_port(app, 1), argument.value);
+        function.value = make_port(app, 2);
+    }
+
+    void encode_abstraction(encoded& body, symbol_id id, size_t level)
+    {
+        size_t const lambda = alloc(node_kind::LAMBDA, level);
+        link(make_port(lambda, 1), body.value);
+
+        auto it = body.variables.find(id);
+        if (it == body.variables.end())
+        {
+            link(make_port(lambda, 2), make_port(alloc(node_kind::ERASER), 0));
+        }
+        else
+        {
+            link(make_port(lambda, 2), share(it->second, level));
+            body.variables.erase(it);
+        }
+
+        body.value = make_port(lambda, 0);
+    }
+
+    /**
+     * Brings each use of a variable up to the level of its binder through
+     * one bracket for all the arguments between them, and joins them with a
+     * balanced tree of fans of that level
+     *
+     * @return  the wire to the binder
+     */
+    port share(std::vector<size_t> const& uses, size_t level)
+    {
+        std::vector<port> wires;
+        wires.reserve(uses.size());
+        for (size_t const croissant : uses)
+        {
+            port wire = make_port(croissant, 0);
+            auto const span = static_cast<uint32_t>(nodes[croissant].data - level);
+            if (span > 0)
+            {
+                size_t const bracket = alloc(node_kind::BRACKET, level, span);
+                link(make_port(bracket, 1), wire);
+                wire = make_port(bracket, 0);
+            }
+            wires.push_back(wire);
+        }
+
+        while (wires.size() > 1)
+        {
+            size_t joined = 0;
+            for (size_t i = 0; i + 1 < wires.size(); i += 2)
+            {
+                size_t const fan = alloc(node_kind::FAN, level);
+                link(make_port(fan, 1), wires[i]);
+                link(make_port(fan, 2), wires[i + 1]);
+                wires[joined++] = make_port(fan, 0);
+            }
+            if (wires.size() % 2 != 0)
+                wires[joined++] = wires.back();
+            wires.resize(joined);
+        }
+
+        return wires.front();
+    }
+
+    [[nodiscard]]
+    static bool interacts(node_kind lhs, node_kind rhs)
+    {
+        if (lhs == node_kind::ROOT || rhs == node_kind::ROOT)
+            return false;
+        if (lhs == node_kind::ERASER || rhs == node_kind::ERASER)
+            return true;
+
+        // Free variables are only duplicated or erased, an applied one is stuck
+        if (lhs == node_kind::FREE || rhs == node_kind::FREE)
+            return is_control(lhs) || is_control(rhs);
+
+        // Lambda calculus nets never connect two values or two consumers
+        return !(lhs == node_kind::LAMBDA && rhs == node_kind::LAMBDA)
+               && !(lhs == node_kind::APPLICATION && rhs == node_kind::APPLICATION);
+    }
+
+    /**
+     * Walks the paths from the root the way read back does: into the bodies
+     * of abstractions, to the head of each application and into its
+     * arguments once the head is a variable. A fan is only left at the side
+     * the path entered it, so parts of the net no path reaches are left
+     * alone even if they are still linked to it.
+     * @return  true if anything was rewritten
+     */
+    bool reduce_round()
+    {
+        struct task
+        {
+            port                    at;
+            context_levels          levels;
+        };
+
+        path_context context;
+        std::vector<spine_entry> spine;
+        std::vector<task> tasks{{nodes[0].ports[0], {}}};
+
+        ++round;
+        paired.resize(nodes.size(), 0);
+        active.clear();
+
+        while (!tasks.empty())
+        {
+            auto [at, levels] = std::move(tasks.back());
+            tasks.pop_back();
+
+            spine.clear();
+            bool passed_pair = false;
+            auto result = context.walk(*this, at, levels, &spine);
+            while (result == walk_result::ACTIVE_PAIR)
+            {
+                size_t const lhs = index_of(at);
+                size_t const rhs = index_of(partner(at));
+                if (paired[lhs] != round && paired[rhs] != round)
+                {
+                    paired[lhs] = paired[rhs] = round;
+                    active.emplace_back(lhs, rhs);
+                }
+
+                // Rewriting keeps the paths through a pair of a fan, croissant or
+                // bracket, so the walk goes on past it for more pairs this round
+                passed_pair = true;
+                bool const commutes = (is_control(nodes[lhs].kind) && nodes[rhs].kind != node_kind::ERASER)
+                                      || (is_control(nodes[rhs].kind) && nodes[lhs].kind != node_kind::ERASER);
+                if (!commutes)
+                    break;
+
+                at = partner(at);
+                result = context.walk(*this, at, levels, &spine);
+            }
+
+            if (result == walk_result::BROKEN)
+            {
+                consistent = false;
+                return false;
+            }
+            if (result == walk_result::ACTIVE_PAIR)
+                continue;
+
+            auto const& value = nodes[index_of(at)];
+            if (value.kind == node_kind::LAMBDA && slot_of(at) == 0 && spine.empty())
+            {
+                tasks.push_back({value.ports[1], std::move(levels)});
+                continue;
+            }
+
+            bool const variable = value.kind == node_kind::FREE
+                                  || (value.kind == node_kind::LAMBDA && slot_of(at) == 2);
+            if (variable)
+            {
+                for (auto& entry : spine)
+                    tasks.push_back({nodes[entry.app].ports[1], std::move(entry.levels)});
+                continue;
+            }
+
+            // Past a pair the head may be a redex to be, otherwise the path is broken
+            if (!passed_pair)
+            {
+                consistent = false;
+                return false;
+            }
+        }
+
+        // Every node has one principal port, so the pairs are disjoint
+        for (size_t i = 0; i < active.size(); ++i)
+            if (!rewrite(active[i].first, active[i].second))
+            {
+                consistent = false;
+                return false;
+            }
+
+        stats_.rounds += !active.empty();
+        return !active.empty();
+    }
+
+    /**
+     * @return  false for a pair the encoding of a term never brings together
+     */
+    bool rewrite(size_t lhs, size_t rhs)
+    {
+        stats_.interactions++;
+
+        if (nodes[lhs].kind == node_kind::ERASER || nodes[lhs].kind == node_kind::FREE)
+            std::swap(lhs, rhs);
+        if (nodes[rhs].kind == node_kind::ERASER)
+        {
+            erase(lhs, rhs);
+            return true;
+        }
+
+        // A free variable is above every level
+        if (nodes[rhs].kind == node_kind::FREE)
+        {
+            commute(lhs, rhs);
+            return true;
+        }
+
+        auto const lhs_kind = nodes[lhs].kind;
+        auto const rhs_kind = nodes[rhs].kind;
+        if (nodes[lhs].data == nodes[rhs].data)
+        {
+            if (lhs_kind == rhs_kind)
+            {
+                annihilate(lhs, rhs);
+                return true;
+            }
+            if (is_control(lhs_kind) || is_control(rhs_kind))
+                return false;
+
+            if (lhs_kind == node_kind::APPLICATION)
+                std::swap(lhs, rhs);
+            beta(lhs, rhs);
+            return true;
+        }
+
+        if (!is_control(lhs_kind) && !is_control(rhs_kind))
+            return false;
+
+        if (nodes[lhs].data > nodes[rhs].data)
+            std::swap(lhs, rhs);
+        commute(lhs, rhs);
+        return true;
+    }
+
+    /**
+     * The argument goes to the variable, the body to the result
+     */
+    void beta(size_t lambda, size_t app)
+    {
+        stats_.betas++;
+
+        fuse(make_port(app, 1), make_port(lambda, 2));
+        fuse(make_port(app, 2), make_port(lambda, 1));
+        release(lambda);
+        release(app);
+    }
+
+    void annihilate(size_t lhs, size_t rhs)
+    {
+        // Of two chains of brackets the longer one keeps the brackets the other has none for
+        if (nodes[lhs].span != nodes[rhs].span)
+        {
+            if (nodes[lhs].span > nodes[rhs].span)
+                std::swap(lhs, rhs);
+
+            nodes[rhs].data += nodes[lhs].span;
+            nodes[rhs].span -= nodes[lhs].span;
+            link(make_port(rhs, 0), partner(make_port(lhs, 1)));
+            release(lhs);
+            return;
+        }
+
+        for (uint8_t i = 1; i <= arity(nodes[lhs].kind); ++i)
+            fuse(make_port(lhs, i), make_port(rhs, i));
+
+        release(lhs);
+        release(rhs);
+    }
+
+    /**
+     * Each node goes through the other one, as a copy for each auxiliary
+     * port of it. The copies of upper get the level they have on the other
+     * side of lower.
+     */
+    void commute(size_t lower, size_t upper)
+    {
+        size_t const lower_arity = arity(nodes[lower].kind);
+        size_t const upper_arity = arity(nodes[upper].kind);
+
+        size_t upper_level = nodes[upper].data;
+        if (nodes[upper].kind != node_kind::FREE && nodes[lower].kind == node_kind::CROISSANT)
+            --upper_level;
+        else if (nodes[upper].kind != node_kind::FREE && nodes[lower].kind == node_kind::BRACKET)
+            upper_level += nodes[lower].span;
+
+        size_t lower_copies[2], upper_copies[2];
+        for (size_t i = 0; i < upper_arity; ++i)
+            lower_copies[i] = alloc(nodes[lower].kind, nodes[lower].data, nodes[lower].span);
+        for (size_t i = 0; i < lower_arity; ++i)
+            upper_copies[i] = alloc(nodes[upper].kind, upper_level, nodes[upper].span);
+
+        // A port of the pair linked to the other node of it is replaced with the copy it meets
+        auto replacement = [&] (port p)
+        {
+            if (index_of(p) == lower)
+                return make_port(upper_copies[slot_of(p) - 1], 0);
+            if (index_of(p) == upper)
+                return make_port(lower_copies[slot_of(p) - 1], 0);
+            return p;
+        };
+
+        port outer_lower[2], outer_upper[2];
+        for (uint8_t i = 0; i < lower_arity; ++i)
+            outer_lower[i] = replacement(partner(make_port(lower, i + 1)));
+        for (uint8_t i = 0; i < upper_arity; ++i)
+            outer_upper[i] = replacement(partner(make_port(upper, i + 1)));
+
+        for (uint8_t i = 0; i < lower_arity; ++i)
+            link(make_port(upper_copies[i], 0), outer_lower[i]);
+        for (uint8_t j = 0; j < upper_arity; ++j)
+        {
+            link(make_port(lower_copies[j], 0), outer_upper[j]);
+            for (uint8_t i = 0; i < lower_arity; ++i)
+                link(make_port(lower_copies[j], i + 1), make_port(upper_copies[i], j + 1));
+        }
+
+        // Copies meeting more fans, croissants or brackets are rewritten this round too, so
+        // going through a tree of them takes one round and not one for each of its levels
+        size_t copies[4];
+        size_t const count = std::copy(upper_copies, upper_copies + lower_arity,
+                                       std::copy(lower_copies, lower_copies + upper_arity, copies)) - copies;
+        for (size_t i = 0; i < count; ++i)
+        {
+            port const next = partner(make_port(copies[i], 0));
+            size_t const other = index_of(next);
+            bool const seen = std::find(copies, copies + i, other) != copies + i;
+            if (slot_of(next) == 0 && !seen && is_control(nodes[copies[i]].kind) && is_control(nodes[other].kind))
+                active.emplace_back(copies[i], other);
+        }
+
+        release(lower);
+        release(upper);
+    }
+
+    void erase(size_t target, size_t eraser)
+    {
+        size_t const ports = arity(nodes[target].kind);
+        for (uint8_t i = 0; i < ports; ++i)
+            link(make_port(alloc(node_kind::ERASER), 0), partner(make_port(target, i + 1)));
+
+        release(target);
+        release(eraser);
+    }
+
+    /**
+     * The innermost instance of the abstraction whose context agrees on the
+     * levels below the abstraction's one
+     */
+    [[nodiscard]]
+    binder_instance const* find_binder(std::vector<binder_instance> const& binders,
+                                       std::unordered_map<size_t, std::vector<size_t>> const& instances,
+                                       size_t index, context_levels const& levels) const
+    {
+        auto it = instances.find(index);
+        if (it == instances.end())
+            return nullptr;
+
+        for (size_t i = it->second.size(); i-- > 0;)
+        {
+            auto const& binder = binders[it->second[i]];
+            if (levels.agrees_below(binder.levels, nodes[index].data))
+                return &binder;
+        }
+
+        return nullptr;
+    }
+
+    std::vector<node>       nodes;
+    std::vector<size_t>     free_nodes;
+    std::vector<size_t>     paired;
+    /**
+     * Pairs to rewrite in this round
+     */
+    std::vector<std::pair<size_t, size_t>>  active;
+    size_t                  round{0};
+    bool                    consistent{true};
+    reduction_stats         stats_;
+    symbol_table const&     symbols;
+};
@@ -0,0 +1,397 @@
+#pragma once
+
+#include "de_bruijn.h"
+
+#include <memory>
+#include <ostream>
+#include <vector>
+
+/**
+ * Strong normal order reduction on a Krivine machine.
+ *
+ * The machine runs over the immutable De Bruijn code of the input: a beta step
+ * only pushes the argument closure to the environment, nothing is copied or
+ * substituted. Abstractions without arguments are entered with a fresh level
+ * variable, and once a head variable is reached its arguments are normalized
+ * left to right. Normal forms found so far are kept in frames, which together
+ * with the focused closure give back the current term at any step.
+ *
+ * Arguments are not shared (call by name): every step is one step of plain
+ * leftmost outermost reduction.
+ */
+class krivine_machine
+{
+    struct env_cell;
+
+    using environment = std::shared_ptr<env_cell>;
+
+    /**
+     * Closure of code, or the variable bound at the given level if code is null
+     */
+    struct value
+    {
+        db_term const*  code;
+        environment     env;
+        size_t          level;
+    };
+
+    struct env_cell
+    {
+        env_cell(value head, environment tail)
+                : head(std::move(head)),
+                  tail(std::move(tail))
+        {}
+
+        env_cell(env_cell const&) = delete;
+        env_cell& operator=(env_cell const&) = delete;
+
+        /**
+         * Releases the chains of cells with an explicit stack instead of
+         * the recursive chain of shared_ptr destructors
+         */
+        ~env_cell()
+        {
+            std::vector<environment> cells;
+            auto detach = [&cells] (env_cell& cell)
+            {
+                if (cell.tail)
+                    cells.push_back(std::move(cell.tail));
+                if (cell.head.env)
+                    cells.push_back(std::move(cell.head.env));
+            };
+
+            detach(*this);
+            while (!cells.empty())
+            {
+                auto cell = std::move(cells.back());
+                cells.pop_back();
+                if (sole_owner(cell))
+                    detach(*cell);
+            }
+        }
+
+        value           head;
+        environment     tail;
+    };
+
+    /**
+     * Either an entered abstraction (head is null), or a neutral term
+     * whose arguments are being normalized, next one at the back of rest
+     */
+    struct frame
+    {
+        db_term_ptr         head;
+        std::vector<value>  rest;
+        size_t              depth;
+    };
+
+public:
+    krivine_machine(db_term const& code, symbol_table const& symbols)
+            : focus{&code, nullptr, 0},
+              symbols(symbols)
+    {}
+
+    /**
+     * Runs the machine up to the next beta step
+     * @return  false if the term is in normal form
+     */
+    bool step()
+    {
+        if (result)
+            return false;
+
+        while (true)
+        {
+            db_term const& code = *focus.code;
+
+            switch (code.node.index())
+            {
+            case 0:
+            {
+                value const& bound = lookup(focus.env, std::get<0>(code.node).index);
+                if (bound.code == nullptr)
+                {
+                    if (finish_neutral(make_db_term(db_index{depth - 1 - bound.level})))
+                        return false;
+                }
+                else
+                {
+                    // bound may be owned by the environment being replaced
+                    value next = bound;
+                    focus = std::move(next);
+                }
+                break;
+            }
+            case 1:
+                if (finish_neutral(make_db_term(std::get<1>(code.node))))
+                    return false;
+                break;
+            case 2:
+            {
+                auto& body = *std::get<2>(code.node).body;
+                if (!args.empty())
+                {
+                    auto env = std::make_shared<env_cell>(std::move(args.back()), std::move(focus.env));
+                    args.pop_back();
+                    focus = {&body, std::move(env), 0};
+                    return true;
+                }
+
+                frames.push_back({nullptr, {}, depth});
+                auto env = std::make_shared<env_cell>(value{nullptr, nullptr, depth}, std::move(focus.env));
+                depth++;
+                focus = {&body, std::move(env), 0};
+                break;
+            }
+            case 3:
+            {
+                auto& app = std::get<3>(code.node);
+                args.push_back({app.args[1].get(), focus.env, 0});
+                focus.code = app.args[0].get();
+                break;
+            }
+            default:
+                assert(false && "Unexpected node type!");
+                return false;
+            }
+        }
+    }
+
+    /**
+     * Reads the current term back, in the format of ast_record's operator<<
+     */
+    void print(std::ostream& out) const
+    {
+        if (result)
+        {
+            print_normal(out, *result, 0);
+            return;
+        }
+
+        for (auto const& frm : frames)
+        {
+            if (!frm.head)
+            {
+                out << "(\\";
+                symbols.print(out, symbol_table::generated(frm.depth)) << '.';
+                continue;
+            }
+
+            for (size_t i = 0; i <= frm.rest.size(); ++i)
+                out << '(';
+            print_normal(out, *frm.head, frm.depth);
+            out << ' ';
+        }
+
+        for (size_t i = 0; i < args.size(); ++i)
+            out << '(';
+        print_closure(out, focus, depth);
+        for (size_t i = args.size(); i-- > 0;)
+        {
+            out << ' ';
+            print_closure(out, args[i], depth);
+            out << ')';
+        }
+
+        for (size_t i = frames.size(); i-- > 0;)
+        {
+            auto const& frm = frames[i];
+            out << ')';
+            for (size_t j = frm.rest.size(); j-- > 0;)
+            {
+                out << ' ';
+                print_closure(out, frm.rest[j], frm.depth);
+                out << ')';
+            }
+        }
+    }
+
+private:
+    [[nodiscard]]
+    static value const& lookup(environment const& env, size_t index)
+    {
+        env_cell const* cell = env.get();
+        for (; index > 0; --index)
+            cell = cell->tail.get();
+
+        return cell->head;
+    }
+
+    /**
+     * The focus is a variable applied to args: its arguments are normalized next
+     * @return  true if the whole term is in normal form
+     */
+    bool finish_neutral(db_term_ptr head)
+    {
+        if (!args.empty())
+        {
+            std::vector<value> rest;
+            rest.swap(args);
+            focus = std::move(rest.back());
+            rest.pop_back();
+            frames.push_back({std::move(head), std::move(rest), depth});
+            return false;
+        }
+
+        auto normal = std::move(head);
+        while (!frames.empty())
+        {
+            auto& top = frames.back();
+            if (!top.head)
+            {
+                normal = make_db_term(db_abstraction{std::move(normal)});
+                depth--;
+                frames.pop_back();
+                continue;
+            }
+
+            top.head = make_db_term(db_application{{std::move(top.head), std::move(normal)}});
+            if (!top.rest.empty())
+            {
+                focus = std::move(top.rest.back());
+                top.rest.pop_back();
+                return false;
+            }
+
+            normal = std::move(top.head);
+            frames.pop_back();
+        }
+
+        result = std::move(normal);
+        return true;
+    }
+
+    /**
+     * Prints val with its free levels named, the closures and the text left
+     * to print wait on a stack, the next one on top
+     */
+    void print_closure(std::ostream& out, value const& val, size_t level) const
+    {
+        struct pending
+        {
+            value   val;
+            size_t  level;
+            /**
+             * Printed instead of the closure if not zero
+             */
+            char    text;
+        };
+
+        pooled_stack<pending> printing;
+        auto& stack = printing.items;
+        stack.push_back({val, level, 0});
+
+        while (!stack.empty())
+        {
+            auto cur = std::move(stack.back());
+            stack.pop_back();
+
+            if (cur.text != 0)
+            {
+                out << cur.text;
+                continue;
+            }
+
+            // Variables bound to closures are looked up in place
+            while (cur.val.code != nullptr
+                   && cur.val.code->node.index() == 0)
+            {
+                value next = lookup(cur.val.env, std::get<0>(cur.val.code->node).index);
+                cur.val = std::move(next);
+            }
+
+            if (cur.val.code == nullptr)
+            {
+                symbols.print(out, symbol_table::generated(cur.val.level));
+                continue;
+            }
+
+            db_term const& code = *cur.val.code;
+            switch (code.node.index())
+            {
+            case 1:
+                out << std::get<1>(code.node);
+                break;
+            case 2:
+            {
+                out << "(\\";
+                symbols.print(out, symbol_table::generated(cur.level)) << '.';
+                auto env = std::make_shared<env_cell>(value{nullptr, nullptr, cur.level}, std::move(cur.val.env));
+                stack.push_back({{nullptr, nullptr, 0}, 0, ')'});
+                stack.push_back({{std::get<2>(code.node).body.get(), std::move(env), 0}, cur.level + 1, 0});
+                break;
+            }
+            case 3:
+            {
+                auto& app = std::get<3>(code.node);
+                out << '(';
+                stack.push_back({{nullptr, nullptr, 0}, 0, ')'});
+                stack.push_back({{app.args[1].get(), cur.val.env, 0}, cur.level, 0});
+                stack.push_back({{nullptr, nullptr, 0}, 0, ' '});
+                stack.push_back({{app.args[0].get(), std::move(cur.val.env), 0}, cur.level, 0});
+                break;
+            }
+            default:
+                assert(false && "Unexpected node type!");
+            }
+        }
+    }
+
+    /**
+     * Normal forms are built with indices relative to their own position
+     */
+    void print_normal(std::ostream& out, db_term const& term, size_t level) const
+    {
+        struct printer : walk_visitor
+        {
+            walk_action enter(db_term const& term)
+            {
+                switch (term.node.index())
+                {
+                case 0:
+                    symbols.print(out, symbol_table::generated(level - 1 - std::get<0>(term.node).index));
+                    break;
+                case 1:
+                    out << std::get<1>(term.node);
+                    break;
+                case 2:
+                    out << "(\\";
+                    symbols.print(out, symbol_table::generated(level++)) << '.';
+                    break;
+                case 3:
+                    out << '(';
+                    break;
+                default:
+                    assert(false && "Unexpected node type!");
+                }
+
+                return walk_action::DESCEND;
+            }
+
+            void between(db_term const&)
+            {
+                out << ' ';
+            }
+
+            void leave(db_term const& term)
+            {
+                if (term.node.index() == 2)
+                    level--;
+                out << ')';
+            }
+
+            std::ostream&       out;
+            symbol_table const& symbols;
+            size_t              level;
+        } visitor{{}, out, symbols, level};
+
+        db_walk(term, visitor);
+    }
+
+    value               focus;
+    std::vector<value>  args;
+    std::vector<frame>  frames;
+    size_t              depth{0};
+    db_term_ptr         result;
+    symbol_table const& symbols;
+};
@@ -2,12 +2,17 @@
 
 #include <variant>
 #include <string>
+#include <atomic>
 #include <memory>
 #include <ostream>
 #include <cassert>
 #include <vector>
 #include <unordered_map>
 
+#include "char_scanner.h"
+#include "node_arena.h"
+#include "symbol_table.h"
+
 template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
 template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 
@@ -16,11 +21,12 @@ struct binary_operation;
 
 struct variable_t
 {
-    std::string name;
+    symbol_id           id;
+    symbol_table const* symbols;
 
-    explicit operator std::string const&()
+    friend std::ostream& operator<<(std::ostream& out, variable_t const& var)
     {
-        return name;
+        return var.symbols->print(out, var.id);
     }
 };
 
@@ -36,10 +42,226 @@ struct ast_record;
 template<typename UD>
 using ast_node = std::variant<variable_t, binary_operation<UD>, std::shared_ptr<ast_record<UD>>>;
 
-using rename_map_t = std::unordered_map<std::string, std::string>;
+using rename_map_t = std::unordered_map<symbol_id, symbol_id>;
 
 template<typename UD>
-using ast_record_ptr = std::unique_ptr<ast_record<UD>>;
+using ast_record_ptr = std::unique_ptr<ast_record<UD>, node_deleter<UD>>;
+
+/**
+ * Allocates a node in the thread's current node_arena, or on the heap when none is set
+ */
+template<typename UD, typename... Args>
+ast_record_ptr<UD> make_record(Args&&... args)
+{
+    auto* arena = node_arena<UD>::current();
+    if (arena == nullptr)
+        return ast_record_ptr<UD>(new ast_record<UD>(std::forward<Args>(args)...));
+
+    void* place = arena->allocate();
+    return ast_record_ptr<UD>(new (place) ast_record<UD>(std::forward<Args>(args)...),
+                              node_deleter<UD>{arena});
+}
+
+/**
+ * Whether ptr holds the only reference to its node. use_count() is a relaxed
+ * load, so the fence orders the caller's changes to the node after the
+ * reads other threads did before dropping their references.
+ */
+template<typename T>
+bool sole_owner(std::shared_ptr<T> const& ptr)
+{
+    if (ptr.use_count() != 1)
+        return false;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+}
+
+enum class walk_action
+{
+    DESCEND,
+    SKIP,
+    STOP
+};
+
+/**
+ * No-op callbacks for walk, visitors hide the ones they need
+ */
+struct walk_visitor
+{
+    template<typename Record>
+    walk_action enter(Record&)
+    {
+        return walk_action::DESCEND;
+    }
+
+    template<typename Record>
+    void between(Record&)
+    {}
+
+    template<typename Record>
+    void leave(Record&)
+    {}
+};
+
+/**
+ * Work stack taken from a per-thread pool, so repeated traversals do not
+ * reallocate it; nested traversals get stacks of their own
+ */
+template<typename T>
+struct pooled_stack
+{
+    pooled_stack()
+    {
+        auto& free = pool();
+        if (!free.empty())
+        {
+            items = std::move(free.back());
+            free.pop_back();
+        }
+    }
+
+    pooled_stack(pooled_stack const&) = delete;
+    pooled_stack& operator=(pooled_stack const&) = delete;
+
+    ~pooled_stack()
+    {
+        items.clear();
+        pool().push_back(std::move(items));
+    }
+
+    std::vector<T> items;
+
+private:
+    static std::vector<std::vector<T>>& pool()
+    {
+        thread_local std::vector<std::vector<T>> stacks;
+        return stacks;
+    }
+};
+
+/**
+ * Pre-order walk for visitors which only need enter: a plain stack
+ * of pending nodes, left operands are visited first
+ *
+ * @return  false if the visitor stopped the walk
+ */
+template<typename Record, typename Visitor>
+bool preorder_walk(Record& root, Visitor&& enter)
+{
+    pooled_stack<Record*> pending;
+    auto& stack = pending.items;
+    stack.push_back(&root);
+
+    while (!stack.empty())
+    {
+        Record& rec = *stack.back();
+        stack.pop_back();
+
+        auto action = enter(rec);
+        if (action == walk_action::STOP)
+            return false;
+        if (action == walk_action::SKIP)
+            continue;
+
+        switch (rec.node.index())
+        {
+        case 0:
+            break;
+        case 1:
+        {
+            auto& op = std::get<1>(rec.node);
+            stack.push_back(op.args[1].get());
+            if (op.tag == node_tag::APPLICATION)
+                stack.push_back(op.args[0].get());
+            break;
+        }
+        case 2:
+            stack.push_back(std::get<2>(rec.node).get());
+            break;
+        default:
+            assert(false && "Unexpected node type!");
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Depth-first walk over the tree with an explicit stack.
+ *
+ * visitor.enter(rec) is called first and may change rec before the walk
+ * descends, visitor.between(rec) runs between the operands of an application
+ * and visitor.leave(rec) after the children of a descended node.
+ * Binders of abstractions are not visited on their own, referrals are walked through.
+ *
+ * @return  false if the visitor stopped the walk
+ */
+template<typename Record, typename Visitor>
+bool walk(Record& root, Visitor&& visitor)
+{
+    struct frame
+    {
+        Record* rec;
+        uint8_t stage;
+    };
+
+    pooled_stack<frame> frames;
+    auto& stack = frames.items;
+    stack.push_back({&root, 0});
+
+    while (!stack.empty())
+    {
+        size_t const top = stack.size() - 1;
+        Record& rec = *stack[top].rec;
+
+        switch (stack[top].stage++)
+        {
+        case 0:
+        {
+            auto action = visitor.enter(rec);
+            if (action == walk_action::STOP)
+                return false;
+
+            if (action == walk_action::SKIP
+                || rec.node.index() == 0)
+            {
+                stack.pop_back();
+                break;
+            }
+
+            if (rec.node.index() == 2)
+            {
+                stack[top].stage = 2;
+                stack.push_back({std::get<2>(rec.node).get(), 0});
+                break;
+            }
+
+            auto& op = std::get<1>(rec.node);
+            if (op.tag == node_tag::FORALL)
+            {
+                stack[top].stage = 2;
+                stack.push_back({op.args[1].get(), 0});
+            }
+            else
+                stack.push_back({op.args[0].get(), 0});
+            break;
+        }
+        case 1:
+            visitor.between(rec);
+            stack.push_back({std::get<1>(rec.node).args[1].get(), 0});
+            break;
+        case 2:
+            visitor.leave(rec);
+            stack.pop_back();
+            break;
+        default:
+            assert(false && "Unexpected walk stage");
+        }
+    }
+
+    return true;
+}
 
 template<typename UD>
 struct ast_record
@@ -54,6 +276,24 @@ struct ast_record
               userdata(std::move(other))
     {}
 
+    ast_record(ast_record const&) = delete;
+    ast_record& operator=(ast_record const&) = delete;
+
+    /**
+     * A chain of referrals is released link by link instead of by the
+     * recursive chain of shared_ptr destructors, binary_operation tears
+     * the subtrees down
+     */
+    ~ast_record()
+    {
+        if (node.index() != 2 || node_arena<UD>::dropping())
+            return;
+
+        auto target = std::move(std::get<2>(node));
+        while (target && sole_owner(target) && target->node.index() == 2)
+            target = std::move(std::get<2>(target->node));
+    }
+
     ast_record<UD>& child(uint8_t id)
     {
         if (node.index() != 1)
@@ -77,85 +317,117 @@ struct ast_record
     }
 
     [[nodiscard]]
-    bool has_node_tag(node_tag tag)
+    bool has_node_tag(node_tag tag) const
     {
-        switch (node.index())
-        {
-        case 0:
-            return false;
-        case 1:
-            return std::get<1>(node).tag == tag;
-        case 2:
-            return std::get<2>(node)->has_node_tag(tag);
-        default:
-            assert(false);
-            return false;
-        }
+        ast_record<UD> const* rec = this;
+        while (rec->node.index() == 2)
+            rec = std::get<2>(rec->node).get();
+
+        return rec->node.index() == 1
+               && std::get<1>(rec->node).tag == tag;
     }
 
+    /**
+     * Referrals are copied as their targets
+     * @made    if set, the number of nodes made is added to it
+     */
     [[nodiscard]]
-    ast_record_ptr<UD> deep_copy() const
+    ast_record_ptr<UD> deep_copy(size_t* made = nullptr) const
     {
-        switch (node.index())
-        {
-        case 0:
-        {
-            auto& rec = std::get<0>(node);
-            return std::make_unique<ast_record<UD>>(ast_node<UD>{rec}, userdata);
-        }
-        case 1:
-        {
-            auto& rec = std::get<1>(node);
-            return std::make_unique<ast_record<UD>>(ast_node<UD>{rec.deep_copy()}, userdata);
-        }
-        case 2:
+        struct copier : walk_visitor
         {
-            auto& rec = std::get<2>(node);
-            return rec->deep_copy();
-        }
-        default:
-            assert(false);
-            return {nullptr};
-        }
+            walk_action enter(ast_record<UD> const& rec)
+            {
+                if (rec.node.index() == 0)
+                {
+                    copies.push_back(make_record<UD>(ast_node<UD>{std::get<0>(rec.node)}, rec.userdata));
+                    made++;
+                }
+
+                return walk_action::DESCEND;
+            }
+
+            void leave(ast_record<UD> const& rec)
+            {
+                if (rec.node.index() != 1)
+                    return;
+
+                auto& op = std::get<1>(rec.node);
+                auto rhs = std::move(copies.back());
+                copies.pop_back();
+
+                ast_record_ptr<UD> lhs;
+                if (op.tag == node_tag::FORALL)
+                {
+                    lhs = make_record<UD>(ast_node<UD>{std::get<0>(op.args[0]->node)}, op.args[0]->userdata);
+                    made++;
+                }
+                else
+                {
+                    lhs = std::move(copies.back());
+                    copies.pop_back();
+                }
+
+                copies.push_back(make_record<UD>(ast_node<UD>{binary_operation(op.tag, std::move(lhs), std::move(rhs))},
+                                                 rec.userdata));
+                made++;
+            }
+
+            std::vector<ast_record_ptr<UD>> copies;
+            size_t                          made{0};
+        } visitor;
+
+        walk(*this, visitor);
+        if (made != nullptr)
+            *made += visitor.made;
+
+        assert(visitor.copies.size() == 1);
+        return std::move(visitor.copies.back());
     }
 
     friend std::ostream& operator<<(std::ostream& out, ast_record<UD> const& rec)
     {
-        switch (rec.node.index())
-        {
-        case 0:
-        {
-            out << std::get<0>(rec.node).name;
-            break;
-        }
-        case 1:
+        struct printer : walk_visitor
         {
-            auto& op = std::get<1>(rec.node);
-            out << '(';
-            switch (op.tag)
+            walk_action enter(ast_record<UD> const& rec)
             {
-            case node_tag::FORALL:
-                out << '\\' << *op.args[0] << "." << *op.args[1];
-                break;
-            case node_tag::APPLICATION:
-                out << *op.args[0] << " " << *op.args[1];
-                break;
-            default:
-                assert(false);
+                switch (rec.node.index())
+                {
+                case 0:
+                    out << std::get<0>(rec.node);
+                    break;
+                case 1:
+                {
+                    auto& op = std::get<1>(rec.node);
+                    out << '(';
+                    if (op.tag == node_tag::FORALL)
+                        out << '\\' << *op.args[0] << ".";
+                    break;
+                }
+                case 2:
+                    break;
+                default:
+                    assert(false && "Unexpected node type!");
+                }
+
+                return walk_action::DESCEND;
             }
-            out << ')';
-            break;
-        }
-        case 2:
-        {
-            auto& ptr = std::get<2>(rec.node);
-            out << *ptr;
-            break;
-        }
-        default:
-            assert(false && "Unexpected node type!");
-        }
 
+            void between(ast_record<UD> const&)
+            {
+                out << " ";
+            }
+
+            void leave(ast_record<UD> const& rec)
+            {
+                if (rec.node.index() == 1)
+                    out << ')';
+            }
+
+            std::ostream& out;
+        } visitor{{}, out};
+
+        walk(rec, visitor);
         return out;
     }
 
@@ -171,10 +443,58 @@ struct binary_operation
               args{std::move(lhs), std::move(rhs)}
     {}
 
-    [[nodiscard]]
-    binary_operation<UD> deep_copy() const
+    binary_operation(binary_operation&&) noexcept = default;
+    binary_operation& operator=(binary_operation&&) noexcept = default;
+
+    /**
+     * Tears the subtrees down with an explicit stack instead of
+     * the recursive chain of unique_ptr destructors
+     */
+    ~binary_operation()
     {
-        return binary_operation(tag, args[0]->deep_copy(), args[1]->deep_copy());
+        // The subtrees are destroyed by node_arena::drop_all
+        if (node_arena<UD>::dropping())
+            return;
+
+        std::vector<ast_record_ptr<UD>> records;
+        std::vector<std::shared_ptr<ast_record<UD>>> shared;
+
+        auto detach = [&records, &shared] (ast_record<UD>& rec)
+        {
+            switch (rec.node.index())
+            {
+            case 1:
+                for (auto& arg : std::get<1>(rec.node).args)
+                    if (arg && arg->node.index() != 0)
+                        records.push_back(std::move(arg));
+                break;
+            case 2:
+                shared.push_back(std::move(std::get<2>(rec.node)));
+                break;
+            default:
+                break;
+            }
+        };
+
+        for (auto& arg : args)
+            if (arg && arg->node.index() != 0)
+                records.push_back(std::move(arg));
+
+        while (!records.empty() || !shared.empty())
+        {
+            if (!records.empty())
+            {
+                auto rec = std::move(records.back());
+                records.pop_back();
+                detach(*rec);
+                continue;
+            }
+
+            auto ptr = std::move(shared.back());
+            shared.pop_back();
+            if (ptr && sole_owner(ptr))
+                detach(*ptr);
+        }
     }
 
     node_tag            tag;
@@ -183,7 +503,7 @@ struct binary_operation
 
 struct empty_userdata
 {
-    explicit empty_userdata(ast_record<empty_userdata>* owner)
+    explicit empty_userdata([[maybe_unused]] ast_record<empty_userdata>* owner)
     {
         assert(&owner->userdata == this);
     };
@@ -204,10 +524,25 @@ struct parsing_context
         CLOSING_PARANTH,
     };
 
+    /**
+     * Whether variable names are copied to the symbol table or refer to the
+     * parsed string, which then has to outlive the context and its terms
+     */
+    enum class name_storage
+    {
+        COPY,
+        BORROW,
+    };
+
     parsing_context()
         : current_token(token_type::EMPTY)
     {}
 
+    explicit parsing_context(name_storage names)
+        : current_token(token_type::EMPTY),
+          names(names)
+    {}
+
     token_type get_token()
     {
         return current_token;
@@ -245,11 +580,16 @@ struct parsing_context
         }
     }
 
-    std::string& get_varname()
+    symbol_id get_varname()
     {
         return varname;
     }
 
+    symbol_table& symbols()
+    {
+        return symbols_;
+    }
+
     std::string_view& get_tail()
     {
         return tail;
@@ -276,102 +616,52 @@ private:
 
     void skip_ws()
     {
-        size_t cnt = 0;
-        while (cnt < tail.size()
-               && std::isspace(tail[cnt]))
-            cnt++;
-
-        skip_chars(cnt);
-    }
-
-    [[nodiscard]]
-    constexpr bool is_varname_char(char c) const
-    {
-        return (c >= 'a' && c <= 'z')
-                || c == '\''
-                || (c >= '0' && c <= '9');
+        skip_chars(char_scanner::count_spaces(tail));
     }
 
     void read_var()
     {
         skip_ws();
-        assert(tail[0] >= 'a' && tail[0] <= 'z');
-        size_t i = 1;
-        for (; i < tail.size()
-                && is_varname_char(tail[i]); ++i)
-        {}
-
-        varname = tail.substr(0, i);
-        skip_chars(i);
-    }
+        assert(char_scanner::is(tail[0], char_scanner::VARNAME_START));
+        size_t const len = 1 + char_scanner::count_varname(tail.substr(1));
 
-    ast_record_ptr<UD> parse_variable()
-    {
-        auto token = get_token();
-
-        assert(token == token_type::VARNAME);
-
-        return std::make_unique<ast_record<UD>>(variable_t{std::move(get_varname())});
+        auto const name = tail.substr(0, len);
+        varname = names == name_storage::BORROW ? symbols_.intern_borrowed(name) : symbols_.intern(name);
+        skip_chars(len);
     }
 
-    ast_record_ptr<UD> parse_atom()
+    void apply(ast_record_ptr<UD>& spine, ast_record_ptr<UD> arg)
     {
-        auto token = get_token();
-
-        switch (token)
-        {
-        case token_type::OPEN_PARANTH:
-        {
-            auto result = parse_expression();
-            auto tok = get_token();
-            assert(tok == token_type::CLOSING_PARANTH);
-            return result;
-        }
-        case token_type::VARNAME:
-            return parse_variable();
-        default:
-            assert(false && "Unexpected token in for atom");
-            return {nullptr};
-        }
+        if (!spine)
+            spine = std::move(arg);
+        else
+            spine = make_record<UD>(binary_operation(node_tag::APPLICATION, std::move(spine), std::move(arg)));
     }
 
-    ast_record_ptr<UD> combine_binary_op(std::vector<ast_record_ptr<UD>>& args,
-                                        node_tag tag)
+    void close_abstractions(ast_record_ptr<UD>& spine)
     {
-        switch (tag)
+        while (!frames.empty()
+               && frames.back().opened_by == token_type::FORALL_VARNAME)
         {
-        case node_tag::FORALL:
-            while (args.size() > 1)
-            {
-                ast_record_ptr<UD> rhs = std::move(args.back());
-                args.pop_back();
-                ast_record_ptr<UD> lhs = std::move(args.back());
-                args.pop_back();
-
-                args.push_back(std::make_unique<ast_record<UD>>(binary_operation(tag, std::move(lhs), std::move(rhs))));
-            }
-        case node_tag::APPLICATION:
-            for (size_t l = 0, r = args.size() - 1; l < r; ++l, --r)
-                std::swap(args[l], args[r]);
-
-            while (args.size() > 1)
-            {
-                ast_record_ptr<UD> lhs = std::move(args.back());
-                args.pop_back();
-                ast_record_ptr<UD> rhs = std::move(args.back());
-                args.pop_back();
-
-                args.push_back(std::make_unique<ast_record<UD>>(binary_operation(tag, std::move(lhs), std::move(rhs))));
-            }
+            auto& frame = frames.back();
+            auto abstraction = make_record<UD>(binary_operation(node_tag::FORALL,
+                                                                make_record<UD>(variable_t{frame.binder, &symbols_}),
+                                                                std::move(spine)));
+            spine = std::move(frame.applicants);
+            apply(spine, std::move(abstraction));
+            frames.pop_back();
         }
-
-        return std::move(args[0]);
     }
 
-    ast_record_ptr<UD> parse_application()
+    /**
+     * Shift-reduce parser with an explicit stack: applications are folded
+     * as soon as the next atom is read, opened parentheses and abstractions
+     * wait in frames until the closing parenthesis or the end of input.
+     */
+    ast_record_ptr<UD> parse_expression()
     {
-        std::vector<ast_record_ptr<UD>> applicants;
-        applicants.push_back(parse_atom());
+        frames.clear();
+        ast_record_ptr<UD> spine;
 
         do
         {
@@ -379,76 +669,51 @@ private:
 
             switch (tok)
             {
-            case token_type::OPEN_PARANTH:
             case token_type::VARNAME:
-                applicants.push_back(parse_atom());
+                apply(spine, make_record<UD>(variable_t{get_varname(), &symbols_}));
                 break;
+            case token_type::OPEN_PARANTH:
             case token_type::FORALL_VARNAME:
-                applicants.push_back(parse_expression(1));
+                frames.push_back({tok, std::move(spine), get_varname()});
+                spine = nullptr;
+                break;
             case token_type::CLOSING_PARANTH:
             case token_type::EMPTY:
-                return combine_binary_op(applicants, node_tag::APPLICATION);
-            default:
-                assert(false && "Unexpected token for parse_application");
+            {
+                assert(spine && "Empty expression");
+                close_abstractions(spine);
+
+                if (frames.empty())
+                    return spine;
+
+                assert(tok == token_type::CLOSING_PARANTH && "Unbalanced parentheses");
+                auto applicants = std::move(frames.back().applicants);
+                frames.pop_back();
+
+                apply(applicants, std::move(spine));
+                spine = std::move(applicants);
                 break;
             }
+            default:
+                assert(false && "Unexpected token for parse_expression");
+                return {nullptr};
+            }
         } while (true);
     }
 
-    ast_record_ptr<UD> parse_expression(bool token_read = false)
-    {
-        auto tok = (token_read) ? get_token() : read_token();
-        if (tok == token_type::FORALL_VARNAME)
-        {
-            ast_record_ptr<UD> lhs = std::make_unique<ast_record<UD>>(variable_t{std::move(get_varname())});
-            auto rhs = parse_expression();
-
-            return std::make_unique<ast_record<UD>>(binary_operation(node_tag::FORALL, std::move(lhs), std::move(rhs)));
-        }
-        else
-            return parse_application();
-    }
-
 private:
     std::string_view    tail;
     token_type          current_token;
-    std::string         varname;
-};
+    symbol_id           varname{0};
+    name_storage        names{name_storage::COPY};
+    symbol_table        symbols_;
 
-struct hashing_userdata
-{
-    /**
-     * Public "secret" is ridiculous, but anyway
-     */
-    constexpr static size_t secret = 31;
-
-    explicit hashing_userdata(ast_record<hashing_userdata>* owner)
+    struct pending_frame
     {
-        assert(&owner->userdata == this);
-
-        std::visit(
-                overloaded {
-                        [this] (variable_t const& var)
-                        {
-                            hashcode = std::hash<std::string>()(var.name);
-                        },
-                        [this] (binary_operation<hashing_userdata> const& op)
-                        {
-                            hashcode = op.args[0]->userdata.hashcode * 31u;
-                            hashcode += (op.tag == node_tag::FORALL ? 42u : 971u);
-                            hashcode *= 31u;
-                            hashcode += op.args[0]->userdata.hashcode;
-                            hashcode *= 31u;
-                            hashcode += 0xcaffab27;
-                        },
-                        [this] (std::shared_ptr<ast_record<hashing_userdata>> const& ptr)
-                        {
-                            hashcode = ptr->userdata.hashcode * 17 + 911;
-                        }
-                },
-                owner->node
-        );
+        token_type          opened_by;
+        ast_record_ptr<UD>  applicants;
+        symbol_id           binder;
     };
 
-    size_t hashcode{0};
+    std::vector<pending_frame> frames;
 };
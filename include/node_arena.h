@@ -0,0 +1,270 @@
+#pragma once
+
+#include "reduction_stats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+template<typename UD>
+struct ast_record;
+
+/**
+ * Slab allocator for ast_record nodes.
+ *
+ * Nodes are carved out of large slabs one after another, freed nodes go to
+ * an intrusive free list and are reused by the next allocation. Slabs are only returned to the
+ * system when the arena dies, so the arena must outlive every node it owns.
+ * drop_all destroys all the nodes at once, slab by slab, instead of tearing
+ * their terms down node by node.
+ */
+template<typename UD>
+class node_arena
+{
+    union slot
+    {
+        slot*           next;
+        alignas(ast_record<UD>)
+        unsigned char   storage[sizeof(ast_record<UD>)];
+    };
+
+public:
+    /**
+     * Memory taken by one live node
+     */
+    constexpr static size_t node_bytes = sizeof(slot);
+
+    /**
+     * Makes the arena current for the calling thread, restores the
+     * previous one on exit
+     */
+    class scope
+    {
+    public:
+        explicit scope(node_arena<UD>& arena)
+                : scope(&arena)
+        {}
+
+        /**
+         * Null makes nodes on the heap
+         */
+        explicit scope(node_arena<UD>* arena)
+                : previous(current())
+        {
+            current() = arena;
+        }
+
+        scope(scope const&) = delete;
+        scope& operator=(scope const&) = delete;
+
+        ~scope()
+        {
+            current() = previous;
+        }
+
+    private:
+        node_arena<UD>* previous;
+    };
+
+    explicit node_arena(size_t slab_size = 1u << 16u)
+            : slab_size(slab_size)
+    {
+        assert(slab_size > 0);
+    }
+
+    node_arena(node_arena const&) = delete;
+    node_arena& operator=(node_arena const&) = delete;
+
+    ~node_arena()
+    {
+        assert(live == 0 && "Arena destroyed before its nodes");
+    }
+
+    [[nodiscard]]
+    void* allocate()
+    {
+        slot* result = free_list;
+        if (result != nullptr)
+            free_list = result->next;
+        else
+        {
+            if (bump == bump_end)
+                carve();
+            result = bump++;
+        }
+
+        live++;
+        peak.raise_to(live);
+        return result->storage;
+    }
+
+    void deallocate(void* ptr)
+    {
+        auto* freed = reinterpret_cast<slot*>(ptr);
+        freed->next = free_list;
+        free_list = freed;
+        live--;
+    }
+
+    [[nodiscard]]
+    size_t live_nodes() const
+    {
+        return live;
+    }
+
+    /**
+     * Memory taken by the live nodes
+     */
+    [[nodiscard]]
+    size_t live_bytes() const
+    {
+        return live * node_bytes;
+    }
+
+    /**
+     * Most nodes alive at once since the last reset_peak, 0 without LAMBDA_STATS
+     */
+    [[nodiscard]]
+    size_t peak_live_nodes() const
+    {
+        return peak.value();
+    }
+
+    void reset_peak()
+    {
+        peak = stat_counter();
+        peak.raise_to(live);
+    }
+
+    /**
+     * Destroys every live node of the arena in one sweep over the slabs.
+     * release drops the references from outside, such as the roots of the
+     * terms; pointers destroyed until the sweep is done release nothing, so
+     * no term is walked. Nothing may refer to the nodes afterwards, and they
+     * may not own heap nodes or nodes of another arena.
+     */
+    template<typename Release>
+    void drop_all(Release&& release)
+    {
+        bool const previous = dropping();
+        dropping() = true;
+        release();
+        destroy_live();
+        dropping() = previous;
+    }
+
+    /**
+     * Set while drop_all runs on this thread
+     */
+    static bool& dropping()
+    {
+        thread_local bool drop = false;
+        return drop;
+    }
+
+    /**
+     * Arena used by make_record on this thread, nullptr means plain new/delete
+     */
+    static node_arena<UD>*& current()
+    {
+        thread_local node_arena<UD>* arena = nullptr;
+        return arena;
+    }
+
+private:
+    void destroy_live()
+    {
+        if (live != 0)
+        {
+            // Free slots are marked through the free list, all the others carved out hold nodes
+            std::vector<std::pair<slot*, size_t>> bases;
+            for (size_t i = 0; i < carved_slabs; ++i)
+                bases.emplace_back(slabs[i].get(), i);
+
+            // Slabs are separate allocations, only std::less orders their addresses
+            std::less<slot const*> const before;
+            std::sort(bases.begin(), bases.end(), [&before] (auto const& lhs, auto const& rhs)
+            {
+                return before(lhs.first, rhs.first);
+            });
+
+            std::vector<bool> free_slots(carved_slabs * slab_size);
+            for (slot* cur = free_list; cur != nullptr; cur = cur->next)
+            {
+                auto const it = std::prev(std::upper_bound(bases.begin(), bases.end(), cur,
+                                                           [&before] (slot const* ptr, auto const& base)
+                                                           {
+                                                               return before(ptr, base.first);
+                                                           }));
+                free_slots[it->second * slab_size + static_cast<size_t>(cur - it->first)] = true;
+            }
+
+            for (size_t i = 0; i < carved_slabs; ++i)
+            {
+                size_t const end = i + 1 < carved_slabs ? slab_size : static_cast<size_t>(bump - slabs[i].get());
+                for (size_t j = 0; j < end; ++j)
+                    if (!free_slots[i * slab_size + j])
+                        std::launder(reinterpret_cast<ast_record<UD>*>(slabs[i][j].storage))->~ast_record<UD>();
+            }
+        }
+
+        // The slabs are carved again from the first one
+        free_list = nullptr;
+        carved_slabs = 0;
+        bump = nullptr;
+        bump_end = nullptr;
+        live = 0;
+    }
+
+    void carve()
+    {
+        if (carved_slabs == slabs.size())
+            slabs.emplace_back(new slot[slab_size]);
+
+        bump = slabs[carved_slabs++].get();
+        bump_end = bump + slab_size;
+    }
+
+    size_t                          slab_size;
+    size_t                          live{0};
+    stat_counter                    peak;
+    slot*                           free_list{nullptr};
+    /**
+     * Next slot never handed out, in the last slab carved
+     */
+    slot*                           bump{nullptr};
+    slot*                           bump_end{nullptr};
+    size_t                          carved_slabs{0};
+    std::vector<std::unique_ptr<slot[]>> slabs;
+};
+
+/**
+ * Deleter of ast_record_ptr: returns the node to its arena
+ * or deletes it when it was allocated on the heap
+ */
+template<typename UD>
+struct node_deleter
+{
+    void operator()(ast_record<UD>* rec) const
+    {
+        if (arena == nullptr)
+        {
+            delete rec;
+            return;
+        }
+
+        // drop_all destroys the node with the rest of the arena
+        if (node_arena<UD>::dropping())
+            return;
+
+        rec->~ast_record<UD>();
+        arena->deallocate(rec);
+    }
+
+    node_arena<UD>* arena{nullptr};
+};
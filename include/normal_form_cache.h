@@ -0,0 +1,477 @@
+#pragma once
+
+#include "hash_cons.h"
+#include "reduction_context.h"
+#include "resource_budget.h"
+
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Normal forms of closed terms keyed by their alpha-invariant fingerprint,
+ * kept from one term to the next.
+ *
+ * normalize reduces in normal order as parallel_normalizer does, on one
+ * thread: head reduction, then the arguments of the head normal form one
+ * after another. The term and every closed argument are looked up first:
+ * a hit is replaced with a renamed copy of its normal form in one step,
+ * a miss is normalized and stored if that took any steps.
+ *
+ * Only terms without free variables are stored, so an entry does not
+ * depend on the symbol table of the term it came from. Entries are nodes
+ * of the context's arena: the cache is used with one context and dies
+ * before it, and a budget_guard on the arena counts them as live nodes.
+ *
+ * The cache holds at most max_nodes nodes, the oldest entries are evicted
+ * at the end of normalize to make room. Each entry is charged for the copies
+ * it made; entries stored inside another one point into its copies and are
+ * stored before it, so evicting the oldest first frees the copies of an
+ * entry once it is gone.
+ *
+ * Fingerprints come from the print_cache of the nodes, filled by one pass
+ * over the first task not known yet and forgotten along the changes of each
+ * contraction, so a term is not walked again for each of its arguments.
+ * Misses nested in each other share their copies: a missed term is copied
+ * only before the first step inside it, and the normal form of a miss inside
+ * another one is borrowed from the term until the outer one is copied.
+ */
+class normal_form_cache
+{
+    using snapshot_ptr = std::shared_ptr<rendering_ast_rec const>;
+
+    struct entry
+    {
+        /**
+         * The term as it was looked up, to tell it from others with the same hash
+         */
+        snapshot_ptr            term;
+        term_fingerprint        print;
+        snapshot_ptr            normal_form;
+        /**
+         * Nodes of the copies made for this entry
+         */
+        size_t                  nodes;
+    };
+
+    /**
+     * Missed term being normalized, stored when its arguments are done
+     */
+    struct pending_entry
+    {
+        rendering_ast_rec*      rec;
+        term_fingerprint        print;
+        /**
+         * Taken by snapshot before the first step inside rec, null until then
+         */
+        snapshot_ptr            term;
+        /**
+         * Nodes of the snapshot, 0 if it points into the snapshot of an outer term
+         */
+        size_t                  snapshot_nodes;
+        size_t                  steps_before;
+        /**
+         * Entries stored inside rec are in borrowed from this index on
+         */
+        size_t                  first_borrowed;
+    };
+
+    /**
+     * Stored entry whose normal form is still the node of the term
+     */
+    struct borrowed_entry
+    {
+        entry*                  stored;
+        rendering_ast_rec*      rec;
+        size_t                  first_borrowed;
+    };
+
+    /**
+     * Limits of the running normalize
+     */
+    struct step_limits
+    {
+        size_t                                      steps;
+        budget_guard<rendering_userdata> const*     guard;
+        size_t                                      output_bytes;
+        budget_limit                                stopped;
+    };
+
+public:
+    constexpr static size_t default_max_nodes = 1u << 20u;
+
+    /**
+     * @min_nodes   smaller terms are not looked up
+     * @max_nodes   the oldest entries are evicted above this many cached nodes
+     */
+    explicit normal_form_cache(size_t min_nodes = 8, size_t max_nodes = default_max_nodes)
+            : min_nodes(min_nodes),
+              max_nodes(max_nodes)
+    {}
+
+    normal_form_cache(normal_form_cache const&) = delete;
+    normal_form_cache& operator=(normal_form_cache const&) = delete;
+
+    /**
+     * Reduces root in place, a hit counts as one of the context's steps
+     * @guard           checked before each step, null for no budget
+     * @output_bytes    bytes of output written so far, for the guard
+     * @return          false if the step limit or the budget stopped it before
+     *                  the normal form, see stopped
+     */
+    bool normalize(reduction_context& context, rendering_ast_rec& root, size_t step_limit,
+                   budget_guard<rendering_userdata> const* guard = nullptr, size_t output_bytes = 0)
+    {
+        node_arena<rendering_userdata>::scope arena_guard(context.allocator());
+
+        limits = {step_limit, guard, output_bytes, budget_limit::NONE};
+        bool const normal = normalize_tasks(context, root);
+        while (!borrowed.empty())
+        {
+            auto const last = borrowed.back();
+            borrowed.pop_back();
+            copy_normal_form(*last.stored, *last.rec, last.first_borrowed);
+        }
+
+        // Ancestors of the changed nodes above their tasks still keep their caches
+        forget_fingerprints(root);
+        evict(max_nodes);
+        return normal;
+    }
+
+    /**
+     * Limit of the budget which stopped the last normalize, if any
+     */
+    [[nodiscard]]
+    budget_limit stopped() const
+    {
+        return limits.stopped;
+    }
+
+    [[nodiscard]]
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+    /**
+     * Nodes of the copies held by the entries
+     */
+    [[nodiscard]]
+    size_t cached_nodes() const
+    {
+        return nodes;
+    }
+
+    /**
+     * Evicts the oldest entries down to the new limit
+     */
+    void set_max_nodes(size_t limit)
+    {
+        max_nodes = limit;
+        evict(max_nodes);
+    }
+
+    void clear()
+    {
+        entries.clear();
+        order.clear();
+        nodes = 0;
+    }
+
+private:
+    bool normalize_tasks(reduction_context& context, rendering_ast_rec& root)
+    {
+        // Null stands for storing the last pending entry, all of its arguments are normal by then
+        std::vector<rendering_ast_rec*> tasks{&root};
+        std::vector<pending_entry> pending;
+        size_t const stored_before = order.size();
+
+        while (!tasks.empty())
+        {
+            auto* task = tasks.back();
+            tasks.pop_back();
+
+            if (task == nullptr)
+            {
+                auto finished = std::move(pending.back());
+                pending.pop_back();
+                store(context, finished, !pending.empty());
+                continue;
+            }
+
+            context.take_over(*task);
+            auto const print = closed_fingerprint(*task);
+            if (print && print->nodes >= min_nodes)
+            {
+                context.counters.cache_lookups.add();
+                if (auto const* normal_form = find(*print, *task))
+                {
+                    if (!may_step(context))
+                        return abandon(pending, stored_before);
+
+                    snapshot(pending);
+                    replace(context, *task, *normal_form);
+                    continue;
+                }
+
+                pending.push_back({task, *print, nullptr, 0, context.steps(), borrowed.size()});
+                tasks.push_back(nullptr);
+            }
+
+            if (!normalize_head(context, *task, tasks, pending))
+                return abandon(pending, stored_before);
+        }
+
+        return true;
+    }
+
+    /**
+     * @return  false if a limit does not allow another step
+     */
+    bool may_step(reduction_context const& context)
+    {
+        if (context.steps() >= limits.steps)
+            return false;
+
+        if (limits.guard != nullptr)
+            limits.stopped = limits.guard->check(limits.output_bytes);
+        return limits.stopped == budget_limit::NONE;
+    }
+
+    /**
+     * Pending terms are not stored when normalize stops early, but entries
+     * stored inside them may point into their snapshots. The last entry stored
+     * is charged for those, all the others are evicted before it.
+     * @return  false
+     */
+    bool abandon(std::vector<pending_entry> const& pending, size_t stored_before)
+    {
+        if (order.size() == stored_before)
+            return false;
+
+        for (auto const& unfinished : pending)
+        {
+            order.back()->nodes += unfinished.snapshot_nodes;
+            nodes += unfinished.snapshot_nodes;
+        }
+        return false;
+    }
+
+    /**
+     * Evicts the oldest entries until at most limit nodes are cached,
+     * nothing may be borrowed
+     */
+    void evict(size_t limit)
+    {
+        assert(borrowed.empty());
+        while (nodes > limit)
+        {
+            entry const* oldest = order.front();
+            order.pop_front();
+            nodes -= oldest->nodes;
+
+            auto range = entries.equal_range(oldest->print.hash);
+            for (auto it = range.first; it != range.second; ++it)
+                if (&it->second == oldest)
+                {
+                    entries.erase(it);
+                    break;
+                }
+        }
+    }
+
+    [[nodiscard]]
+    rendering_ast_rec const* find(term_fingerprint const& print, rendering_ast_rec const& term) const
+    {
+        auto range = entries.equal_range(print.hash);
+        for (auto it = range.first; it != range.second; ++it)
+            if (alpha_equivalent(*it->second.term, it->second.print, term, print))
+                return it->second.normal_form.get();
+
+        return nullptr;
+    }
+
+    static void replace(reduction_context& context, rendering_ast_rec& rec, rendering_ast_rec const& normal_form)
+    {
+        auto copy = context.unshared_copy(normal_form);
+        rec.node = std::move(copy->node);
+        rec.userdata.print_cache.known = false;
+        context.done++;
+        context.counters.cache_hits.add();
+    }
+
+    /**
+     * @nested  finished is inside a pending term, which is stored after it
+     */
+    void store(reduction_context& context, pending_entry& finished, bool nested)
+    {
+        // Already normal, the copy would save nothing
+        if (context.steps() == finished.steps_before)
+            return;
+
+        assert(finished.term);
+        auto& stored = entries.emplace(finished.print.hash,
+                                       entry{std::move(finished.term), finished.print, nullptr,
+                                             finished.snapshot_nodes})->second;
+        order.push_back(&stored);
+        nodes += stored.nodes;
+        if (!nested)
+        {
+            copy_normal_form(stored, *finished.rec, finished.first_borrowed);
+            return;
+        }
+
+        // Nothing changes the normal form until the pending term around it is stored
+        stored.normal_form = snapshot_ptr(snapshot_ptr(), finished.rec);
+        borrowed.push_back({&stored, finished.rec, finished.first_borrowed});
+    }
+
+    /**
+     * Copies the normal form of stored, the borrowed entries from first_borrowed
+     * on are inside it and get pointed into the copy
+     */
+    void copy_normal_form(entry& stored, rendering_ast_rec const& rec, size_t first_borrowed)
+    {
+        size_t made = 0;
+        stored.normal_form = snapshot_ptr(rec.deep_copy(&made));
+        stored.nodes += made;
+        nodes += made;
+
+        std::unordered_map<rendering_ast_rec const*, snapshot_ptr*> inner;
+        for (size_t i = first_borrowed; i < borrowed.size(); ++i)
+            inner.emplace(borrowed[i].rec, &borrowed[i].stored->normal_form);
+        borrowed.resize(first_borrowed);
+
+        point_into_copy(rec, stored.normal_form, inner);
+    }
+
+    /**
+     * Copies the pending terms not copied yet, to be called before a step.
+     * They are all ancestors of the step, each one inside the one before:
+     * the outermost is copied and the others point into its copy.
+     */
+    static void snapshot(std::vector<pending_entry>& pending)
+    {
+        size_t first = pending.size();
+        while (first > 0 && !pending[first - 1].term)
+            first--;
+        if (first == pending.size())
+            return;
+
+        pending[first].term = snapshot_ptr(pending[first].rec->deep_copy(&pending[first].snapshot_nodes));
+
+        std::unordered_map<rendering_ast_rec const*, snapshot_ptr*> inner;
+        for (size_t i = first + 1; i < pending.size(); ++i)
+            inner.emplace(pending[i].rec, &pending[i].term);
+
+        point_into_copy(*pending[first].rec, pending[first].term, inner);
+    }
+
+    /**
+     * Sets the snapshot of every node of inner, found under rec, to its node
+     * in copy, a deep copy of rec
+     */
+    static void point_into_copy(rendering_ast_rec const& rec, snapshot_ptr const& copy,
+                                std::unordered_map<rendering_ast_rec const*, snapshot_ptr*>& inner)
+    {
+        // The copy has the shape of the term with referrals looked through
+        std::vector<std::pair<rendering_ast_rec const*, rendering_ast_rec const*>> stack{{&rec, copy.get()}};
+        while (!inner.empty() && !stack.empty())
+        {
+            auto [cur, copied] = stack.back();
+            stack.pop_back();
+
+            while (true)
+            {
+                if (auto it = inner.find(cur); it != inner.end())
+                {
+                    *it->second = snapshot_ptr(copy, copied);
+                    inner.erase(it);
+                }
+
+                if (cur->node.index() != 2)
+                    break;
+                cur = std::get<2>(cur->node).get();
+            }
+
+            if (cur->node.index() != 1)
+                continue;
+
+            auto const& op = std::get<1>(cur->node);
+            auto const& copied_op = std::get<1>(copied->node);
+            stack.emplace_back(op.args[1].get(), copied_op.args[1].get());
+            if (op.tag == node_tag::APPLICATION)
+                stack.emplace_back(op.args[0].get(), copied_op.args[0].get());
+        }
+
+        assert(inner.empty());
+    }
+
+    /**
+     * Head reduction of root, then the arguments of its head normal form
+     * are pushed to tasks, the first one on top
+     * @return  false if a limit was hit
+     */
+    bool normalize_head(reduction_context& context, rendering_ast_rec& root,
+                        std::vector<rendering_ast_rec*>& tasks, std::vector<pending_entry>& pending)
+    {
+        rendering_ast_rec* top = &root;
+        std::vector<rendering_ast_rec*> spine;
+        bool changed = false;
+
+        while (true)
+        {
+            context.take_over(*top);
+            if (top->has_node_tag(node_tag::FORALL))
+            {
+                top = &top->child(1);
+                continue;
+            }
+
+            spine.clear();
+            rendering_ast_rec* head = top;
+            while (head->has_node_tag(node_tag::APPLICATION))
+            {
+                spine.push_back(head);
+                head = &head->child(0);
+                context.take_over(*head);
+            }
+
+            if (!head->has_node_tag(node_tag::FORALL))
+                break;
+
+            if (!may_step(context))
+                return false;
+
+            snapshot(pending);
+            context.contract(*spine.back());
+
+            // contract forgets the body, the abstractions above top are forgotten once and the spine every time
+            for (auto* rec = &root; !changed && rec != top; rec = &rec->child(1))
+                rec->userdata.print_cache.known = false;
+            changed = true;
+            for (auto* app : spine)
+                app->userdata.print_cache.known = false;
+        }
+
+        for (auto* app : spine)
+            tasks.push_back(&app->child(1));
+        return true;
+    }
+
+    size_t                                          min_nodes;
+    size_t                                          max_nodes;
+    std::unordered_multimap<size_t, entry>          entries;
+    /**
+     * Stored entries, oldest first
+     */
+    std::deque<entry*>                              order;
+    size_t                                          nodes{0};
+    step_limits                                     limits{};
+    /**
+     * Innermost last, empty between calls of normalize
+     */
+    std::vector<borrowed_entry>                     borrowed;
+};
@@ -0,0 +1,220 @@
+#pragma once
+
+#include "lambdas.h"
+
+#include <unistd.h>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+
+/**
+ * Output collected in one reusable buffer and handed to write(2) in big
+ * chunks, terms are rendered into it directly instead of through std::ostream.
+ * The buffer is flushed once it grows over the threshold and on destruction.
+ */
+class output_buffer
+{
+public:
+    /**
+     * Descriptor of a buffer which keeps all output in memory, see release
+     */
+    constexpr static int in_memory = -1;
+
+    explicit output_buffer(int fd = STDOUT_FILENO, size_t threshold = 1024 * 1024)
+            : fd(fd),
+              threshold(threshold)
+    {
+        buffer.reserve(threshold + threshold / 4);
+    }
+
+    output_buffer(output_buffer const&) = delete;
+    output_buffer& operator=(output_buffer const&) = delete;
+
+    ~output_buffer()
+    {
+        flush();
+    }
+
+    output_buffer& put(char c)
+    {
+        buffer.push_back(c);
+        return spill();
+    }
+
+    output_buffer& append(std::string_view str)
+    {
+        buffer.append(str);
+        return spill();
+    }
+
+    output_buffer& append(symbol_table const& symbols, symbol_id id)
+    {
+        symbols.append(buffer, id);
+        return spill();
+    }
+
+    /**
+     * In the format of std::ostream with std::hex set
+     */
+    output_buffer& append_hex(size_t value)
+    {
+        char digits[std::numeric_limits<size_t>::digits / 4];
+        auto const end = std::to_chars(std::begin(digits), std::end(digits), value, 16).ptr;
+        buffer.append(digits, end);
+        return spill();
+    }
+
+    /**
+     * In the format of std::ostream's operator<< for pointers
+     */
+    output_buffer& append_address(void const* ptr)
+    {
+        buffer.append("0x");
+        return append_hex(reinterpret_cast<uintptr_t>(ptr));
+    }
+
+    /**
+     * Byte for byte the output of ast_record's operator<<
+     */
+    template<typename UD>
+    output_buffer& append(ast_record<UD> const& rec)
+    {
+        append_prefix(rec, std::numeric_limits<size_t>::max());
+        return *this;
+    }
+
+    /**
+     * append(rec) cut once about max_size bytes of it are written, the cut
+     * is marked with " ..." and the term is left unbalanced
+     * @return  false if the term was cut
+     */
+    template<typename UD>
+    bool append_prefix(ast_record<UD> const& rec, size_t max_size)
+    {
+        struct printer : walk_visitor
+        {
+            walk_action enter(ast_record<UD> const& rec)
+            {
+                if (out.total_size() - start >= max_size)
+                    return walk_action::STOP;
+
+                switch (rec.node.index())
+                {
+                case 0:
+                {
+                    auto& var = std::get<0>(rec.node);
+                    out.append(*var.symbols, var.id);
+                    break;
+                }
+                case 1:
+                {
+                    auto& op = std::get<1>(rec.node);
+                    out.buffer.push_back('(');
+                    if (op.tag == node_tag::FORALL)
+                    {
+                        auto& var = std::get<0>(op.args[0]->node);
+                        out.buffer.push_back('\\');
+                        out.append(*var.symbols, var.id);
+                        out.buffer.push_back('.');
+                    }
+                    break;
+                }
+                case 2:
+                    break;
+                default:
+                    assert(false && "Unexpected node type!");
+                }
+
+                return walk_action::DESCEND;
+            }
+
+            void between(ast_record<UD> const&)
+            {
+                out.buffer.push_back(' ');
+            }
+
+            void leave(ast_record<UD> const& rec)
+            {
+                if (rec.node.index() == 1)
+                    out.buffer.push_back(')');
+            }
+
+            output_buffer&  out;
+            size_t          start;
+            size_t          max_size;
+        } visitor{{}, *this, total_size(), max_size};
+
+        bool const complete = walk(rec, visitor);
+        if (!complete)
+            buffer.append(" ...");
+        spill();
+        return complete;
+    }
+
+    /**
+     * @return  false if write failed, errno tells why
+     */
+    bool flush()
+    {
+        if (fd == in_memory)
+            return true;
+
+        size_t written = 0;
+        while (written < buffer.size())
+        {
+            auto const wr = write(fd, buffer.data() + written, buffer.size() - written);
+            if (wr < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                passed += buffer.size();
+                buffer.clear();
+                return false;
+            }
+
+            written += static_cast<size_t>(wr);
+        }
+
+        passed += buffer.size();
+        buffer.clear();
+        return true;
+    }
+
+    /**
+     * Output collected so far by an in_memory buffer, which is left empty
+     */
+    [[nodiscard]]
+    std::string release()
+    {
+        passed += buffer.size();
+        std::string result;
+        result.swap(buffer);
+        return result;
+    }
+
+    /**
+     * Bytes put into the buffer since it was made, flushed or not
+     */
+    [[nodiscard]]
+    size_t total_size() const
+    {
+        return passed + buffer.size();
+    }
+
+private:
+    output_buffer& spill()
+    {
+        if (fd != in_memory && buffer.size() >= threshold)
+            flush();
+        return *this;
+    }
+
+    std::string buffer;
+    int         fd;
+    size_t      threshold;
+    size_t      passed{0};
+};
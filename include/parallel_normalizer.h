@@ -0,0 +1,252 @@
+#pragma once
+
+#include "reduction_context.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Normal form of a term computed by several threads at once.
+ *
+ * Normal order reduction is head reduction followed by the normalization of
+ * the arguments of the head normal form, one after another. The arguments
+ * do not depend on each other, so here each one is a task of its own. Tasks
+ * run on a fixed set of workers: a worker takes its newest task first, and
+ * when it has none it steals the oldest task of another worker. A worker
+ * finding no task at all sleeps until one is queued or the work is done.
+ *
+ * A worker changes only the nodes it owns. On the way to a redex, a referral
+ * is replaced by its target when it is the only one to it, and by a renamed
+ * copy of the target otherwise, so a target reachable from two tasks is only
+ * ever read. Nodes of the term are freed by any worker, so they have to be
+ * made on the heap, see reduction_context::use_heap_nodes.
+ *
+ * The normal form is alpha-equivalent to the one of normal order reduction,
+ * with other fresh names. Arguments copied out of a shared target are
+ * reduced once per copy, so the number of steps may be larger.
+ */
+class parallel_normalizer
+{
+    struct worker
+    {
+        explicit worker(reduction_context::name_storage names)
+                : context(names)
+        {}
+
+        reduction_context                   context;
+        std::mutex                          lock;
+        std::deque<rendering_ast_rec*>      tasks;
+    };
+
+public:
+    /**
+     * @context     context which renamed the term, fresh names
+     *              of the workers do not clash with its names
+     * @step_limit  reduction stops after this many contractions
+     */
+    parallel_normalizer(reduction_context& context, size_t threads, size_t step_limit)
+            : step_limit(step_limit)
+    {
+        threads = std::max<size_t>(threads, 1);
+        for (size_t i = 0; i < threads; ++i)
+        {
+            workers.push_back(std::make_unique<worker>(context.names));
+
+            auto& worker_context = workers.back()->context;
+            worker_context.use_heap_nodes(true);
+            worker_context.next_name = context.next_name + i;
+            worker_context.name_stride = threads;
+        }
+    }
+
+    parallel_normalizer(parallel_normalizer const&) = delete;
+    parallel_normalizer& operator=(parallel_normalizer const&) = delete;
+
+    /**
+     * Reduces root in place, its nodes must be made on the heap
+     * @return  false if the step limit was hit before the normal form
+     */
+    bool normalize(rendering_ast_rec& root)
+    {
+        stopped = false;
+        reserved = 0;
+        pending = 1;
+        queued = 1;
+        workers.front()->tasks.push_back(&root);
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers.size(); ++i)
+            threads.emplace_back([this, i] { run(i); });
+        run(0);
+
+        for (auto& thread : threads)
+            thread.join();
+
+        for (auto& w : workers)
+            w->tasks.clear();
+
+        return !stopped;
+    }
+
+    /**
+     * Counters of all workers, heap nodes are not counted as live
+     */
+    [[nodiscard]]
+    reduction_stats stats() const
+    {
+        reduction_stats result;
+        for (auto const& w : workers)
+            result.merge(w->context.stats());
+        return result;
+    }
+
+    /**
+     * Contractions done by all workers
+     */
+    [[nodiscard]]
+    size_t steps() const
+    {
+        size_t result = 0;
+        for (auto const& w : workers)
+            result += w->context.steps();
+        return result;
+    }
+
+private:
+    void run(size_t self)
+    {
+        while (!stopped && pending != 0)
+        {
+            if (auto* task = take(self))
+            {
+                normalize_head(self, *task);
+                if (--pending == 0)
+                    wake_idle();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(idle_lock);
+            ++idle;
+            work_queued.wait(guard, [this] { return stopped || pending == 0 || queued != 0; });
+            --idle;
+        }
+    }
+
+    /**
+     * Taking idle_lock first, a worker between checking for work and
+     * waiting does not miss the notification
+     */
+    void wake_idle()
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        work_queued.notify_all();
+    }
+
+    [[nodiscard]]
+    rendering_ast_rec* take(size_t self)
+    {
+        {
+            auto& own = *workers[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty())
+            {
+                auto* task = own.tasks.back();
+                own.tasks.pop_back();
+                queued--;
+                return task;
+            }
+        }
+
+        for (size_t i = 1; i < workers.size(); ++i)
+        {
+            auto& victim = *workers[(self + i) % workers.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                auto* task = victim.tasks.front();
+                victim.tasks.pop_front();
+                queued--;
+                return task;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Head reduction of root, then the arguments of its head normal form
+     * are left to the workers, the first one on top of the own tasks
+     */
+    void normalize_head(size_t self, rendering_ast_rec& root)
+    {
+        auto& context = workers[self]->context;
+        node_arena<rendering_userdata>::scope arena_guard(context.allocator());
+
+        rendering_ast_rec* top = &root;
+        std::vector<rendering_ast_rec*> spine;
+
+        while (!stopped)
+        {
+            context.take_over(*top);
+            if (top->has_node_tag(node_tag::FORALL))
+            {
+                top = &top->child(1);
+                continue;
+            }
+
+            spine.clear();
+            rendering_ast_rec* head = top;
+            while (head->has_node_tag(node_tag::APPLICATION))
+            {
+                spine.push_back(head);
+                head = &head->child(0);
+                context.take_over(*head);
+            }
+
+            if (head->has_node_tag(node_tag::FORALL))
+            {
+                if (reserved++ >= step_limit)
+                {
+                    stopped = true;
+                    wake_idle();
+                    return;
+                }
+
+                context.contract(*spine.back());
+                continue;
+            }
+
+            pending += spine.size();
+            {
+                auto& own = *workers[self];
+                std::lock_guard<std::mutex> guard(own.lock);
+                for (auto* app : spine)
+                    own.tasks.push_back(&app->child(1));
+            }
+
+            // idle is read after queued is raised: a worker going to sleep either sees the tasks or is woken
+            queued += spine.size();
+            if (!spine.empty() && idle != 0)
+                wake_idle();
+            return;
+        }
+    }
+
+    std::vector<std::unique_ptr<worker>>    workers;
+    size_t                                  step_limit;
+    std::atomic<size_t>                     reserved{0};
+    std::atomic<size_t>                     pending{0};
+    /**
+     * Tasks in the queues of the workers
+     */
+    std::atomic<size_t>                     queued{0};
+    std::atomic<size_t>                     idle{0};
+    std::atomic<bool>                       stopped{false};
+    std::mutex                              idle_lock;
+    std::condition_variable                 work_queued;
+};
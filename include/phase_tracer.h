@@ -0,0 +1,259 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * Timeline of the phases of a reduction (parse, renaming, reduction steps,
+ * printing) with the wall time and the hardware counters of each one,
+ * written in the Chrome trace event format (chrome://tracing, Perfetto).
+ *
+ * Cycles, instructions and cache misses of the calling thread are read from
+ * one perf_event_open group, user space only. When the kernel refuses it
+ * (no PMU in a VM, perf_event_paranoid) only the wall time is recorded.
+ * A tracer counts the thread which made it, so every thread needs its own.
+ */
+class phase_tracer
+{
+public:
+    constexpr static size_t counter_count = 3;
+
+    struct event
+    {
+        char const*                             name;
+        uint32_t                                tid;
+        uint64_t                                start_ns;
+        uint64_t                                duration_ns;
+        std::array<uint64_t, counter_count>     counters;
+        /**
+         * Reduction steps done in the phase
+         */
+        size_t                                  steps;
+    };
+
+    /**
+     * Point where a phase starts, see finish
+     */
+    struct mark
+    {
+        uint64_t                                ns;
+        std::array<uint64_t, counter_count>     counters;
+    };
+
+    /**
+     * Phase from its construction to its destruction
+     */
+    class span
+    {
+    public:
+        span(phase_tracer& tracer, char const* name)
+                : tracer(tracer),
+                  name(name),
+                  from(tracer.start())
+        {}
+
+        span(span const&) = delete;
+        span& operator=(span const&) = delete;
+
+        ~span()
+        {
+            tracer.finish(name, from);
+        }
+
+    private:
+        phase_tracer&   tracer;
+        char const*     name;
+        mark            from;
+    };
+
+    /**
+     * A disabled tracer records nothing and costs a branch per phase
+     * @tid     thread id of the events in the trace
+     */
+    explicit phase_tracer(bool enabled, uint32_t tid = 0)
+            : enabled(enabled),
+              tid(tid)
+    {
+        if (enabled)
+            open_counters();
+    }
+
+    phase_tracer(phase_tracer const&) = delete;
+    phase_tracer& operator=(phase_tracer const&) = delete;
+
+    ~phase_tracer()
+    {
+        close_counters();
+    }
+
+    [[nodiscard]]
+    bool is_enabled() const
+    {
+        return enabled;
+    }
+
+    /**
+     * True if the events have hardware counters, not only the wall time
+     */
+    [[nodiscard]]
+    bool has_counters() const
+    {
+        return fds[0] >= 0;
+    }
+
+    [[nodiscard]]
+    mark start() const
+    {
+        mark result{};
+        if (!enabled)
+            return result;
+
+        read_counters(result.counters);
+        result.ns = now_ns();
+        return result;
+    }
+
+    /**
+     * Records the phase from mark until now
+     */
+    void finish(char const* name, mark const& from, size_t steps = 0)
+    {
+        if (!enabled)
+            return;
+
+        uint64_t const end = now_ns();
+        auto counters = from.counters;
+        read_counters(counters);
+
+        for (size_t i = 0; i < counter_count; ++i)
+            counters[i] -= from.counters[i];
+        events.push_back({name, tid, from.ns, end - from.ns, counters, steps});
+    }
+
+    [[nodiscard]]
+    std::vector<event> const& recorded() const
+    {
+        return events;
+    }
+
+    /**
+     * Writes events of any number of tracers as one trace
+     * @counters    whether the events have hardware counters
+     */
+    static void write_chrome_trace(std::ostream& out, std::vector<event> const& events, bool counters)
+    {
+        out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+        for (size_t i = 0; i < events.size(); ++i)
+        {
+            auto const& e = events[i];
+            out << (i == 0 ? "\n" : ",\n")
+                << "  {\"name\": \"" << e.name << "\", \"cat\": \"task2\", \"ph\": \"X\""
+                << ", \"pid\": 1, \"tid\": " << e.tid
+                << ", \"ts\": " << microseconds(e.start_ns)
+                << ", \"dur\": " << microseconds(e.duration_ns)
+                << ", \"args\": {\"steps\": " << e.steps;
+            if (counters)
+                out << ", \"cycles\": " << e.counters[0]
+                    << ", \"instructions\": " << e.counters[1]
+                    << ", \"cache_misses\": " << e.counters[2];
+            out << "}}";
+        }
+        out << "\n]}\n";
+    }
+
+private:
+    [[nodiscard]]
+    static uint64_t now_ns()
+    {
+        // Tracers of all threads share the origin, so their events line up
+        static auto const origin = std::chrono::steady_clock::now();
+        auto const elapsed = std::chrono::steady_clock::now() - origin;
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    /**
+     * Chrome traces count in microseconds, the fraction keeps the nanoseconds
+     */
+    [[nodiscard]]
+    static std::string microseconds(uint64_t ns)
+    {
+        std::string result = std::to_string(ns / 1000) + ".";
+        auto const fraction = std::to_string(ns % 1000);
+        result.append(3 - fraction.size(), '0');
+        return result + fraction;
+    }
+
+    void open_counters()
+    {
+        constexpr std::array<uint64_t, counter_count> configs{PERF_COUNT_HW_CPU_CYCLES,
+                                                              PERF_COUNT_HW_INSTRUCTIONS,
+                                                              PERF_COUNT_HW_CACHE_MISSES};
+
+        for (size_t i = 0; i < counter_count; ++i)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.disabled = i == 0;
+
+            auto const fd = syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+            if (fd < 0)
+            {
+                close_counters();
+                return;
+            }
+            fds[i] = static_cast<int>(fd);
+        }
+
+        ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    void close_counters()
+    {
+        for (int& fd : fds)
+        {
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+    }
+
+    /**
+     * Leaves counters as they are if the counters can not be read
+     */
+    void read_counters(std::array<uint64_t, counter_count>& counters) const
+    {
+        if (!has_counters())
+            return;
+
+        /**
+         * PERF_FORMAT_GROUP layout: the number of counters, then their values
+         */
+        std::array<uint64_t, counter_count + 1> group{};
+        if (read(fds[0], group.data(), sizeof(group)) != static_cast<ssize_t>(sizeof(group)))
+            return;
+
+        for (size_t i = 0; i < counter_count; ++i)
+            counters[i] = group[i + 1];
+    }
+
+    bool                        enabled;
+    uint32_t                    tid;
+    std::array<int, counter_count> fds{-1, -1, -1};
+    std::vector<event>          events;
+};
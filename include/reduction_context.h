@@ -0,0 +1,1004 @@
+#pragma once
+
+#include "lambdas.h"
+#include "reduction_stats.h"
+#include "render_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct sharing_stats
+{
+    /**
+     * Contractions actually done
+     */
+    size_t  graph_steps{0};
+    /**
+     * Same contractions counted once for every occurrence of the redex in the
+     * printed term, as reduction of the unshared tree would do them
+     */
+    size_t  tree_steps{0};
+};
+
+/**
+ * Named normal order reduction with all of its state: fresh names, rename
+ * scopes, the step counter, the parser with its symbol table and the node
+ * arena. Contexts share nothing, so several reductions can run at once on
+ * different threads, each with a context of its own.
+ *
+ * Terms are made by parse and must die before the context or its next reset.
+ */
+class reduction_context
+{
+public:
+    using name_storage = parsing_context<rendering_userdata>::name_storage;
+
+    explicit reduction_context(name_storage names = name_storage::COPY)
+            : names(names),
+              parser(names)
+    {}
+
+    reduction_context(reduction_context const&) = delete;
+    reduction_context& operator=(reduction_context const&) = delete;
+
+    /**
+     * Starts a new term with the names and counters of a fresh context,
+     * the arena is kept for reuse. The symbol table is emptied in place:
+     * closed terms kept from before, like the entries of normal_form_cache,
+     * still point to it and are only used through copies with fresh names.
+     */
+    void reset()
+    {
+        parser.reset();
+        parser.symbols().clear();
+        next_name = 0;
+        name_stride = 1;
+        renames.clear();
+        done = 0;
+        renders = nullptr;
+        counters = reduction_stats();
+        started = std::chrono::steady_clock::now();
+        arena.reset_peak();
+    }
+
+    [[nodiscard]]
+    rendering_ast_rec_ptr parse(std::string_view term)
+    {
+        node_arena<rendering_userdata>::scope arena_guard(allocator());
+        return parser.parse_lambda(term);
+    }
+
+    [[nodiscard]]
+    symbol_table const& symbols()
+    {
+        return parser.symbols();
+    }
+
+    /**
+     * Arena of the nodes of this context, null if they are made on the heap.
+     * To be made current by code which makes nodes of its terms outside of the context.
+     */
+    [[nodiscard]]
+    node_arena<rendering_userdata>* allocator()
+    {
+        return heap_nodes ? nullptr : &arena;
+    }
+
+    /**
+     * Makes new nodes on the heap instead of the arena, for terms whose
+     * nodes are freed by other threads, see parallel_normalizer
+     */
+    void use_heap_nodes(bool heap)
+    {
+        heap_nodes = heap;
+    }
+
+    /**
+     * Renderings to invalidate on each contraction, null if the term is printed without a cache
+     */
+    void set_render_cache(render_cache* cache)
+    {
+        renders = cache;
+    }
+
+    /**
+     * Contractions done since the last reset
+     */
+    [[nodiscard]]
+    size_t steps() const
+    {
+        return done;
+    }
+
+    /**
+     * Counters since the last reset, see reduction_stats
+     */
+    [[nodiscard]]
+    reduction_stats stats() const
+    {
+        auto result = counters;
+        result.peak_live_nodes.raise_to(arena.peak_live_nodes());
+        return result;
+    }
+
+    /**
+     * Adds the counters as they are now to the time series of stats
+     */
+    void record_sample()
+    {
+        if constexpr (!stats_enabled)
+            return;
+
+        auto const elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started);
+        counters.series.push_back({counters.beta_steps.value(),
+                                   static_cast<uint64_t>(elapsed.count()),
+                                   arena.live_nodes(),
+                                   counters.reduce_visits.value(),
+                                   counters.copied_nodes.value(),
+                                   counters.substitution_visits.value(),
+                                   counters.fresh_names.value()});
+    }
+
+    void count_printed(size_t bytes)
+    {
+        counters.printed_bytes.add(bytes);
+    }
+
+    /**
+     * Gives every binder a fresh name and renames its occurrences, referrals are left as they are
+     * @return  nodes visited, 0 without LAMBDA_STATS
+     */
+    size_t run_substitutions(rendering_ast_rec& root)
+    {
+        struct renamer : walk_visitor
+        {
+            walk_action enter(rendering_ast_rec& rec)
+            {
+                visited.add();
+                switch (rec.node.index())
+                {
+                case 0:
+                {
+                    auto& name = std::get<0>(rec.node).id;
+                    auto it = context.renames.find(name);
+
+                    if (it != context.renames.end())
+                        name = it->second;
+                    // else global varname expected
+
+                    return walk_action::SKIP;
+                }
+                case 1:
+                {
+                    auto& op = std::get<1>(rec.node);
+                    if (op.tag == node_tag::APPLICATION)
+                        return walk_action::DESCEND;
+
+                    if (op.args[0]->node.index() != 0)
+                    {
+                        assert(false);
+                        return walk_action::SKIP;
+                    }
+
+                    auto& name = std::get<0>(op.args[0]->node).id;
+                    std::optional<symbol_id> before;
+
+                    auto it = context.renames.find(name);
+                    if (it != context.renames.end())
+                    {
+                        before = it->second;
+                        context.renames.erase(it);
+                    }
+
+                    scopes.emplace_back(name, before);
+
+                    auto const newname = context.gen_name();
+                    context.renames.emplace(name, newname);
+                    name = newname;
+
+                    return walk_action::DESCEND;
+                }
+                case 2:
+                    return walk_action::SKIP;
+                default:
+                    assert(false);
+                    return walk_action::SKIP;
+                }
+            }
+
+            void leave(rendering_ast_rec& rec)
+            {
+                if (rec.node.index() != 1
+                    || std::get<1>(rec.node).tag != node_tag::FORALL)
+                    return;
+
+                auto const [old_name, before] = scopes.back();
+                scopes.pop_back();
+
+                auto it = context.renames.find(old_name);
+                if (before)
+                    it->second = *before;
+                else
+                {
+                    assert(it != context.renames.end());
+                    context.renames.erase(it);
+                }
+            }
+
+            reduction_context&                                          context;
+            std::vector<std::pair<symbol_id, std::optional<symbol_id>>> scopes;
+            stat_counter                                                visited;
+        } visitor{{}, *this, {}, {}};
+
+        node_arena<rendering_userdata>::scope arena_guard(allocator());
+        walk(root, visitor);
+        assert(renames.empty());
+        return visitor.visited.value();
+    }
+
+    /**
+     * Contracts the leftmost outermost redex, looking into referrals.
+     * The path to it is only tracked for the rendering cache.
+     * @return  false if the term is in normal form
+     */
+    bool reduce(rendering_ast_rec& root)
+    {
+        node_arena<rendering_userdata>::scope arena_guard(allocator());
+
+        size_t visits = 0;
+        if (renders == nullptr)
+        {
+            bool const normal = preorder_walk(root, [this, &visits] (rendering_ast_rec& rec)
+            {
+                visits++;
+                if (!is_redex(rec))
+                    return walk_action::DESCEND;
+
+                contract(rec);
+                return walk_action::STOP;
+            });
+            count_search(visits);
+            return !normal;
+        }
+
+        /**
+         * Node to visit and the number of its ancestors
+         */
+        pooled_stack<std::pair<rendering_ast_rec*, size_t>> pending;
+        pooled_stack<rendering_ast_rec*> ancestors;
+        auto& stack = pending.items;
+        auto& path = ancestors.items;
+        stack.emplace_back(&root, 0);
+
+        while (!stack.empty())
+        {
+            auto [rec, depth] = stack.back();
+            stack.pop_back();
+            path.resize(depth);
+            visits++;
+
+            if (is_redex(*rec))
+            {
+                contract(*rec);
+                invalidate_renderings(path, *rec);
+                count_search(visits);
+                return true;
+            }
+
+            switch (rec->node.index())
+            {
+            case 0:
+                break;
+            case 1:
+            {
+                auto& op = std::get<1>(rec->node);
+                path.push_back(rec);
+                stack.emplace_back(op.args[1].get(), path.size());
+                if (op.tag == node_tag::APPLICATION)
+                    stack.emplace_back(op.args[0].get(), path.size());
+                break;
+            }
+            case 2:
+                path.push_back(rec);
+                stack.emplace_back(std::get<2>(rec->node).get(), path.size());
+                break;
+            default:
+                assert(false && "Unexpected node type!");
+            }
+        }
+
+        count_search(visits);
+        return false;
+    }
+
+    /**
+     * Contracts the leftmost outermost redex of the graph
+     * @return  false if the term is in normal form
+     */
+    bool reduce_shared(rendering_ast_rec& root, sharing_stats& stats)
+    {
+        node_arena<rendering_userdata>::scope arena_guard(allocator());
+
+        /**
+         * Node to visit, the number of its ancestors and whether it is reached through a referral
+         */
+        struct position
+        {
+            rendering_ast_rec*  rec;
+            size_t              depth;
+            bool                shared;
+        };
+
+        pooled_stack<position> pending;
+        pooled_stack<rendering_ast_rec*> ancestors;
+        auto& stack = pending.items;
+        auto& path = ancestors.items;
+        stack.push_back({&root, 0, false});
+        size_t visits = 0;
+
+        while (!stack.empty())
+        {
+            auto [rec, depth, shared] = stack.back();
+            stack.pop_back();
+            path.resize(depth);
+            visits++;
+
+            if (is_redex(*rec))
+            {
+                count_search(visits);
+                stats.graph_steps++;
+                stats.tree_steps = saturating_add(stats.tree_steps, shared ? count_occurrences(root, rec) : 1);
+
+                contract_shared(*rec);
+                invalidate_renderings(path, *rec);
+                return true;
+            }
+
+            switch (rec->node.index())
+            {
+            case 0:
+                break;
+            case 1:
+            {
+                auto& op = std::get<1>(rec->node);
+                path.push_back(rec);
+                stack.push_back({op.args[1].get(), path.size(), shared});
+                if (op.tag == node_tag::APPLICATION)
+                    stack.push_back({op.args[0].get(), path.size(), shared});
+                break;
+            }
+            case 2:
+                path.push_back(rec);
+                stack.push_back({std::get<2>(rec->node).get(), path.size(), true});
+                break;
+            default:
+                assert(false && "Unexpected node type!");
+            }
+        }
+
+        count_search(visits);
+        return false;
+    }
+
+    class redex_cursor;
+
+private:
+    friend class parallel_normalizer;
+    friend class normal_form_cache;
+
+    [[nodiscard]]
+    symbol_id gen_name()
+    {
+        auto const name = symbol_table::generated(next_name);
+        next_name += name_stride;
+        counters.fresh_names.add();
+        return name;
+    }
+
+    /**
+     * One search for a redex which went through visits nodes
+     */
+    void count_search(size_t visits)
+    {
+        counters.reduce_calls.add();
+        counters.reduce_visits.add(visits);
+        counters.max_reduce_visits.raise_to(visits);
+    }
+
+    [[nodiscard]]
+    static bool is_redex(rendering_ast_rec& rec)
+    {
+        return rec.node.index() == 1
+               && std::get<1>(rec.node).tag == node_tag::APPLICATION
+               && rec.child(0).has_node_tag(node_tag::FORALL);
+    }
+
+    /**
+     * Renamed deep copy of a referral target, to be changed by one of its referrals only
+     */
+    [[nodiscard]]
+    rendering_ast_rec_ptr unshared_copy(rendering_ast_rec const& target)
+    {
+        size_t made = 0;
+        auto copy = target.deep_copy(&made);
+        counters.copied_nodes.add(made);
+        run_substitutions(*copy);
+        return copy;
+    }
+
+    /**
+     * Last target of a chain of referrals, the only one which holds a node
+     */
+    [[nodiscard]]
+    static std::shared_ptr<rendering_ast_rec> const& last_target(std::shared_ptr<rendering_ast_rec> const& link)
+    {
+        auto const* target = &link;
+        while ((*target)->node.index() == 2)
+            target = &std::get<2>((*target)->node);
+        return *target;
+    }
+
+    /**
+     * Argument of a redex as the target of its referrals. A referral argument
+     * is looked through, so contractions do not build chains of referrals.
+     */
+    [[nodiscard]]
+    static std::shared_ptr<rendering_ast_rec> shared_argument(rendering_ast_rec_ptr& argument)
+    {
+        if (argument->node.index() == 2)
+            return last_target(std::get<2>(argument->node));
+        return std::move(argument);
+    }
+
+    /**
+     * Makes rec a node of its own, whatever referrals it goes through: a target
+     * with no other referral is moved in, a shared one is copied
+     */
+    void take_over(rendering_ast_rec& rec)
+    {
+        while (rec.node.index() == 2)
+        {
+            auto& target = std::get<2>(rec.node);
+            target = last_target(target);
+            if (sole_owner(target))
+            {
+                auto owned = std::move(target);
+                rec.node = std::move(owned->node);
+                continue;
+            }
+
+            auto copy = unshared_copy(*target);
+            rec.node = std::move(copy->node);
+        }
+    }
+
+    /**
+     * Replaces every referral with a renamed copy of its target
+     */
+    void resolve_referrals(rendering_ast_rec& root)
+    {
+        preorder_walk(root, [this] (rendering_ast_rec& rec)
+        {
+            if (rec.node.index() != 2)
+                return walk_action::DESCEND;
+
+            auto copy = unshared_copy(*std::get<2>(rec.node));
+            rec.node = std::move(copy->node);
+
+            return walk_action::SKIP;
+        });
+    }
+
+    void substitute_with_referral(rendering_ast_rec& root, symbol_id varname,
+                                  std::shared_ptr<rendering_ast_rec>& lazy_link)
+    {
+        size_t visits = 0;
+        preorder_walk(root, [varname, &lazy_link, &visits] (rendering_ast_rec& rec)
+        {
+            visits++;
+            rec.userdata.print_cache.known = false;
+            switch (rec.node.index())
+            {
+            case 0:
+            {
+                if (std::get<0>(rec.node).id == varname)
+                    rec.node = lazy_link;
+                return walk_action::SKIP;
+            }
+            case 1:
+            {
+                auto& op = std::get<1>(rec.node);
+                if (op.tag == node_tag::APPLICATION)
+                    return walk_action::DESCEND;
+
+                auto& lhs = rec.child(0);
+                if (lhs.node.index() != 0)
+                {
+                    assert(false);
+                    return walk_action::SKIP;
+                }
+
+                auto abstraction_name = std::get<0>(lhs.node).id;
+                if (abstraction_name == varname)
+                    return walk_action::SKIP;
+                return walk_action::DESCEND;
+            }
+            case 2:
+                assert(false && "Unresolved referral");
+                return walk_action::SKIP;
+            default:
+                assert(false && "Unexpected node type!");
+                return walk_action::SKIP;
+            }
+        });
+        counters.substitution_visits.add(visits);
+    }
+
+    /**
+     * Beta step in place: the argument becomes a referral shared by every occurrence.
+     * The fingerprint caches of rec and of the body are forgotten, the ones of
+     * the ancestors are left to the caller.
+     */
+    void contract(rendering_ast_rec& rec)
+    {
+        auto& parent_op = std::get<1>(rec.node);
+
+        resolve_referrals(rec.child(0));
+
+        auto ptr = shared_argument(parent_op.args[1]);
+
+        auto& name_holder_rec = rec.child(0).child(0);
+        if (name_holder_rec.node.index() != 0)
+        {
+            assert(false);
+            return;
+        }
+        symbol_id const varname = std::get<0>(name_holder_rec.node).id;
+
+        substitute_with_referral(rec.child(0).child(1), varname, ptr);
+
+        auto newnode = std::move(rec.child(0).child(1).node);
+
+        rec.node = std::move(newnode);
+        rec.userdata.print_cache.known = false;
+        done++;
+        counters.beta_steps.add();
+    }
+
+    /**
+     * Drops the renderings changed by contracting rec, ancestors are the nodes above it
+     */
+    template<typename Ancestors>
+    void invalidate_renderings(Ancestors const& ancestors, rendering_ast_rec& rec)
+    {
+        if (renders == nullptr)
+            return;
+
+        for (auto* ancestor : ancestors)
+            render_cache::invalidate(*ancestor);
+        render_cache::invalidate_tree(rec);
+    }
+
+    /**
+     * True if some variable of the term, looking into referrals, is one of names
+     */
+    [[nodiscard]]
+    static bool mentions_any(rendering_ast_rec& root, std::vector<symbol_id> const& names)
+    {
+        if (names.empty())
+            return false;
+
+        std::unordered_set<rendering_ast_rec const*> seen_targets;
+        return !preorder_walk(root, [&names, &seen_targets] (rendering_ast_rec& rec)
+        {
+            switch (rec.node.index())
+            {
+            case 0:
+            {
+                auto const id = std::get<0>(rec.node).id;
+                if (std::find(names.begin(), names.end(), id) != names.end())
+                    return walk_action::STOP;
+                return walk_action::SKIP;
+            }
+            case 2:
+                if (!seen_targets.insert(std::get<2>(rec.node).get()).second)
+                    return walk_action::SKIP;
+                return walk_action::DESCEND;
+            default:
+                return walk_action::DESCEND;
+            }
+        });
+    }
+
+    /**
+     * Copy with fresh binder names, looking through referrals at the root.
+     * Referrals inside which do not mention the copied binders stay shared.
+     */
+    [[nodiscard]]
+    rendering_ast_rec_ptr shared_copy(rendering_ast_rec& root)
+    {
+        struct copier : walk_visitor
+        {
+            walk_action enter(rendering_ast_rec& rec)
+            {
+                switch (rec.node.index())
+                {
+                case 0:
+                    copies.push_back(make_record<rendering_userdata>(ast_node<rendering_userdata>{std::get<0>(rec.node)},
+                                                                     rec.userdata));
+                    made++;
+                    break;
+                case 1:
+                {
+                    auto& op = std::get<1>(rec.node);
+                    if (op.tag == node_tag::FORALL)
+                        scope.push_back(std::get<0>(op.args[0]->node).id);
+                    break;
+                }
+                case 2:
+                {
+                    auto const& target = last_target(std::get<2>(rec.node));
+                    if (mentions_any(*target, scope))
+                        break;
+
+                    copies.push_back(make_record<rendering_userdata>(ast_node<rendering_userdata>{target}, rec.userdata));
+                    made++;
+                    return walk_action::SKIP;
+                }
+                default:
+                    assert(false && "Unexpected node type!");
+                }
+
+                return walk_action::DESCEND;
+            }
+
+            void leave(rendering_ast_rec& rec)
+            {
+                if (rec.node.index() != 1)
+                    return;
+
+                auto& op = std::get<1>(rec.node);
+                auto rhs = std::move(copies.back());
+                copies.pop_back();
+
+                rendering_ast_rec_ptr lhs;
+                if (op.tag == node_tag::FORALL)
+                {
+                    lhs = make_record<rendering_userdata>(ast_node<rendering_userdata>{std::get<0>(op.args[0]->node)},
+                                                          op.args[0]->userdata);
+                    made++;
+                    scope.pop_back();
+                }
+                else
+                {
+                    lhs = std::move(copies.back());
+                    copies.pop_back();
+                }
+
+                copies.push_back(make_record<rendering_userdata>(
+                        ast_node<rendering_userdata>{binary_operation(op.tag, std::move(lhs), std::move(rhs))},
+                        rec.userdata));
+                made++;
+            }
+
+            std::vector<rendering_ast_rec_ptr>  copies;
+            std::vector<symbol_id>              scope;
+            size_t                              made{0};
+        } visitor;
+
+        rendering_ast_rec* rec = &root;
+        while (rec->node.index() == 2)
+            rec = std::get<2>(rec->node).get();
+
+        walk(*rec, visitor);
+        assert(visitor.copies.size() == 1);
+
+        auto copy = std::move(visitor.copies.back());
+        counters.copied_nodes.add(visitor.made);
+        run_substitutions(*copy);
+        return copy;
+    }
+
+    /**
+     * substitute_with_referral for graph reduction: a referral is unshared only
+     * if its target mentions varname, the other ones are left shared
+     */
+    void substitute_shared(rendering_ast_rec& root, symbol_id varname,
+                           std::shared_ptr<rendering_ast_rec>& lazy_link)
+    {
+        std::vector<symbol_id> const names{varname};
+
+        size_t visits = 0;
+        preorder_walk(root, [this, &names, varname, &lazy_link, &visits] (rendering_ast_rec& rec)
+        {
+            visits++;
+            if (rec.node.index() == 2)
+            {
+                if (!mentions_any(*std::get<2>(rec.node), names))
+                    return walk_action::SKIP;
+
+                auto copy = shared_copy(rec);
+                rec.node = std::move(copy->node);
+            }
+
+            switch (rec.node.index())
+            {
+            case 0:
+                if (std::get<0>(rec.node).id == varname)
+                    rec.node = lazy_link;
+                return walk_action::SKIP;
+            case 1:
+            {
+                auto& op = std::get<1>(rec.node);
+                if (op.tag == node_tag::FORALL
+                    && std::get<0>(op.args[0]->node).id == varname)
+                    return walk_action::SKIP;
+                return walk_action::DESCEND;
+            }
+            default:
+                assert(false && "Unexpected node type!");
+                return walk_action::SKIP;
+            }
+        });
+        counters.substitution_visits.add(visits);
+    }
+
+    /**
+     * Beta step rewriting the redex node itself, so a redex inside a shared
+     * argument is contracted once for all of its occurrences. Only a shared
+     * function is copied, and the referrals of its body are kept where possible.
+     */
+    void contract_shared(rendering_ast_rec& rec)
+    {
+        auto& parent_op = std::get<1>(rec.node);
+
+        auto& function = parent_op.args[0];
+        if (function->node.index() == 2)
+            function = shared_copy(*function);
+
+        auto ptr = shared_argument(parent_op.args[1]);
+
+        auto& name_holder_rec = function->child(0);
+        if (name_holder_rec.node.index() != 0)
+        {
+            assert(false);
+            return;
+        }
+        symbol_id const varname = std::get<0>(name_holder_rec.node).id;
+
+        substitute_shared(function->child(1), varname, ptr);
+
+        auto newnode = std::move(function->child(1).node);
+
+        rec.node = std::move(newnode);
+        done++;
+        counters.beta_steps.add();
+    }
+
+    [[nodiscard]]
+    static size_t saturating_add(size_t lhs, size_t rhs)
+    {
+        return lhs > std::numeric_limits<size_t>::max() - rhs
+               ? std::numeric_limits<size_t>::max()
+               : lhs + rhs;
+    }
+
+    /**
+     * Number of occurrences of target in the term with referrals expanded,
+     * every shared subterm is counted once
+     */
+    [[nodiscard]]
+    static size_t count_occurrences(rendering_ast_rec& root, rendering_ast_rec const* target)
+    {
+        struct counter : walk_visitor
+        {
+            walk_action enter(rendering_ast_rec& rec)
+            {
+                if (&rec == target)
+                {
+                    sums.back() = saturating_add(sums.back(), 1);
+                    return walk_action::SKIP;
+                }
+
+                if (rec.node.index() != 2)
+                    return walk_action::DESCEND;
+
+                auto it = known.find(std::get<2>(rec.node).get());
+                if (it != known.end())
+                {
+                    sums.back() = saturating_add(sums.back(), it->second);
+                    return walk_action::SKIP;
+                }
+
+                sums.push_back(0);
+                return walk_action::DESCEND;
+            }
+
+            void leave(rendering_ast_rec& rec)
+            {
+                if (rec.node.index() != 2)
+                    return;
+
+                size_t const inside = sums.back();
+                sums.pop_back();
+                known.emplace(std::get<2>(rec.node).get(), inside);
+                sums.back() = saturating_add(sums.back(), inside);
+            }
+
+            rendering_ast_rec const*                                target;
+            std::vector<size_t>                                     sums{0};
+            std::unordered_map<rendering_ast_rec const*, size_t>    known;
+        } visitor;
+
+        visitor.target = target;
+        walk(root, visitor);
+
+        assert(visitor.sums.size() == 1);
+        return visitor.sums.back();
+    }
+
+    /**
+     * Declared first, so it dies after the parser and every node of the context
+     */
+    node_arena<rendering_userdata>                      arena;
+    name_storage                                        names;
+    parsing_context<rendering_userdata>                 parser;
+    size_t                                              next_name{0};
+    /**
+     * Contexts reducing parts of one term make names of different residues
+     */
+    size_t                                              name_stride{1};
+    rename_map_t                                        renames;
+    size_t                                              done{0};
+    render_cache*                                       renders{nullptr};
+    bool                                                heap_nodes{false};
+    reduction_stats                                     counters;
+    std::chrono::steady_clock::time_point               started{std::chrono::steady_clock::now()};
+};
+
+/**
+ * Zipper over the normal order search: keeps the path to the last contracted
+ * redex and the nodes still to visit after it, so the next search resumes there.
+ *
+ * Nodes before the contracted one in pre-order are untouched by the step, so
+ * the only one of them which can become a redex is the application having the
+ * contracted node (seen through referrals) as its function. Otherwise the next
+ * redex is the first one from the contracted node on, the same one reduce finds.
+ */
+class reduction_context::redex_cursor
+{
+    enum class attachment
+    {
+        ROOT,
+        FUNCTION,
+        ARGUMENT,
+        BODY,
+        TARGET
+    };
+
+    struct position
+    {
+        rendering_ast_rec*  rec;
+        attachment          via;
+        size_t              depth;
+    };
+
+public:
+    redex_cursor(reduction_context& context, rendering_ast_rec& root)
+            : context(context)
+    {
+        reset(root);
+    }
+
+    /**
+     * Restarts the search from the root, needed after the tree was changed from outside
+     */
+    void reset(rendering_ast_rec& root)
+    {
+        pending.clear();
+        path.clear();
+        current = {&root, attachment::ROOT, 0};
+        has_current = true;
+    }
+
+    bool reduce()
+    {
+        node_arena<rendering_userdata>::scope arena_guard(context.allocator());
+
+        size_t visits = 0;
+        while (true)
+        {
+            if (!has_current)
+            {
+                if (pending.empty())
+                {
+                    context.count_search(visits);
+                    return false;
+                }
+
+                current = pending.back();
+                pending.pop_back();
+                path.resize(current.depth);
+            }
+
+            auto& rec = *current.rec;
+            visits++;
+            if (is_redex(rec))
+            {
+                context.count_search(visits);
+                context.contract(rec);
+                if (context.renders != nullptr)
+                {
+                    for (auto const& pos : path)
+                        render_cache::invalidate(*pos.rec);
+                    render_cache::invalidate_tree(rec);
+                }
+                step_back();
+                return true;
+            }
+
+            has_current = false;
+            switch (rec.node.index())
+            {
+            case 0:
+                break;
+            case 1:
+            {
+                auto& op = std::get<1>(rec.node);
+                path.push_back(current);
+                if (op.tag == node_tag::FORALL)
+                    pending.push_back({op.args[1].get(), attachment::BODY, path.size()});
+                else
+                {
+                    pending.push_back({op.args[1].get(), attachment::ARGUMENT, path.size()});
+                    pending.push_back({op.args[0].get(), attachment::FUNCTION, path.size()});
+                }
+                break;
+            }
+            case 2:
+                path.push_back(current);
+                pending.push_back({std::get<2>(rec.node).get(), attachment::TARGET, path.size()});
+                break;
+            default:
+                assert(false && "Unexpected node type!");
+            }
+        }
+    }
+
+private:
+    /**
+     * Moves the focus to the application of the contracted node if it became
+     * a redex, otherwise the search goes on from the contracted node itself
+     */
+    void step_back()
+    {
+        has_current = true;
+
+        size_t depth = path.size();
+        attachment via = current.via;
+        while (via == attachment::TARGET)
+            via = path[--depth].via;
+
+        if (via != attachment::FUNCTION
+            || !is_redex(*path[depth - 1].rec))
+            return;
+
+        assert(pending.back().via == attachment::ARGUMENT
+               && pending.back().depth == depth);
+        pending.pop_back();
+
+        current = path[depth - 1];
+        path.resize(depth - 1);
+    }
+
+    reduction_context&      context;
+    std::vector<position>   pending;
+    std::vector<position>   path;
+    position                current{};
+    bool                    has_current{false};
+};
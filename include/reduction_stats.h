@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+/**
+ * Build with -DLAMBDA_STATS=0 to compile the counters out of the hot paths
+ */
+#ifndef LAMBDA_STATS
+#define LAMBDA_STATS 1
+#endif
+
+constexpr bool stats_enabled = LAMBDA_STATS != 0;
+
+/**
+ * Counter which does nothing and stays 0 when stats are compiled out
+ */
+class stat_counter
+{
+public:
+    void add(size_t n = 1)
+    {
+        if constexpr (stats_enabled)
+            count += n;
+    }
+
+    void raise_to(size_t n)
+    {
+        if constexpr (stats_enabled)
+            count = std::max(count, n);
+    }
+
+    [[nodiscard]]
+    size_t value() const
+    {
+        return count;
+    }
+
+private:
+    size_t  count{0};
+};
+
+/**
+ * Counters of the work done by reduction_context, see reduction_context::stats
+ */
+struct reduction_stats
+{
+    /**
+     * Counters taken every few steps, see reduction_context::record_sample
+     */
+    struct sample
+    {
+        size_t      beta_steps;
+        uint64_t    elapsed_ns;
+        size_t      live_nodes;
+        size_t      reduce_visits;
+        size_t      copied_nodes;
+        size_t      substitution_visits;
+        size_t      fresh_names;
+    };
+
+    stat_counter        beta_steps;
+    /**
+     * Searches for a redex and the nodes they went through, in total and at most in one
+     */
+    stat_counter        reduce_calls;
+    stat_counter        reduce_visits;
+    stat_counter        max_reduce_visits;
+    /**
+     * Nodes made when a referral target or a function is copied to be unshared
+     */
+    stat_counter        copied_nodes;
+    /**
+     * Nodes visited while replacing the bound variable with the argument
+     */
+    stat_counter        substitution_visits;
+    stat_counter        fresh_names;
+    /**
+     * Most nodes alive in the arena at once, heap nodes are not counted
+     */
+    stat_counter        peak_live_nodes;
+    stat_counter        printed_bytes;
+    /**
+     * Closed subterms looked up in the normal form cache, and the ones found there
+     */
+    stat_counter        cache_lookups;
+    stat_counter        cache_hits;
+    std::vector<sample> series;
+
+    /**
+     * Adds up the counters of other, which did its work alongside this one.
+     * The time series of other is dropped.
+     */
+    void merge(reduction_stats const& other)
+    {
+        beta_steps.add(other.beta_steps.value());
+        reduce_calls.add(other.reduce_calls.value());
+        reduce_visits.add(other.reduce_visits.value());
+        max_reduce_visits.raise_to(other.max_reduce_visits.value());
+        copied_nodes.add(other.copied_nodes.value());
+        substitution_visits.add(other.substitution_visits.value());
+        fresh_names.add(other.fresh_names.value());
+        peak_live_nodes.raise_to(other.peak_live_nodes.value());
+        printed_bytes.add(other.printed_bytes.value());
+        cache_lookups.add(other.cache_lookups.value());
+        cache_hits.add(other.cache_hits.value());
+    }
+
+    void write_json(std::ostream& out) const
+    {
+        double const hit_rate = cache_lookups.value() == 0 ? 0.0 : double(cache_hits.value()) / cache_lookups.value();
+
+        out << "{\n"
+            << "  \"enabled\": " << (stats_enabled ? "true" : "false") << ",\n"
+            << "  \"beta_steps\": " << beta_steps.value() << ",\n"
+            << "  \"reduce_calls\": " << reduce_calls.value() << ",\n"
+            << "  \"reduce_visits\": " << reduce_visits.value() << ",\n"
+            << "  \"max_reduce_visits\": " << max_reduce_visits.value() << ",\n"
+            << "  \"copied_nodes\": " << copied_nodes.value() << ",\n"
+            << "  \"substitution_visits\": " << substitution_visits.value() << ",\n"
+            << "  \"fresh_names\": " << fresh_names.value() << ",\n"
+            << "  \"peak_live_nodes\": " << peak_live_nodes.value() << ",\n"
+            << "  \"printed_bytes\": " << printed_bytes.value() << ",\n"
+            << "  \"cache_lookups\": " << cache_lookups.value() << ",\n"
+            << "  \"cache_hits\": " << cache_hits.value() << ",\n"
+            << "  \"cache_hit_rate\": " << hit_rate << ",\n"
+            << "  \"series\": [";
+
+        for (size_t i = 0; i < series.size(); ++i)
+        {
+            auto const& s = series[i];
+            out << (i == 0 ? "\n" : ",\n")
+                << "    {\"beta_steps\": " << s.beta_steps
+                << ", \"elapsed_ns\": " << s.elapsed_ns
+                << ", \"live_nodes\": " << s.live_nodes
+                << ", \"reduce_visits\": " << s.reduce_visits
+                << ", \"copied_nodes\": " << s.copied_nodes
+                << ", \"substitution_visits\": " << s.substitution_visits
+                << ", \"fresh_names\": " << s.fresh_names << "}";
+        }
+
+        out << (series.empty() ? "]\n" : "\n  ]\n") << "}\n";
+    }
+};
@@ -0,0 +1,288 @@
+#pragma once
+
+#include "hash_cons.h"
+#include "lambdas.h"
+#include "output_buffer.h"
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct rendering_userdata;
+
+using rendering_ast_rec = ast_record<rendering_userdata>;
+using rendering_ast_rec_ptr = ast_record_ptr<rendering_userdata>;
+
+/**
+ * Rendered text of a subtree as a rope: the text of the node with the
+ * renderings of its big children and of referral targets spliced in
+ */
+struct rendering
+{
+    struct splice
+    {
+        size_t                              offset;
+        std::shared_ptr<rendering const>    child;
+        /**
+         * Used when child is null: the current rendering of the target is
+         * taken at print time, so changes of a shared subtree do not
+         * invalidate the nodes referring to it
+         */
+        rendering_ast_rec*                  target;
+    };
+
+    std::string         text;
+    std::vector<splice> splices;
+    size_t              epoch{0};
+};
+
+struct rendering_userdata
+{
+    explicit rendering_userdata([[maybe_unused]] ast_record<rendering_userdata>* owner)
+    {
+        assert(&owner->userdata == this);
+    };
+
+    /**
+     * Copies get renamed, they are rendered anew
+     */
+    rendering_userdata(rendering_userdata const&)
+    {}
+
+    rendering_userdata& operator=(rendering_userdata const&)
+    {
+        cache.reset();
+        print_cache = {};
+        return *this;
+    }
+
+    /**
+     * Kept only for subtrees with more text than render_cache::inline_limit
+     */
+    std::shared_ptr<rendering const> cache;
+    /**
+     * Filled by normal_form_cache, see cache_fingerprints
+     */
+    mutable fingerprint_cache        print_cache;
+};
+
+/**
+ * Memoized printing of a term kept in node userdata.
+ *
+ * A node keeps its rendering until it is invalidated: whoever changes a node
+ * in place invalidates it together with its ancestors up to the nearest
+ * referral target. Printing again renders only the invalidated nodes and
+ * copies the cached pieces of the others. Small subtrees are not kept,
+ * they are rendered into their parents.
+ */
+class render_cache
+{
+public:
+    /**
+     * Subtrees with less text are copied into the parent's rendering instead of spliced
+     */
+    constexpr static size_t inline_limit = 64;
+
+    /**
+     * Drops every rendering at once, for changes all over the term
+     */
+    void clear()
+    {
+        epoch++;
+    }
+
+    static void invalidate(rendering_ast_rec& rec)
+    {
+        rec.userdata.cache.reset();
+    }
+
+    /**
+     * Invalidates rec and all of its subtree which is not behind a referral
+     */
+    static void invalidate_tree(rendering_ast_rec& rec)
+    {
+        preorder_walk(rec, [] (rendering_ast_rec& cur)
+        {
+            invalidate(cur);
+            return cur.node.index() == 2 ? walk_action::SKIP : walk_action::DESCEND;
+        });
+    }
+
+    /**
+     * Byte for byte the output of ast_record's operator<<
+     */
+    void print(output_buffer& out, rendering_ast_rec& root)
+    {
+        struct cursor
+        {
+            rendering const*    rope;
+            size_t              next_splice;
+            size_t              offset;
+        };
+
+        // Renderings of small referral targets live until the end of the print
+        std::deque<piece> targets;
+
+        auto const top_piece = render(root);
+
+        pooled_stack<cursor> pending;
+        auto& stack = pending.items;
+        stack.push_back({top_piece.get(), 0, 0});
+
+        while (!stack.empty())
+        {
+            auto& top = stack.back();
+            std::string_view const text = top.rope->text;
+
+            if (top.next_splice == top.rope->splices.size())
+            {
+                out.append(text.substr(top.offset));
+                stack.pop_back();
+                continue;
+            }
+
+            auto const& splice = top.rope->splices[top.next_splice++];
+            out.append(text.substr(top.offset, splice.offset - top.offset));
+            top.offset = splice.offset;
+
+            rendering const* next = splice.child.get();
+            if (next == nullptr)
+            {
+                // The target may have changed since the rope was made
+                auto* target = splice.target;
+                while (target->node.index() == 2)
+                    target = std::get<2>(target->node).get();
+
+                targets.push_back(render(*target));
+                next = targets.back().get();
+            }
+
+            stack.push_back({next, 0, 0});
+        }
+    }
+
+private:
+    /**
+     * Either the kept rendering of a node or a temporary one of a small subtree
+     */
+    struct piece
+    {
+        std::shared_ptr<rendering const>    kept;
+        rendering                           small;
+
+        [[nodiscard]]
+        rendering const* get() const
+        {
+            return kept ? kept.get() : &small;
+        }
+    };
+
+    [[nodiscard]]
+    bool is_valid(rendering_ast_rec const& rec) const
+    {
+        return rec.userdata.cache && rec.userdata.cache->epoch == epoch;
+    }
+
+    /**
+     * Appends a child's rendering, big ones are spliced and small ones copied
+     */
+    static void add_child(rendering& result, piece&& child)
+    {
+        if (child.kept)
+        {
+            result.splices.push_back({result.text.size(), std::move(child.kept), nullptr});
+            return;
+        }
+
+        for (auto& splice : child.small.splices)
+            result.splices.push_back({result.text.size() + splice.offset, std::move(splice.child), splice.target});
+        result.text.append(child.small.text);
+    }
+
+    /**
+     * Renders the invalidated nodes of the tree of root, referral targets
+     * are left to print
+     */
+    piece render(rendering_ast_rec& root)
+    {
+        if (is_valid(root))
+            return {root.userdata.cache, {}};
+
+        struct renderer : walk_visitor
+        {
+            walk_action enter(rendering_ast_rec& rec)
+            {
+                if (cache.is_valid(rec))
+                {
+                    pieces.push_back({rec.userdata.cache, {}});
+                    return walk_action::SKIP;
+                }
+
+                switch (rec.node.index())
+                {
+                case 0:
+                {
+                    auto& var = std::get<0>(rec.node);
+                    pieces.emplace_back();
+                    var.symbols->append(pieces.back().small.text, var.id);
+                    return walk_action::SKIP;
+                }
+                case 2:
+                    pieces.emplace_back();
+                    pieces.back().small.splices.push_back({0, nullptr, std::get<2>(rec.node).get()});
+                    return walk_action::SKIP;
+                default:
+                    return walk_action::DESCEND;
+                }
+            }
+
+            void leave(rendering_ast_rec& rec)
+            {
+                auto& op = std::get<1>(rec.node);
+                rendering result;
+
+                result.text.push_back('(');
+                if (op.tag == node_tag::FORALL)
+                {
+                    auto& var = std::get<0>(op.args[0]->node);
+                    result.text.push_back('\\');
+                    var.symbols->append(result.text, var.id);
+                    result.text.push_back('.');
+                    add_child(result, std::move(pieces.back()));
+                    pieces.pop_back();
+                }
+                else
+                {
+                    add_child(result, std::move(pieces[pieces.size() - 2]));
+                    result.text.push_back(' ');
+                    add_child(result, std::move(pieces.back()));
+                    pieces.pop_back();
+                    pieces.pop_back();
+                }
+                result.text.push_back(')');
+
+                if (result.text.size() <= inline_limit
+                    && result.splices.size() <= 1)
+                {
+                    pieces.push_back({nullptr, std::move(result)});
+                    return;
+                }
+
+                result.epoch = cache.epoch;
+                rec.userdata.cache = std::make_shared<rendering const>(std::move(result));
+                pieces.push_back({rec.userdata.cache, {}});
+            }
+
+            render_cache&       cache;
+            std::vector<piece>  pieces;
+        } visitor{{}, *this, {}};
+
+        walk(root, visitor);
+
+        assert(visitor.pieces.size() == 1);
+        return std::move(visitor.pieces.back());
+    }
+
+    size_t  epoch{1};
+};
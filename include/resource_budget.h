@@ -0,0 +1,128 @@
+#pragma once
+
+#include "node_arena.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <limits>
+
+/**
+ * Limits of one reduction besides its number of steps, 0 for no limit
+ */
+struct resource_budget
+{
+    /**
+     * Nodes alive in the arena of the reduction
+     */
+    size_t                      max_live_nodes{0};
+    /**
+     * Memory of the live nodes plus the output written so far
+     */
+    size_t                      max_bytes{0};
+    std::chrono::milliseconds   max_time{0};
+
+    [[nodiscard]]
+    bool limits_anything() const
+    {
+        return max_live_nodes != 0 || max_bytes != 0 || max_time.count() != 0;
+    }
+
+    /**
+     * Nodes the node and byte limits allow, the maximum of size_t without them
+     * @node_bytes  memory of one node
+     */
+    [[nodiscard]]
+    size_t node_allowance(size_t node_bytes) const
+    {
+        size_t allowance = std::numeric_limits<size_t>::max();
+        if (max_live_nodes != 0)
+            allowance = max_live_nodes;
+        if (max_bytes != 0)
+            allowance = std::min(allowance, max_bytes / node_bytes);
+        return allowance;
+    }
+};
+
+enum class budget_limit
+{
+    NONE,
+    LIVE_NODES,
+    BYTES,
+    WALL_TIME
+};
+
+[[nodiscard]]
+inline char const* describe(budget_limit limit)
+{
+    switch (limit)
+    {
+    case budget_limit::NONE:
+        return "no limit";
+    case budget_limit::LIVE_NODES:
+        return "live node limit";
+    case budget_limit::BYTES:
+        return "byte limit";
+    case budget_limit::WALL_TIME:
+        return "time limit";
+    }
+    return "unknown limit";
+}
+
+/**
+ * Checks a resource_budget between reduction steps. Nodes are counted by
+ * the arena, so a check costs two compares and a read of the monotonic
+ * clock, which is small next to the search for a redex. A single step may
+ * still go over a limit by the size of what it copies before the next
+ * check sees it.
+ */
+template<typename UD>
+class budget_guard
+{
+public:
+    /**
+     * @arena   arena of the reduced term, the time is counted from now
+     */
+    budget_guard(resource_budget const& budget, node_arena<UD> const& arena)
+            : budget(budget),
+              arena(arena),
+              started(std::chrono::steady_clock::now())
+    {}
+
+    /**
+     * @output_bytes    bytes of output written so far
+     */
+    [[nodiscard]]
+    budget_limit check(size_t output_bytes) const
+    {
+        if (budget.max_live_nodes != 0 && arena.live_nodes() > budget.max_live_nodes)
+            return budget_limit::LIVE_NODES;
+
+        if (budget.max_bytes != 0 && arena.live_bytes() + output_bytes > budget.max_bytes)
+            return budget_limit::BYTES;
+
+        if (budget.max_time.count() != 0
+            && std::chrono::steady_clock::now() - started > budget.max_time)
+            return budget_limit::WALL_TIME;
+
+        return budget_limit::NONE;
+    }
+
+    /**
+     * Bytes of output the byte limit still allows, the maximum of size_t without one
+     */
+    [[nodiscard]]
+    size_t output_left(size_t output_bytes) const
+    {
+        if (budget.max_bytes == 0)
+            return std::numeric_limits<size_t>::max();
+
+        size_t const used = arena.live_bytes() + output_bytes;
+        return used < budget.max_bytes ? budget.max_bytes - used : 0;
+    }
+
+private:
+    resource_budget const&                  budget;
+    node_arena<UD> const&                   arena;
+    std::chrono::steady_clock::time_point   started;
+};
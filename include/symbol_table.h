@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cassert>
+#include <charconv>
+#include <iterator>
+#include <limits>
+#include <cstddef>
+#include <deque>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using symbol_id = size_t;
+
+/**
+ * Interns variable names of one parsing context into small integer ids.
+ *
+ * Besides interned names there are generated ids which carry only a number
+ * and are printed as prefix + number, so fresh names never touch the table.
+ */
+class symbol_table
+{
+public:
+    constexpr static symbol_id generated_bit = ~(~symbol_id{0} >> 1u);
+
+    symbol_table() = default;
+
+    symbol_table(symbol_table const&) = delete;
+    symbol_table& operator=(symbol_table const&) = delete;
+
+    [[nodiscard]]
+    symbol_id intern(std::string_view name)
+    {
+        auto it = index.find(name);
+        if (it != index.end())
+            return it->second;
+
+        return add(storage.emplace_back(name));
+    }
+
+    /**
+     * Same as intern, but a new name is kept as a view of the caller's
+     * buffer instead of a copy, the buffer must outlive the table
+     */
+    [[nodiscard]]
+    symbol_id intern_borrowed(std::string_view name)
+    {
+        auto it = index.find(name);
+        if (it != index.end())
+            return it->second;
+
+        return add(name);
+    }
+
+    [[nodiscard]]
+    constexpr static symbol_id generated(size_t number)
+    {
+        return generated_bit | number;
+    }
+
+    [[nodiscard]]
+    constexpr static bool is_generated(symbol_id id)
+    {
+        return (id & generated_bit) != 0;
+    }
+
+    [[nodiscard]]
+    std::string name(symbol_id id) const
+    {
+        if (is_generated(id))
+            return generated_prefix + std::to_string(id & ~generated_bit);
+
+        return std::string(names[id]);
+    }
+
+    [[nodiscard]]
+    size_t hash(symbol_id id) const
+    {
+        if (is_generated(id))
+            return std::hash<std::string>()(name(id));
+
+        return hashes[id];
+    }
+
+    std::ostream& print(std::ostream& out, symbol_id id) const
+    {
+        if (is_generated(id))
+            return out << generated_prefix << (id & ~generated_bit);
+
+        return out << names[id];
+    }
+
+    /**
+     * Same as print, for output_buffer
+     */
+    void append(std::string& out, symbol_id id) const
+    {
+        if (!is_generated(id))
+        {
+            out.append(names[id]);
+            return;
+        }
+
+        char digits[std::numeric_limits<size_t>::digits10 + 1];
+        auto const end = std::to_chars(std::begin(digits), std::end(digits), id & ~generated_bit).ptr;
+
+        out.append(generated_prefix);
+        out.append(digits, end);
+    }
+
+    [[nodiscard]]
+    size_t size() const
+    {
+        return names.size();
+    }
+
+    /**
+     * Forgets every interned name. The table itself stays, so variables of
+     * older terms still point to a live one, but their interned ids mean
+     * nothing anymore.
+     */
+    void clear()
+    {
+        storage.clear();
+        names.clear();
+        hashes.clear();
+        index.clear();
+    }
+
+    std::string                                     generated_prefix{"pinus"};
+
+private:
+    symbol_id add(std::string_view stored)
+    {
+        symbol_id const id = names.size();
+        assert(!is_generated(id));
+
+        names.emplace_back(stored);
+        hashes.push_back(std::hash<std::string_view>()(stored));
+        index.emplace(stored, id);
+        return id;
+    }
+
+    std::deque<std::string>                         storage;
+    std::vector<std::string_view>                   names;
+    std::vector<size_t>                             hashes;
+    std::unordered_map<std::string_view, symbol_id> index;
+};
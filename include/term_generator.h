@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+
+/**
+ * Terms in the grammar of parsing_context, built as text for benchmarks and
+ * stress tests. Every term here is closed and fully parenthesized, so it can
+ * be glued into bigger terms as is.
+ */
+
+inline std::string const church_plus = "(\\m.\\n.\\f.\\x.m f (n f x))";
+inline std::string const church_mult = "(\\m.\\n.\\f.m (n f))";
+inline std::string const church_pred = "(\\n.\\f.\\x.n (\\g.\\h.h (g f)) (\\u.x) (\\u.u))";
+inline std::string const church_true = "(\\a.\\b.a)";
+inline std::string const church_false = "(\\a.\\b.b)";
+inline std::string const church_is_zero = "(\\n.n (\\u." + church_false + ") " + church_true + ")";
+inline std::string const y_combinator = "(\\f.(\\x.f (x x)) (\\x.f (x x)))";
+
+[[nodiscard]]
+inline std::string church_numeral(size_t n)
+{
+    std::string result = "(\\f.\\x.";
+    for (size_t i = 1; i < n; ++i)
+        result += "f (";
+    result += n == 0 ? "x" : "f x";
+    result.append(n == 0 ? 0 : n - 1, ')');
+    return result + ")";
+}
+
+/**
+ * Nested applications of the identity, one redex inside the other:
+ * exactly steps contractions to the normal form in normal order
+ */
+[[nodiscard]]
+inline std::string identity_chain(size_t steps)
+{
+    std::string result = "(\\y.";
+    for (size_t i = 0; i < steps; ++i)
+        result += "(\\x.x) (";
+    result += "y";
+    result.append(steps, ')');
+    return result + ")";
+}
+
+enum class term_shape
+{
+    /**
+     * Complete binary tree of applications
+     */
+    BALANCED,
+    /**
+     * x x ... x, each application is the function of the next one
+     */
+    LEFT_SPINE,
+    /**
+     * x (x (... x)), each application is the argument of the previous one
+     */
+    RIGHT_SPINE
+};
+
+/**
+ * Application tree of the given shape with n occurrences of the only bound
+ * variable, rounded up to a power of two for BALANCED
+ */
+[[nodiscard]]
+inline std::string shaped_term(term_shape shape, size_t n)
+{
+    n = std::max<size_t>(n, 1);
+    std::string result = "(\\x.";
+
+    switch (shape)
+    {
+    case term_shape::BALANCED:
+    {
+        std::string tree = "x";
+        for (size_t leaves = 1; leaves < n; leaves *= 2)
+            tree = leaves == 1 ? "x x" : "(" + tree + ") (" + tree + ")";
+        result += tree;
+        break;
+    }
+    case term_shape::LEFT_SPINE:
+        result += "x";
+        for (size_t i = 1; i < n; ++i)
+            result += " x";
+        break;
+    case term_shape::RIGHT_SPINE:
+        for (size_t i = 2; i < n; ++i)
+            result += "x (";
+        result += n == 1 ? "x" : "x x";
+        result.append(n < 2 ? 0 : n - 2, ')');
+        break;
+    }
+
+    return result + ")";
+}
+
+struct random_term_parameters
+{
+    /**
+     * Chance of a node to be an abstraction rather than an application
+     */
+    double  binder_density{0.3};
+    /**
+     * Chance of an application to have an abstraction as its function
+     */
+    double  redex_density{0.2};
+    /**
+     * Nodes deeper than this become variables, 0 for no limit
+     */
+    size_t  max_depth{0};
+};
+
+/**
+ * Random closed terms of a given size. Every variable is bound by one of
+ * the abstractions around it, the one at depth d binding the name vd.
+ */
+class random_term_generator
+{
+public:
+    explicit random_term_generator(uint64_t seed, random_term_parameters params = {})
+            : engine(seed),
+              params(params)
+    {}
+
+    /**
+     * @size    number of abstractions, applications and variables, approximately
+     *          when max_depth cuts the tree
+     */
+    [[nodiscard]]
+    std::string generate(size_t size)
+    {
+        std::string result;
+        generate(result, std::max<size_t>(size, 2), 0, 0);
+        return result;
+    }
+
+private:
+    void generate(std::string& out, size_t size, size_t binders, size_t depth)
+    {
+        bool const depth_left = params.max_depth == 0 || depth < params.max_depth;
+
+        if (binders != 0 && (size <= 1 || !depth_left))
+        {
+            out += 'v';
+            out += std::to_string(std::uniform_int_distribution<size_t>(0, binders - 1)(engine));
+            return;
+        }
+
+        if (binders == 0 || size == 2 || chance(params.binder_density))
+        {
+            generate_abstraction(out, size, binders, depth);
+            return;
+        }
+
+        size_t const function_size = std::uniform_int_distribution<size_t>(1, size - 2)(engine);
+        out += '(';
+        if (function_size >= 2 && chance(params.redex_density))
+            generate_abstraction(out, function_size, binders, depth + 1);
+        else
+            generate(out, function_size, binders, depth + 1);
+        out += ' ';
+        generate(out, size - 1 - function_size, binders, depth + 1);
+        out += ')';
+    }
+
+    void generate_abstraction(std::string& out, size_t size, size_t binders, size_t depth)
+    {
+        out += "(\\v";
+        out += std::to_string(binders);
+        out += '.';
+        generate(out, std::max<size_t>(size - 1, 1), binders + 1, depth + 1);
+        out += ')';
+    }
+
+    [[nodiscard]]
+    bool chance(double probability)
+    {
+        return std::bernoulli_distribution(probability)(engine);
+    }
+
+    std::mt19937_64         engine;
+    random_term_parameters  params;
+};
@@ -0,0 +1,51 @@
+#include "include/lambdas.h"
+#include "include/interaction_net.h"
+#include "include/input_buffer.h"
+
+#include <cstring>
+#include <iostream>
+
+/**
+ * Reads task2's input and prints the term and its normal form found by
+ * optimal reduction. Intermediate terms do not exist in the net, so m and k
+ * are only read for compatibility and the normal form is always printed.
+ */
+int main()
+{
+    std::ios_base::sync_with_stdio(false);
+
+    input_buffer input;
+    if (!input.load())
+    {
+        std::cerr << "Error reading stdin: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    task_input task;
+    if (!split_task_input(input.view(), task) || task.term.empty())
+    {
+        std::cerr << "Expected m, k and the term" << std::endl;
+        return -1;
+    }
+
+    parsing_context<empty_userdata> contxt(parsing_context<empty_userdata>::name_storage::BORROW);
+    auto parsed = contxt.parse_lambda(task.term);
+    std::cout << *parsed << std::endl;
+
+    interaction_net net(*parsed, contxt.symbols());
+    parsed.reset();
+
+    auto normal_form = net.normalize() ? net.read_back<empty_userdata>() : nullptr;
+    if (!normal_form)
+    {
+        std::cerr << "Optimal reduction broke the net, no normal form to print" << std::endl;
+        return -1;
+    }
+    std::cout << *normal_form << std::endl;
+
+    auto const& stats = net.stats();
+    std::cerr << "Interactions: " << stats.interactions << ", beta: " << stats.betas
+              << ", rounds: " << stats.rounds << std::endl;
+
+    return 0;
+}
@@ -1,6 +1,23 @@
 #include "3rd-party/gtest/gtest.h"
 #include "lambdas.h"
+#include "ast_dot.h"
+#include "de_bruijn.h"
+#include "hash_cons.h"
+#include "krivine.h"
+#include "normal_form_cache.h"
+#include "interaction_net.h"
+#include "output_buffer.h"
+#include "parallel_normalizer.h"
+#include "phase_tracer.h"
+#include "reduction_context.h"
+#include "render_cache.h"
+#include "resource_budget.h"
+#include "term_generator.h"
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <random>
 #include <sstream>
 
 static inline
@@ -79,24 +96,1051 @@ TEST(author, task1_sample2)
     test_str(str, result);
 }
 
+TEST(correctness, deep_parentheses)
+{
+    constexpr size_t depth = 1000000;
+    std::string str = std::string(depth, '(') + "x" + std::string(depth, ')') + " y";
+
+    parsing_context<empty_userdata> contxt;
+    auto ast_rec = contxt.parse_lambda(str);
+
+    std::stringstream ss;
+    ss << *ast_rec;
+    EXPECT_EQ(ss.str(), "(x y)");
+}
+
+TEST(correctness, deep_application_spine)
+{
+    constexpr size_t depth = 1000000;
+    std::string str;
+    for (size_t i = 0; i < depth; ++i)
+        str += "x ";
+
+    parsing_context<empty_userdata> contxt;
+    auto ast_rec = contxt.parse_lambda(str);
+    auto copy = ast_rec->deep_copy();
+
+    std::stringstream ss;
+    ss << *copy;
+    EXPECT_EQ(ss.str().size(), 4 * depth - 3);
+}
+
+TEST(correctness, deep_referral_chain)
+{
+    constexpr size_t depth = 1000000;
+
+    parsing_context<empty_userdata> contxt;
+    auto make_chain = [&contxt]
+    {
+        std::shared_ptr<empty_ast_rec> chain = contxt.parse_lambda("x");
+        for (size_t i = 0; i < depth; ++i)
+            chain = make_record<empty_userdata>(ast_node<empty_userdata>{std::move(chain)});
+        return chain;
+    };
+
+    // One chain released on its own, one through the node holding it
+    auto chain = make_chain();
+    EXPECT_FALSE(chain->has_node_tag(node_tag::APPLICATION));
+    chain.reset();
+
+    auto app = make_record<empty_userdata>(binary_operation(node_tag::APPLICATION,
+                                                            make_record<empty_userdata>(ast_node<empty_userdata>{make_chain()}),
+                                                            contxt.parse_lambda("y")));
+    app.reset();
+}
+
+TEST(correctness, deep_dot_output)
+{
+    constexpr size_t depth = 1000000;
+    std::string str;
+    for (size_t i = 0; i < depth; ++i)
+        str += "x ";
+    str += "\\y.y";
+
+    parsing_context<empty_userdata> contxt;
+    auto ast_rec = contxt.parse_lambda(str);
+
+    output_buffer out(output_buffer::in_memory, 0);
+    append_dot(out, *ast_rec);
+    auto const dot = out.release();
+
+    // A node line for each of the depth + 2 leaves and depth + 1 inner nodes, two edges for the inner ones
+    EXPECT_EQ(static_cast<size_t>(std::count(dot.begin(), dot.end(), '\n')), 4 * depth + 5);
+    std::string const last = " [label=\"y\" color=\"#000d16\"];\n";
+    ASSERT_GT(dot.size(), last.size());
+    EXPECT_EQ(dot.substr(dot.size() - last.size()), last);
+}
+
 TEST(correctness, userdata_test)
 {
-    auto x_hash = std::hash<std::string>()("x");
+    auto const x_print = free_fingerprint(std::hash<std::string>()("x"));
 
-    parsing_context<hashing_userdata> contxt;
+    parsing_context<fingerprint_userdata> contxt;
 
     auto ast_rec = contxt.parse_lambda({"x", 1});
-    assert(ast_rec->userdata.hashcode == x_hash);
+    EXPECT_FALSE(ast_rec->userdata.print_cache.known);
+    EXPECT_EQ(fingerprint(*ast_rec).hash, x_print);
+    EXPECT_TRUE(ast_rec->userdata.print_cache.known);
 
     contxt.reset();
     ast_rec = contxt.parse_lambda({"\\x.x", 4});
-    assert(ast_rec->userdata.hashcode == (((((x_hash * 31u) + 42) * 31u) + x_hash ) * 31) + 0xcaffab27);
+    EXPECT_EQ(fingerprint(*ast_rec).hash, abstraction_fingerprint(bound_fingerprint(0)));
+    // The body was walked under its binder, alone its variable is free
+    auto const& body = ast_rec->child(1);
+    EXPECT_TRUE(body.userdata.print_cache.known);
+    EXPECT_FALSE(body.userdata.print_cache.self_contained);
+    EXPECT_EQ(fingerprint(body).hash, x_print);
+    EXPECT_EQ(fingerprint(*ast_rec).hash, abstraction_fingerprint(bound_fingerprint(0)));
 
     contxt.reset();
     ast_rec = contxt.parse_lambda({"x x", 3});
-    assert(ast_rec->userdata.hashcode == (((((x_hash * 31u) + 971u) * 31u) + x_hash ) * 31) + 0xcaffab27);
+    EXPECT_EQ(fingerprint(*ast_rec).hash, application_fingerprint(x_print, x_print));
+}
+
+TEST(correctness, userdata_hashes_both_args)
+{
+    parsing_context<fingerprint_userdata> contxt;
+
+    auto identity = contxt.parse_lambda({"\\x.x", 4});
+    contxt.reset();
+    auto renamed = contxt.parse_lambda({"\\y.y", 4});
+    contxt.reset();
+    auto constant = contxt.parse_lambda({"\\x.y", 4});
+
+    EXPECT_EQ(fingerprint(*identity), fingerprint(*renamed));
+    EXPECT_TRUE(alpha_equivalent(*identity, *renamed));
+    EXPECT_NE(fingerprint(*identity), fingerprint(*constant));
+    EXPECT_FALSE(alpha_equivalent(*identity, *constant));
+}
+
+TEST(hash_cons, alpha_equivalence)
+{
+    parsing_context<empty_userdata> contxt;
+
+    auto lhs = contxt.parse_lambda("\\a.\\b.a (\\c.c b)");
+    contxt.reset();
+    auto rhs = contxt.parse_lambda("\\x.\\y.x (\\x.x y)");
+    contxt.reset();
+    auto other = contxt.parse_lambda("\\x.\\y.x (\\x.y y)");
+
+    EXPECT_TRUE(alpha_equivalent(*lhs, *rhs));
+    EXPECT_FALSE(alpha_equivalent(*lhs, *other));
+}
+
+TEST(hash_cons, fingerprints_are_alpha_invariant)
+{
+    parsing_context<empty_userdata> contxt;
+
+    auto lhs = contxt.parse_lambda("\\a.\\b.a (\\c.c b) z");
+    auto rhs = contxt.parse_lambda("\\x.\\y.x (\\x.x y) z");
+    auto other = contxt.parse_lambda("\\x.\\y.x (\\x.y y) z");
+    auto open = contxt.parse_lambda("\\x.\\y.x (\\x.x y) w");
+
+    auto const lhs_print = fingerprint(*lhs);
+    auto const rhs_print = fingerprint(*rhs);
+    EXPECT_EQ(lhs_print, rhs_print);
+    EXPECT_EQ(lhs_print.nodes, 13u);
+    EXPECT_FALSE(lhs_print.closed);
+    EXPECT_NE(fingerprint(*other), lhs_print);
+    EXPECT_NE(fingerprint(*open), lhs_print);
+    EXPECT_TRUE(fingerprint(*contxt.parse_lambda("\\x.\\y.x")).closed);
+
+    EXPECT_TRUE(alpha_equivalent(*lhs, lhs_print, *rhs, rhs_print));
+    EXPECT_FALSE(alpha_equivalent(*lhs, lhs_print, *other, fingerprint(*other)));
+
+    // Neither the fingerprint nor the comparison recurse over the depth
+    auto const spine = shaped_term(term_shape::RIGHT_SPINE, 200000);
+    auto deep = contxt.parse_lambda(spine);
+    auto copy = deep->deep_copy();
+    EXPECT_EQ(fingerprint(*deep), fingerprint(*copy));
+    EXPECT_TRUE(alpha_equivalent(*deep, *copy));
+}
+
+TEST(hash_cons, closed_normal_forms_are_shared)
+{
+    constexpr auto str = "\\z.(\\f.\\x.f (f x)) z (\\g.\\y.g (g y)) ((\\a.a) (\\a.a))";
+
+    parsing_context<empty_userdata> contxt;
+    auto ast_rec = contxt.parse_lambda({str, strlen(str)});
+
+    std::stringstream before;
+    before << *ast_rec;
+
+    hash_cons_table<empty_userdata> table(4);
+    size_t const replaced = table.intern(ast_rec);
+    EXPECT_EQ(replaced, 1u);
+    EXPECT_EQ(table.size(), 1u);
+
+    auto& numeral = ast_rec->child(1).child(0).child(0).child(0);
+    auto& copy = ast_rec->child(1).child(0).child(1);
+    ASSERT_EQ(numeral.node.index(), 2u);
+    ASSERT_EQ(copy.node.index(), 2u);
+    EXPECT_EQ(std::get<2>(numeral.node), std::get<2>(copy.node));
+
+    std::stringstream after;
+    after << *ast_rec;
+    EXPECT_NE(before.str(), after.str());
+
+    contxt.reset();
+    auto expected = contxt.parse_lambda({after.str().data(), after.str().size()});
+    contxt.reset();
+    auto original = contxt.parse_lambda({before.str().data(), before.str().size()});
+    EXPECT_TRUE(alpha_equivalent(*expected, *original));
+}
+
+TEST(hash_cons, intern_walks_deep_and_shared_terms)
+{
+    parsing_context<empty_userdata> contxt;
+
+    // A target referred to under different numbers of binders
+    constexpr auto str = "z (\\a.a (\\b.a a a) (a a a)) (\\a.a (\\b.a a a) (a a a))";
+    auto ast_rec = contxt.parse_lambda({str, strlen(str)});
+    auto& body = ast_rec->child(0).child(1).child(1);
+    std::shared_ptr<ast_record<empty_userdata>> shared = std::move(body.child_ptr(1));
+    body.child_ptr(1) = make_record<empty_userdata>(ast_node<empty_userdata>{shared});
+    body.child(0).child(1).child_ptr(1) = make_record<empty_userdata>(ast_node<empty_userdata>{shared});
+
+    hash_cons_table<empty_userdata> table(4);
+    size_t const replaced = table.intern(ast_rec);
+    EXPECT_EQ(replaced, 1u);
+
+    // Neither the walk nor the sharing recurse over the depth
+    auto const spine = shaped_term(term_shape::RIGHT_SPINE, 200000);
+    contxt.reset();
+    auto deep = contxt.parse_lambda("z " + spine + " " + spine);
+    auto copy = deep->deep_copy();
+
+    hash_cons_table<empty_userdata> deep_table(4);
+    size_t const deep_replaced = deep_table.intern(deep);
+    EXPECT_EQ(deep_replaced, 1u);
+
+    // Every closed normal subterm is shared, the second spine with the first one
+    auto& term = *std::get<2>(deep->node);
+    auto& function = *std::get<2>(term.child(0).node);
+    EXPECT_EQ(std::get<2>(term.child(1).node), std::get<2>(function.child(1).node));
+    EXPECT_TRUE(alpha_equivalent(*deep, *copy));
+}
+
+TEST(arena, nodes_are_reused)
+{
+    node_arena<empty_userdata> arena(4);
+    node_arena<empty_userdata>::scope arena_guard(arena);
+
+    constexpr auto str = "\\a.\\b.a b c (\\d.e \\f.g) h";
+    parsing_context<empty_userdata> contxt;
+
+    auto ast_rec = contxt.parse_lambda({str, strlen(str)});
+    size_t const nodes = arena.live_nodes();
+    EXPECT_EQ(nodes, 19u);
+
+    auto copy = ast_rec->deep_copy();
+    EXPECT_EQ(arena.live_nodes(), 2 * nodes);
+
+    std::stringstream lhs, rhs;
+    lhs << *ast_rec;
+    rhs << *copy;
+    EXPECT_EQ(lhs.str(), rhs.str());
+
+    ast_rec.reset();
+    copy.reset();
+    EXPECT_EQ(arena.live_nodes(), 0u);
 }
 
+TEST(arena, drop_all_destroys_every_node)
+{
+    node_arena<empty_userdata> arena(4);
+    node_arena<empty_userdata>::scope arena_guard(arena);
+    parsing_context<empty_userdata> contxt;
+
+    std::shared_ptr<empty_ast_rec> shared = contxt.parse_lambda("\\x.x x");
+    std::weak_ptr<empty_ast_rec> const observer = shared;
+    auto term = contxt.parse_lambda("y z");
+    std::get<1>(term->node).args[1] = make_record<empty_userdata>(ast_node<empty_userdata>{std::move(shared)});
+
+    // Free slots between the live ones
+    contxt.parse_lambda("a b c").reset();
+
+    constexpr size_t depth = 1000000;
+    std::string nested;
+    for (size_t i = 0; i < depth; ++i)
+        nested += "\\q.q (";
+    nested += "q" + std::string(depth, ')');
+    auto deep = contxt.parse_lambda(nested);
+    EXPECT_GT(arena.live_nodes(), 4 * depth);
+
+    arena.drop_all([&term, &deep]
+    {
+        term.reset();
+        deep.reset();
+    });
+    EXPECT_EQ(arena.live_nodes(), 0u);
+    EXPECT_TRUE(observer.expired());
+
+    // The slabs are kept for the next nodes
+    constexpr auto str = "\\a.\\b.a b c (\\d.e \\f.g) h";
+    auto again = contxt.parse_lambda(str);
+    EXPECT_EQ(arena.live_nodes(), 19u);
+
+    std::stringstream ss;
+    ss << *again;
+    EXPECT_EQ(ss.str(), "(\\a.(\\b.((((a b) c) (\\d.(e (\\f.g)))) h)))");
+}
+
+TEST(symbols, names_are_interned)
+{
+    parsing_context<empty_userdata> contxt;
+    auto ast_rec = contxt.parse_lambda({"x' x' y", 7});
+
+    auto& lhs = std::get<0>(ast_rec->child(0).child(0).node);
+    auto& rhs = std::get<0>(ast_rec->child(0).child(1).node);
+    auto& other = std::get<0>(ast_rec->child(1).node);
+
+    EXPECT_EQ(lhs.id, rhs.id);
+    EXPECT_NE(lhs.id, other.id);
+    EXPECT_EQ(contxt.symbols().size(), 2u);
+    EXPECT_EQ(contxt.symbols().name(other.id), "y");
+
+    auto fresh = symbol_table::generated(42);
+    EXPECT_TRUE(symbol_table::is_generated(fresh));
+    EXPECT_EQ(contxt.symbols().name(fresh), "pinus42");
+}
+
+TEST(symbols, borrowed_names_match_copied)
+{
+    std::string const str = "\\accumulator.\\b.accumulator b c (\\d.e \\f.accumulator) b";
+
+    parsing_context<empty_userdata> copying;
+    auto copied = copying.parse_lambda(str);
+
+    parsing_context<empty_userdata> borrowing(parsing_context<empty_userdata>::name_storage::BORROW);
+    auto borrowed = borrowing.parse_lambda(str);
+
+    std::stringstream copied_text, borrowed_text;
+    copied_text << *copied;
+    borrowed_text << *borrowed;
+
+    EXPECT_EQ(copied_text.str(), borrowed_text.str());
+    EXPECT_EQ(borrowing.symbols().size(), copying.symbols().size());
+}
+
+TEST(de_bruijn, round_trip)
+{
+    constexpr auto str = "\\a.\\b.a b c (\\d.e \\f.g) h";
+    constexpr auto result = "(\\pinus0.(\\pinus1.((((pinus0 pinus1) c) (\\pinus2.(e (\\pinus3.g)))) h)))";
+
+    parsing_context<empty_userdata> contxt;
+    auto ast_rec = contxt.parse_lambda({str, strlen(str)});
+    auto term = to_de_bruijn(*ast_rec);
+
+    std::stringstream printed, converted;
+    print_de_bruijn(printed, *term, contxt.symbols());
+    converted << *from_de_bruijn<empty_userdata>(*term, contxt.symbols());
+
+    EXPECT_EQ(printed.str(), result);
+    EXPECT_EQ(converted.str(), result);
+}
+
+TEST(de_bruijn, shared_argument)
+{
+    constexpr auto str = "(\\x.y x x) ((\\z.z) w)";
+
+    parsing_context<empty_userdata> contxt;
+    auto term = to_de_bruijn(*contxt.parse_lambda({str, strlen(str)}));
+
+    ASSERT_TRUE(db_reduce(*term));
+    ASSERT_TRUE(db_reduce(*term));
+    ASSERT_FALSE(db_reduce(*term));
+
+    std::stringstream ss;
+    print_de_bruijn(ss, *term, contxt.symbols());
+    EXPECT_EQ(ss.str(), "((y w) w)");
+}
+
+TEST(de_bruijn, deep_terms)
+{
+    constexpr size_t depth = 1000000;
+
+    // A left spine with the redex at the bottom
+    std::string left = "(\\y.y y)";
+    for (size_t i = 0; i < depth; ++i)
+        left += " x";
+
+    parsing_context<empty_userdata> contxt;
+    auto term = to_de_bruijn(*contxt.parse_lambda(left));
+    ASSERT_TRUE(db_reduce(*term));
+    ASSERT_FALSE(db_reduce(*term));
+
+    std::stringstream printed, converted;
+    print_de_bruijn(printed, *term, contxt.symbols());
+    converted << *from_de_bruijn<empty_userdata>(*term, contxt.symbols());
+    EXPECT_EQ(printed.str().size(), 4 * depth + 1);
+    EXPECT_EQ(printed.str(), converted.str());
+
+    // A right spine of abstractions reached through a shifted referral
+    std::string right = "(\\f.\\u.f w) (";
+    for (size_t i = 0; i < depth; ++i)
+        right += "\\a.";
+    right += "q)";
+
+    contxt.reset();
+    term = to_de_bruijn(*contxt.parse_lambda(right));
+    ASSERT_TRUE(db_reduce(*term));
+    ASSERT_TRUE(db_reduce(*term));
+    ASSERT_FALSE(db_reduce(*term));
+
+    std::string expected;
+    for (size_t i = 0; i < depth; ++i)
+        expected += "(\\pinus" + std::to_string(i) + ".";
+    expected += "q" + std::string(depth, ')');
+
+    std::stringstream reduced;
+    print_de_bruijn(reduced, *term, contxt.symbols());
+    EXPECT_EQ(reduced.str(), expected);
+}
+
+TEST(krivine, read_back_between_steps)
+{
+    constexpr auto str = "(\\x.y x x) ((\\z.z) w)";
+
+    parsing_context<empty_userdata> contxt;
+    auto code = to_de_bruijn(*contxt.parse_lambda({str, strlen(str)}));
+    krivine_machine machine(*code, contxt.symbols());
+
+    char const* expected[] = {"((y ((\\pinus0.pinus0) w)) ((\\pinus0.pinus0) w))",
+                              "((y w) ((\\pinus0.pinus0) w))",
+                              "((y w) w)"};
+    for (auto const* term : expected)
+    {
+        ASSERT_TRUE(machine.step());
+
+        std::stringstream ss;
+        machine.print(ss);
+        EXPECT_EQ(ss.str(), term);
+    }
+    EXPECT_FALSE(machine.step());
+}
+
+TEST(krivine, deep_terms)
+{
+    constexpr size_t depth = 1000000;
+
+    // A deep argument read back through the environment
+    std::string spine = "(\\u.u) ";
+    for (size_t i = 0; i < depth; ++i)
+        spine += "x (";
+    spine += "x" + std::string(depth, ')');
+
+    std::string normal_form;
+    for (size_t i = 0; i < depth; ++i)
+        normal_form += "(x ";
+    normal_form += "x" + std::string(depth, ')');
+
+    parsing_context<empty_userdata> contxt;
+    auto code = to_de_bruijn(*contxt.parse_lambda(spine));
+    {
+        krivine_machine machine(*code, contxt.symbols());
+        ASSERT_TRUE(machine.step());
+
+        std::stringstream between;
+        machine.print(between);
+        EXPECT_EQ(between.str(), normal_form);
+
+        ASSERT_FALSE(machine.step());
+        std::stringstream normal;
+        machine.print(normal);
+        EXPECT_EQ(normal.str(), normal_form);
+    }
+
+    // A redex under deep abstractions leaves a deep chain of environments behind
+    std::string lambdas;
+    for (size_t i = 0; i < depth; ++i)
+        lambdas += "\\a.";
+    lambdas += "(\\y.y) a";
+
+    std::string expected;
+    for (size_t i = 0; i < depth; ++i)
+        expected += "(\\pinus" + std::to_string(i) + ".";
+    expected += "pinus" + std::to_string(depth - 1) + std::string(depth, ')');
+
+    contxt.reset();
+    code = to_de_bruijn(*contxt.parse_lambda(lambdas));
+    krivine_machine machine(*code, contxt.symbols());
+    ASSERT_TRUE(machine.step());
+    ASSERT_FALSE(machine.step());
+
+    std::stringstream normal;
+    machine.print(normal);
+    EXPECT_EQ(normal.str(), expected);
+}
+
+TEST(interaction_net, church_exponent)
+{
+    constexpr auto str = "(\\m.\\n.n m) (\\f.\\x.f (f x)) (\\f.\\x.f (f (f x)))";
+
+    parsing_context<empty_userdata> contxt;
+    auto parsed = contxt.parse_lambda({str, strlen(str)});
+
+    interaction_net net(*parsed, contxt.symbols());
+    net.normalize();
+
+    std::stringstream ss;
+    ss << *net.read_back<empty_userdata>();
+    EXPECT_EQ(ss.str(), "(\\pinus0.(\\pinus1.(pinus0 (pinus0 (pinus0 (pinus0 (pinus0 (pinus0 (pinus0 (pinus0 pinus1))))))))))");
+    EXPECT_LT(net.stats().betas, 16u);
+}
+
+TEST(interaction_net, same_normal_form_as_normal_order)
+{
+    random_term_parameters params;
+    params.binder_density = 0.4;
+    params.redex_density = 0.5;
+
+    size_t compared = 0;
+    for (uint64_t seed = 0; seed < 300; ++seed)
+    {
+        random_term_generator random_terms(seed, params);
+        reduction_context context;
+        auto term = context.parse(random_terms.generate(90));
+
+        // Without the oracle some of these were read back wrong, crashed or never stopped
+        interaction_net net(*term, context.symbols());
+
+        context.run_substitutions(*term);
+        bool normal = false;
+        for (size_t steps = 0; steps < 2000 && !normal; ++steps)
+            normal = !context.reduce(*term);
+        if (!normal)
+            continue;
+
+        ASSERT_TRUE(net.normalize());
+        auto const normal_form = net.read_back<rendering_userdata>();
+        ASSERT_NE(normal_form, nullptr);
+        EXPECT_TRUE(alpha_equivalent(*normal_form, *term));
+        ++compared;
+    }
+
+    EXPECT_GT(compared, 250u);
+}
+
+TEST(interaction_net, deep_terms)
+{
+    constexpr size_t depth = 100000;
+
+    // Each use of a shared variable deep in arguments, and a long spine of a free one
+    std::string shared = "(\\u.u) \\y.";
+    std::string expected = "(\\pinus0.";
+    for (size_t i = 0; i < depth; ++i)
+    {
+        shared += "y (";
+        expected += "(pinus0 ";
+    }
+    shared += "y" + std::string(depth, ')');
+    expected += "pinus0" + std::string(depth + 1, ')');
+
+    std::string spine = "x";
+    for (size_t i = 1; i < depth; ++i)
+        spine += " x";
+
+    parsing_context<empty_userdata> contxt;
+    std::stringstream free_spine;
+    free_spine << *contxt.parse_lambda(spine);
+
+    auto normalized = [&contxt] (std::string const& term)
+    {
+        interaction_net net(*contxt.parse_lambda(term), contxt.symbols());
+        EXPECT_TRUE(net.normalize());
+        EXPECT_EQ(net.stats().betas, 1u);
+
+        std::stringstream ss;
+        auto normal_form = net.read_back<empty_userdata>();
+        if (normal_form != nullptr)
+            ss << *normal_form;
+        return ss.str();
+    };
+
+    // Quadratic in the depth this took minutes
+    auto const started = std::chrono::steady_clock::now();
+    EXPECT_EQ(normalized(shared), expected);
+    EXPECT_EQ(normalized("(\\u.u) " + spine), free_spine.str());
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::seconds(30));
+}
+
+TEST(output_buffer, matches_ostream)
+{
+    constexpr auto str = "\\a.\\b.a b c (\\d.e \\f.g) h";
+
+    parsing_context<empty_userdata> contxt;
+    auto ast_rec = contxt.parse_lambda({str, strlen(str)});
+
+    std::stringstream ss;
+    ss << *ast_rec << '\n';
+
+    int fds[2] = {-1, -1};
+    ASSERT_EQ(pipe(fds), 0);
+    {
+        output_buffer out(fds[1]);
+        out.append(*ast_rec).put('\n');
+        EXPECT_TRUE(out.flush());
+    }
+    close(fds[1]);
+
+    std::string written(ss.str().size() + 1, '\0');
+    auto const rd = read(fds[0], written.data(), written.size());
+    close(fds[0]);
+
+    written.resize(rd < 0 ? 0 : static_cast<size_t>(rd));
+    EXPECT_EQ(written, ss.str());
+}
+
+TEST(render_cache, matches_ostream_after_changes)
+{
+    constexpr auto str = "(\\a.\\b.a b c (\\d.e \\f.g) h) (x y z w (\\q.q q q q q q q q q q q q q q q q q q q q q q))";
+
+    parsing_context<rendering_userdata> contxt;
+    auto ast_rec = contxt.parse_lambda({str, strlen(str)});
+
+    render_cache cache;
+    auto cached_text = [&] ()
+    {
+        int fds[2] = {-1, -1};
+        EXPECT_EQ(pipe(fds), 0);
+        {
+            output_buffer out(fds[1]);
+            cache.print(out, *ast_rec);
+            EXPECT_TRUE(out.flush());
+        }
+        close(fds[1]);
+
+        std::string written(4096, '\0');
+        auto const rd = read(fds[0], written.data(), written.size());
+        close(fds[0]);
+
+        written.resize(rd < 0 ? 0 : static_cast<size_t>(rd));
+        return written;
+    };
+    auto plain_text = [&] ()
+    {
+        std::stringstream ss;
+        ss << *ast_rec;
+        return ss.str();
+    };
+
+    EXPECT_EQ(cached_text(), plain_text());
+
+    // Children keep their renderings, only the changed node is invalidated
+    auto& app = std::get<1>(ast_rec->node);
+    std::swap(app.args[0], app.args[1]);
+    render_cache::invalidate(*ast_rec);
+    EXPECT_EQ(cached_text(), plain_text());
+
+    cache.clear();
+    EXPECT_EQ(cached_text(), plain_text());
+}
+
+TEST(char_scanner, runs_match_scalar_classification)
+{
+    std::string const alphabet = "ab z09'\t\n\v\f\r.()\\AZ_\x80\xff";
+
+    std::mt19937 gen(42);
+    for (size_t round = 0; round < 2000; ++round)
+    {
+        // Long runs of one class cross the 16 and 32 byte chunks
+        std::string str;
+        size_t const len = gen() % 100;
+        while (str.size() < len)
+            str.append(gen() % 40, alphabet[gen() % alphabet.size()]);
+
+        size_t spaces = 0;
+        while (spaces < str.size() && std::isspace(static_cast<unsigned char>(str[spaces])))
+            spaces++;
+
+        size_t varname = 0;
+        while (varname < str.size()
+               && (std::islower(static_cast<unsigned char>(str[varname]))
+                   || std::isdigit(static_cast<unsigned char>(str[varname]))
+                   || str[varname] == '\''))
+            varname++;
+
+        EXPECT_EQ(char_scanner::count_spaces(str), spaces);
+        EXPECT_EQ(char_scanner::count_varname(str), varname);
+    }
+}
+
+TEST(reduction_context, interleaved_contexts_are_independent)
+{
+    constexpr auto str = "(\\m.\\n.n m) (\\f.\\x.f (f x)) (\\f.\\x.f (f (f x)))";
+
+    auto normal_form = [] (rendering_ast_rec& term)
+    {
+        std::stringstream ss;
+        ss << term;
+        return ss.str();
+    };
+
+    reduction_context alone;
+    auto expected = alone.parse(str);
+    alone.run_substitutions(*expected);
+    while (alone.reduce(*expected))
+    {}
+
+    reduction_context first, second;
+    auto lhs = first.parse(str);
+    auto rhs = second.parse(str);
+    first.run_substitutions(*lhs);
+    second.run_substitutions(*rhs);
+
+    bool lhs_done = false, rhs_done = false;
+    while (!lhs_done || !rhs_done)
+    {
+        lhs_done = lhs_done || !first.reduce(*lhs);
+        rhs_done = rhs_done || !second.reduce(*rhs);
+    }
+
+    EXPECT_EQ(first.steps(), alone.steps());
+    EXPECT_EQ(second.steps(), alone.steps());
+    EXPECT_EQ(normal_form(*lhs), normal_form(*expected));
+    EXPECT_EQ(normal_form(*rhs), normal_form(*expected));
+
+    rhs.reset();
+    second.reset();
+    EXPECT_EQ(second.steps(), 0u);
+}
+
+TEST(reduction_context, reset_keeps_the_symbol_table)
+{
+    // Cached normal forms point to the table past the reset
+    reduction_context context;
+    auto term = context.parse("x (\\y.y z)");
+    auto const* table = &context.symbols();
+    EXPECT_EQ(table->size(), 3u);
+
+    term.reset();
+    context.reset();
+    EXPECT_EQ(&context.symbols(), table);
+    EXPECT_EQ(table->size(), 0u);
+
+    term = context.parse("z");
+    std::stringstream ss;
+    ss << *term;
+    EXPECT_EQ(ss.str(), "z");
+}
+
+TEST(reduction_context, stats_count_the_work)
+{
+    reduction_context context;
+    auto term = context.parse("(\\m.\\n.n m) (\\f.\\x.f (f x)) (\\f.\\x.f (f (f x)))");
+    context.run_substitutions(*term);
+    while (context.reduce(*term))
+    {}
+
+    auto const stats = context.stats();
+    if constexpr (stats_enabled)
+    {
+        EXPECT_EQ(stats.beta_steps.value(), context.steps());
+        EXPECT_EQ(stats.reduce_calls.value(), context.steps() + 1);
+        EXPECT_GE(stats.reduce_visits.value(), stats.reduce_calls.value());
+        EXPECT_GE(stats.fresh_names.value(), 7u);
+        EXPECT_GT(stats.copied_nodes.value(), 0u);
+        EXPECT_GE(stats.peak_live_nodes.value(), context.allocator()->live_nodes());
+    }
+    else
+        EXPECT_EQ(stats.beta_steps.value(), 0u);
+
+    term.reset();
+    context.reset();
+    EXPECT_EQ(context.stats().beta_steps.value(), 0u);
+}
+
+TEST(reduction_context, copied_nodes_counts_the_nodes_made)
+{
+    reduction_context context;
+    auto term = context.parse("(\\f.f (f y)) (\\x.x)");
+    context.run_substitutions(*term);
+    while (context.reduce(*term))
+    {}
+
+    // Both uses of f copy \x.x, which has three nodes
+    if constexpr (stats_enabled)
+    {
+        EXPECT_EQ(context.stats().copied_nodes.value(), 6u);
+    }
+}
+
+TEST(reduction_context, graph_reduction_keeps_live_nodes_bounded)
+{
+    random_term_parameters params;
+    params.binder_density = 0.4;
+    params.redex_density = 0.4;
+    random_term_generator random_terms(73, params);
+
+    reduction_context context;
+    node_arena<rendering_userdata>::scope arena_guard(context.allocator());
+    auto term = context.parse(random_terms.generate(120));
+    context.run_substitutions(*term);
+
+    sharing_stats stats;
+    auto peak_over = [&] (size_t steps)
+    {
+        size_t peak = 0;
+        for (size_t i = 0; i < steps && context.reduce_shared(*term, stats); ++i)
+            peak = std::max(peak, context.allocator()->live_nodes());
+        return peak;
+    };
+
+    // Referrals to referrals used to pile up, growing with every step
+    size_t const early = peak_over(2000);
+    size_t const late = peak_over(18000);
+    EXPECT_EQ(context.steps(), 20000u);
+    EXPECT_LE(late, 2 * early);
+}
+
+TEST(parallel_normalizer, same_normal_form_as_normal_order)
+{
+    constexpr auto str = "(\\n.\\s.s (n n) (n (n n)) (n n n) (n (\\q.n q))) (\\f.\\x.f (f x))";
+
+    reduction_context sequential;
+    auto expected = sequential.parse(str);
+    sequential.run_substitutions(*expected);
+    while (sequential.reduce(*expected))
+    {}
+
+    for (size_t threads : {1, 4})
+    {
+        reduction_context context;
+        context.use_heap_nodes(true);
+
+        auto term = context.parse(str);
+        context.run_substitutions(*term);
+
+        parallel_normalizer normalizer(context, threads, std::numeric_limits<size_t>::max());
+        ASSERT_TRUE(normalizer.normalize(*term));
+        EXPECT_GE(normalizer.steps(), sequential.steps());
+
+        std::vector<symbol_id> env_lhs, env_rhs;
+        EXPECT_TRUE(alpha_equivalent(*term, *expected, env_lhs, env_rhs));
+    }
+}
+
+TEST(term_generator, terms_parse_with_known_steps)
+{
+    auto print = [] (rendering_ast_rec const& term)
+    {
+        std::stringstream ss;
+        ss << term;
+        return ss.str();
+    };
+
+    // Random terms are printed the way the printer does it
+    random_term_generator random_terms(42);
+    for (size_t size : {2, 10, 100, 1000})
+    {
+        reduction_context context;
+        auto const str = random_terms.generate(size);
+        auto term = context.parse(str);
+        EXPECT_EQ(print(*term), str);
+    }
+
+    for (size_t steps : {0, 1, 17})
+    {
+        reduction_context context;
+        auto term = context.parse(identity_chain(steps));
+        context.run_substitutions(*term);
+        while (context.reduce(*term))
+        {}
+        EXPECT_EQ(context.steps(), steps);
+    }
+
+    for (auto shape : {term_shape::BALANCED, term_shape::LEFT_SPINE, term_shape::RIGHT_SPINE})
+        for (size_t n : {1, 2, 5})
+        {
+            reduction_context context;
+            auto term = context.parse(shaped_term(shape, n));
+            EXPECT_TRUE(term->has_node_tag(node_tag::FORALL));
+        }
+
+    reduction_context context;
+    auto numeral = context.parse(church_numeral(3));
+    EXPECT_EQ(print(*numeral), "(\\f.(\\x.(f (f (f x)))))");
+}
+
+TEST(phase_tracer, records_spans_in_order)
+{
+    phase_tracer disabled(false);
+    {
+        phase_tracer::span span(disabled, "parse");
+    }
+    EXPECT_TRUE(disabled.recorded().empty());
+
+    phase_tracer trace(true, 3);
+    {
+        phase_tracer::span span(trace, "parse");
+    }
+    auto const from = trace.start();
+    trace.finish("reduce", from, 7);
+
+    auto const& events = trace.recorded();
+    ASSERT_EQ(events.size(), 2u);
+    EXPECT_EQ(std::string(events[0].name), "parse");
+    EXPECT_EQ(events[1].steps, 7u);
+    EXPECT_EQ(events[0].tid, 3u);
+    EXPECT_LE(events[0].start_ns + events[0].duration_ns, events[1].start_ns);
+
+    std::stringstream ss;
+    phase_tracer::write_chrome_trace(ss, events, trace.has_counters());
+    EXPECT_NE(ss.str().find("\"name\": \"reduce\""), std::string::npos);
+}
+
+TEST(resource_budget, limits_are_checked_between_steps)
+{
+    reduction_context context;
+    auto term = context.parse("(\\x.x x x) (\\x.x x x)");
+    context.run_substitutions(*term);
+
+    resource_budget budget;
+    budget.max_live_nodes = 40;
+    budget_guard<rendering_userdata> guard(budget, *context.allocator());
+    EXPECT_EQ(guard.check(0), budget_limit::NONE);
+    EXPECT_EQ(guard.output_left(0), std::numeric_limits<size_t>::max());
+
+    size_t steps = 0;
+    while (guard.check(0) == budget_limit::NONE && steps < 1000)
+    {
+        ASSERT_TRUE(context.reduce(*term));
+        ++steps;
+    }
+    EXPECT_GT(context.allocator()->live_nodes(), budget.max_live_nodes);
+
+    budget = resource_budget();
+    budget.max_bytes = context.allocator()->live_bytes() + 40;
+    EXPECT_EQ(guard.check(0), budget_limit::NONE);
+    EXPECT_EQ(guard.check(41), budget_limit::BYTES);
+
+    output_buffer out(output_buffer::in_memory);
+    EXPECT_FALSE(out.append_prefix(*term, guard.output_left(0)));
+    auto const cut = out.release();
+    ASSERT_LT(cut.size(), 60u);
+    EXPECT_EQ(cut.substr(cut.size() - 4), " ...");
+
+    // The whole term is too long to print once shared arguments are expanded
+    EXPECT_FALSE(out.append_prefix(*term, 200));
+    auto const longer = out.release();
+    EXPECT_EQ(longer.substr(0, cut.size() - 4), cut.substr(0, cut.size() - 4));
+}
+
+TEST(normal_form_cache, closed_subterms_are_normalized_once)
+{
+    std::string const sum = "(" + church_plus + " " + church_numeral(2) + " " + church_numeral(3) + ")";
+    std::string const str = "y " + sum + " " + sum;
+
+    reduction_context sequential;
+    auto expected = sequential.parse(str);
+    sequential.run_substitutions(*expected);
+    while (sequential.reduce(*expected))
+    {}
+
+    reduction_context context;
+    normal_form_cache cache;
+    auto term = context.parse(str);
+    context.run_substitutions(*term);
+    ASSERT_TRUE(cache.normalize(context, *term, 1000));
+    EXPECT_TRUE(alpha_equivalent(*term, *expected));
+    EXPECT_EQ(cache.size(), 1u);
+    EXPECT_EQ(context.steps(), sequential.steps() / 2 + 1);
+    if constexpr (stats_enabled)
+    {
+        EXPECT_EQ(context.stats().cache_lookups.value(), 2u);
+        EXPECT_EQ(context.stats().cache_hits.value(), 1u);
+    }
+
+    // Entries outlive the term and the names they were made with
+    term.reset();
+    context.reset();
+    term = context.parse(sum);
+    context.run_substitutions(*term);
+    ASSERT_TRUE(cache.normalize(context, *term, 1));
+    EXPECT_EQ(context.steps(), 1u);
+
+    std::stringstream ss;
+    ss << *term;
+    std::string const five = ss.str();
+    EXPECT_EQ(std::count(five.begin(), five.end(), '('), 7);
+}
+
+TEST(normal_form_cache, deep_terms_are_walked_once)
+{
+    // Only the root of a spine is closed, its arguments are told apart by their cached fingerprints
+    reduction_context context;
+    normal_form_cache cache;
+    auto spine = context.parse(shaped_term(term_shape::RIGHT_SPINE, 200000));
+    context.run_substitutions(*spine);
+    ASSERT_TRUE(cache.normalize(context, *spine, 1));
+    EXPECT_EQ(cache.size(), 0u);
+    if constexpr (stats_enabled)
+    {
+        EXPECT_EQ(context.stats().cache_lookups.value(), 1u);
+    }
+
+    // Every level is a closed argument with a step inside, all of them are stored
+    constexpr size_t depth = 50000;
+    std::string nested;
+    for (size_t i = 0; i < depth; ++i)
+        nested += "\\q.q (";
+    nested += "(\\y.y) (\\z.z)" + std::string(depth, ')');
+
+    spine.reset();
+    context.reset();
+    auto term = context.parse(nested);
+    context.run_substitutions(*term);
+    ASSERT_TRUE(cache.normalize(context, *term, 1));
+    EXPECT_EQ(cache.size(), depth);
+
+    // An inner level is found with its own normal form
+    term.reset();
+    context.reset();
+    term = context.parse("\\q.q (\\q.q (\\q.q ((\\y.y) (\\z.z))))");
+    context.run_substitutions(*term);
+    ASSERT_TRUE(cache.normalize(context, *term, 1));
+    if constexpr (stats_enabled)
+    {
+        EXPECT_EQ(context.stats().cache_hits.value(), 1u);
+    }
+
+    std::stringstream ss;
+    ss << *term;
+    std::string const printed = ss.str();
+    EXPECT_EQ(std::count(printed.begin(), printed.end(), '\\'), 4);
+}
+
+TEST(normal_form_cache, long_batch_stays_bounded)
+{
+    constexpr size_t max_nodes = 2000;
+
+    reduction_context context;
+    normal_form_cache cache(8, max_nodes);
+    size_t tasks = 0;
+    for (size_t lhs = 1; lhs <= 30; ++lhs)
+        for (size_t rhs = 1; rhs <= 10; ++rhs)
+        {
+            context.reset();
+            auto term = context.parse("y (" + church_plus + " " + church_numeral(lhs) + " "
+                                      + church_numeral(rhs) + ")");
+            context.run_substitutions(*term);
+            ASSERT_TRUE(cache.normalize(context, *term, 1000));
+            ++tasks;
+
+            // Between tasks the arena keeps only the cached copies
+            term.reset();
+            EXPECT_LE(cache.cached_nodes(), max_nodes);
+            EXPECT_EQ(context.allocator()->live_nodes(), cache.cached_nodes());
+        }
+
+    EXPECT_GT(cache.size(), 0u);
+    EXPECT_LT(cache.size(), tasks);
+
+    cache.set_max_nodes(0);
+    EXPECT_EQ(cache.size(), 0u);
+    EXPECT_EQ(context.allocator()->live_nodes(), 0u);
+}
 
 int main(int argc, char* argv[])
 {
@@ -1,303 +1,801 @@
 #include "include/lambdas.h"
-
-#include <sys/resource.h>
+#include "include/de_bruijn.h"
+#include "include/hash_cons.h"
+#include "include/input_buffer.h"
+#include "include/krivine.h"
+#include "include/normal_form_cache.h"
+#include "include/output_buffer.h"
+#include "include/parallel_normalizer.h"
+#include "include/phase_tracer.h"
+#include "include/reduction_context.h"
+#include "include/resource_budget.h"
+
+#include <algorithm>
 #include <cstring>
 #include <unistd.h>
+#include <fstream>
+#include <functional>
 #include <iostream>
-#include <unordered_map>
 #include <sstream>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+constexpr int kBudgetExceeded = 3;     // exit status when a resource_budget stopped a reduction
+
+enum class engine_type
+{
+    NAMED,
+    ZIPPER,
+    GRAPH,
+    DE_BRUIJN,
+    KRIVINE,
+    PARALLEL,
+    MEMO
+};
+
+struct reduction_options
+{
+    engine_type engine{engine_type::NAMED};
+    /**
+     * Share equal closed normal forms of the input
+     */
+    bool        hash_cons{false};
+    /**
+     * Deduplicate the term after each dedup_every reductions, 0 to disable
+     */
+    size_t      dedup_every{0};
+    /**
+     * Keep renderings of unchanged subtrees between prints
+     */
+    bool        render_cache{false};
+    /**
+     * Read many tasks from the input and reduce them on worker threads
+     */
+    bool        batch{false};
+    /**
+     * Worker threads of a batch or of the parallel engine, 0 for one per core
+     */
+    size_t      threads{0};
+    /**
+     * File for the JSON report of reduction_stats, empty for none
+     */
+    std::string stats_file;
+    /**
+     * Sample the stats after each stats_every reductions, 0 to disable
+     */
+    size_t      stats_every{0};
+    /**
+     * File for the Chrome trace of the phases, empty for none
+     */
+    std::string trace_file;
+    /**
+     * Limits of each task besides m
+     */
+    resource_budget budget;
+};
 
 [[nodiscard]]
 static inline
-int set_stack_lim()
+bool parse_options(int argc, char** argv, reduction_options& options)
 {
-    const rlim_t kStackSize = 32 * 1024 * 1024;   // min stack size = 32 MB
-    struct rlimit rl;
-    int result;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg(argv[i]);
+        std::string_view const dedup_prefix = "--dedup-every=";
+        std::string_view const threads_prefix = "--threads=";
+        std::string_view const stats_prefix = "--stats=";
+        std::string_view const stats_every_prefix = "--stats-every=";
+        std::string_view const trace_prefix = "--trace=";
+        std::string_view const max_nodes_prefix = "--max-nodes=";
+        std::string_view const max_bytes_prefix = "--max-bytes=";
+        std::string_view const max_time_prefix = "--max-time=";
+
+        if (arg == "--engine=named")
+            options.engine = engine_type::NAMED;
+        else if (arg == "--engine=zipper")
+            options.engine = engine_type::ZIPPER;
+        else if (arg == "--engine=graph")
+            options.engine = engine_type::GRAPH;
+        else if (arg == "--engine=de-bruijn")
+            options.engine = engine_type::DE_BRUIJN;
+        else if (arg == "--engine=krivine")
+            options.engine = engine_type::KRIVINE;
+        else if (arg == "--engine=parallel")
+            options.engine = engine_type::PARALLEL;
+        else if (arg == "--engine=memo")
+            options.engine = engine_type::MEMO;
+        else if (arg == "--hash-cons")
+            options.hash_cons = true;
+        else if (arg == "--render-cache")
+            options.render_cache = true;
+        else if (arg == "--batch")
+            options.batch = true;
+        else if (arg.substr(0, dedup_prefix.size()) == dedup_prefix)
+            options.dedup_every = std::stoul(std::string(arg.substr(dedup_prefix.size())));
+        else if (arg.substr(0, threads_prefix.size()) == threads_prefix)
+            options.threads = std::stoul(std::string(arg.substr(threads_prefix.size())));
+        else if (arg.substr(0, stats_prefix.size()) == stats_prefix)
+            options.stats_file = arg.substr(stats_prefix.size());
+        else if (arg.substr(0, stats_every_prefix.size()) == stats_every_prefix)
+            options.stats_every = std::stoul(std::string(arg.substr(stats_every_prefix.size())));
+        else if (arg.substr(0, trace_prefix.size()) == trace_prefix)
+            options.trace_file = arg.substr(trace_prefix.size());
+        else if (arg.substr(0, max_nodes_prefix.size()) == max_nodes_prefix)
+            options.budget.max_live_nodes = std::stoul(std::string(arg.substr(max_nodes_prefix.size())));
+        else if (arg.substr(0, max_bytes_prefix.size()) == max_bytes_prefix)
+            options.budget.max_bytes = std::stoul(std::string(arg.substr(max_bytes_prefix.size())));
+        else if (arg.substr(0, max_time_prefix.size()) == max_time_prefix)
+            options.budget.max_time = std::chrono::milliseconds(std::stoul(std::string(arg.substr(max_time_prefix.size()))));
+        else
+            return false;
+    }
+
+    // Budgets are checked on the arena, which only the named and memo engines use
+    if (options.budget.limits_anything()
+        && (options.engine == engine_type::DE_BRUIJN
+            || options.engine == engine_type::KRIVINE
+            || options.engine == engine_type::PARALLEL))
+        return false;
+
+    // Stats are counted by reduction_context, which the De Bruijn and Krivine engines do not use
+    if ((!options.stats_file.empty() || options.stats_every != 0)
+        && (options.engine == engine_type::DE_BRUIJN || options.engine == engine_type::KRIVINE))
+        return false;
+
+    // The parallel engine prints only the normal form, and has threads of its own
+    if (options.engine == engine_type::PARALLEL
+        && (options.batch || options.hash_cons || options.dedup_every != 0 || options.render_cache))
+        return false;
+
+    // The memo engine prints only the normal form too
+    if (options.engine == engine_type::MEMO
+        && (options.hash_cons || options.dedup_every != 0 || options.render_cache))
+        return false;
+
+    // Referrals are expanded by the De Bruijn conversion
+    return (options.engine != engine_type::DE_BRUIJN
+            && options.engine != engine_type::KRIVINE)
+           || (!options.hash_cons && options.dedup_every == 0 && !options.render_cache);
+}
+
+struct task_result
+{
+    /**
+     * Empty for the De Bruijn and Krivine engines
+     */
+    reduction_stats stats;
+    budget_limit    stopped{budget_limit::NONE};
+    /**
+     * errno of the failed write of the output, 0 if it was written
+     */
+    int             write_error{0};
+};
+
+/**
+ * @return  stopped is the limit of the budget which stopped the reduction early, if any
+ */
+static inline
+task_result run_named(reduction_context& context, rendering_ast_rec_ptr result, reduction_options const& options,
+                      size_t m, size_t k, output_buffer& out, std::ostream& log, phase_tracer& trace)
+{
+    // The hash consing table makes nodes of the term too
+    node_arena<rendering_userdata>::scope arena_guard(context.allocator());
+    hash_cons_table<rendering_userdata> shared_terms;
+
+    render_cache cache;
+    if (options.render_cache)
+        context.set_render_cache(&cache);
+
+    size_t const printed_before = out.total_size();
+    budget_guard<rendering_userdata> guard(options.budget, *context.allocator());
+
+    // Under a byte limit a term is printed only as far as the limit allows, without the render cache
+    auto print = [&out, &result, &options, &cache, &trace, &guard, printed_before]
+    {
+        phase_tracer::span span(trace, "print");
+        bool complete = true;
+        if (options.budget.max_bytes != 0)
+            complete = out.append_prefix(*result, guard.output_left(out.total_size() - printed_before));
+        else if (options.render_cache)
+            cache.print(out, *result);
+        else
+            out.append(*result);
+        out.put('\n');
+        return complete;
+    };
+
+    {
+        phase_tracer::span span(trace, "run_substitutions");
+        context.run_substitutions(*result);
+        if (options.hash_cons)
+            shared_terms.intern(result);
+    }
+    auto stopped = print() ? budget_limit::NONE : budget_limit::BYTES;
+    bool printed_last = true;
+
+    reduction_context::redex_cursor cursor(context, *result);
+    sharing_stats stats;
+    auto step = [&context, &options, &result, &cursor, &stats]
+    {
+        if (options.engine == engine_type::ZIPPER)
+            return cursor.reduce();
+        if (options.engine == engine_type::GRAPH)
+            return context.reduce_shared(*result, stats);
+        return context.reduce(*result);
+    };
+
+    // Steps between two prints are traced as one phase
+    auto batch = trace.start();
+    size_t batch_from = 0;
+    auto end_batch = [&context, &trace, &batch, &batch_from]
+    {
+        trace.finish("reduce", batch, context.steps() - batch_from);
+    };
 
-    result = getrlimit(RLIMIT_STACK, &rl);
-    if (result == 0)
+    while (stopped == budget_limit::NONE
+           && context.steps() < m
+           && step())
     {
-        if (rl.rlim_cur < kStackSize)
+        size_t const done = context.steps();
+        printed_last = done % k == 0;
+        if (printed_last)
         {
-            rl.rlim_cur = kStackSize;
-            result = setrlimit(RLIMIT_STACK, &rl);
-            if (result != 0)
-                fprintf(stderr, "setrlimit returned result = %d\n", result);
+            end_batch();
+            if (!print())
+                stopped = budget_limit::BYTES;
+            batch = trace.start();
+            batch_from = done;
         }
+
+        if (options.stats_every != 0
+            && done % options.stats_every == 0)
+            context.record_sample();
+
+        if (options.dedup_every != 0
+            && done % options.dedup_every == 0)
+        {
+            phase_tracer::span span(trace, "dedup");
+            shared_terms.intern(result);
+            shared_terms.collect();
+            cursor.reset(*result);
+            cache.clear();
+        }
+
+        if (stopped == budget_limit::NONE)
+            stopped = guard.check(out.total_size() - printed_before);
     }
 
-    return result;
+    // The term between two steps is complete, so it is printed when a limit stops the reduction too
+    end_batch();
+    if (!printed_last && stopped != budget_limit::BYTES)
+        print();
+    context.count_printed(out.total_size() - printed_before);
+    int write_error = 0;
+    {
+        phase_tracer::span span(trace, "write");
+        if (!out.flush())
+            write_error = errno;
+    }
+    context.set_render_cache(nullptr);
+
+    if (options.engine == engine_type::GRAPH)
+        log << "Reductions: " << stats.graph_steps << " with sharing, "
+            << stats.tree_steps << " without" << std::endl;
+
+    if (stopped != budget_limit::NONE)
+        log << "Stopped after " << context.steps() << " reductions: " << describe(stopped) << " reached" << std::endl;
+
+    // Only the term and the table hold nodes of the arena, they go with its slabs instead of node by node
+    task_result finished{context.stats(), stopped, write_error};
+    if (auto* arena = context.allocator())
+        arena->drop_all([&result, &shared_terms]
+        {
+            result.reset();
+            shared_terms.clear();
+        });
+    return finished;
 }
 
 [[nodiscard]]
 static inline
-std::string gen_name()
+size_t thread_count(reduction_options const& options)
 {
-    static size_t counter = 0;
-    return "pinus" + std::to_string(counter++);
+    size_t const threads = options.threads != 0 ? options.threads : std::thread::hardware_concurrency();
+    return std::max<size_t>(threads, 1);
 }
 
-rename_map_t& get_rename_map()
+/**
+ * Normal form only, so with k >= m: the independent parts of the term are
+ * reduced at once on several threads. Prints the term and the normal form,
+ * as run_named does with k >= m, but the fresh names and the step count
+ * may differ.
+ */
+static inline
+task_result run_parallel(reduction_context& context, rendering_ast_rec_ptr result, reduction_options const& options,
+                         size_t m, output_buffer& out, std::ostream& log, phase_tracer& trace)
 {
-    static rename_map_t renames;
-    return renames;
+    size_t const printed_before = out.total_size();
+    {
+        phase_tracer::span span(trace, "run_substitutions");
+        context.run_substitutions(*result);
+    }
+    {
+        phase_tracer::span span(trace, "print");
+        out.append(*result).put('\n');
+    }
+
+    size_t const threads = thread_count(options);
+    parallel_normalizer normalizer(context, threads, m);
+    auto const from = trace.start();
+    normalizer.normalize(*result);
+    trace.finish("reduce", from, normalizer.steps());
+
+    if (normalizer.steps() != 0)
+    {
+        phase_tracer::span span(trace, "print");
+        out.append(*result).put('\n');
+    }
+    context.count_printed(out.total_size() - printed_before);
+    int write_error = 0;
+    {
+        phase_tracer::span span(trace, "write");
+        if (!out.flush())
+            write_error = errno;
+    }
+
+    log << "Reductions: " << normalizer.steps() << " on " << threads << " threads" << std::endl;
+
+    auto stats = context.stats();
+    stats.merge(normalizer.stats());
+    return {stats, budget_limit::NONE, write_error};
 }
 
+/**
+ * Normal form only, so with k >= m: closed subterms normalized before, in
+ * this task or an earlier one of the context, are replaced with their
+ * normal form from cache in one step. Prints the term and the normal form,
+ * as run_named does with k >= m, but the fresh names and the step count
+ * may differ. The cached normal forms are live nodes of the budget.
+ */
 static inline
-void run_substitutions(empty_ast_rec& rec, bool abstraction = false)
+task_result run_memo(reduction_context& context, rendering_ast_rec_ptr result, normal_form_cache& cache,
+                     reduction_options const& options, size_t m, output_buffer& out, std::ostream& log,
+                     phase_tracer& trace)
 {
-    switch (rec.node.index())
+    size_t const printed_before = out.total_size();
+    budget_guard<rendering_userdata> guard(options.budget, *context.allocator());
+
+    // Half of the node and byte limits is left to the term
+    size_t const allowance = options.budget.node_allowance(node_arena<rendering_userdata>::node_bytes);
+    cache.set_max_nodes(std::min(normal_form_cache::default_max_nodes, allowance / 2));
+
+    auto print = [&out, &result, &options, &trace, &guard, printed_before]
     {
-    case 0:
+        phase_tracer::span span(trace, "print");
+        bool complete = true;
+        if (options.budget.max_bytes != 0)
+            complete = out.append_prefix(*result, guard.output_left(out.total_size() - printed_before));
+        else
+            out.append(*result);
+        out.put('\n');
+        return complete;
+    };
+
     {
-        auto& name = std::get<0>(rec.node).name;
-        auto it = get_rename_map().find(name);
+        phase_tracer::span span(trace, "run_substitutions");
+        context.run_substitutions(*result);
+    }
+    auto stopped = print() ? budget_limit::NONE : budget_limit::BYTES;
 
-        if (it != get_rename_map().end())
-        {
-            if (abstraction)
-            {
-                auto const newname = gen_name();
-                it->second = newname;
-            }
+    if (stopped == budget_limit::NONE)
+    {
+        auto const from = trace.start();
+        cache.normalize(context, *result, m, &guard, out.total_size() - printed_before);
+        trace.finish("reduce", from, context.steps());
+        stopped = cache.stopped();
+
+        if (context.steps() != 0
+            && !print()
+            && stopped == budget_limit::NONE)
+            stopped = budget_limit::BYTES;
+    }
+    context.count_printed(out.total_size() - printed_before);
+    int write_error = 0;
+    {
+        phase_tracer::span span(trace, "write");
+        if (!out.flush())
+            write_error = errno;
+    }
 
-            name = it->second;
-        }
-        else
+    auto stats = context.stats();
+    log << "Reductions: " << context.steps() << ", " << stats.cache_hits.value() << " of them from cache, "
+        << cache.size() << " normal forms cached" << std::endl;
+    if (stopped != budget_limit::NONE)
+        log << "Stopped after " << context.steps() << " reductions: " << describe(stopped) << " reached" << std::endl;
+    return {stats, stopped, write_error};
+}
+
+/**
+ * Same reduction sequence on De Bruijn terms: no renaming pass at all,
+ * the output is alpha-equivalent to run_named's
+ */
+static inline
+void run_de_bruijn(rendering_ast_rec_ptr parsed, symbol_table const& symbols, size_t m, size_t k,
+                   std::ostream& out)
+{
+    auto result = to_de_bruijn(*parsed);
+    parsed.reset();
+
+    print_de_bruijn(out, *result, symbols);
+    out << std::endl;
+
+    size_t done = 0;
+    while (done < m
+           && db_reduce(*result))
+    {
+        done++;
+        if (done % k == 0)
         {
-            if (abstraction)
-            {
-                auto const newname = gen_name();
-                get_rename_map().insert(it, {name, newname});
-                name = newname;
-            }
-            else
-                // Global varname expected
-                (void) 42;
+            print_de_bruijn(out, *result, symbols);
+            out << '\n';
         }
-
-        break;
     }
-    case 1:
+
+    if (done % k != 0)
     {
-        auto& op = std::get<1>(rec.node);
+        print_de_bruijn(out, *result, symbols);
+        out << std::endl;
+    }
+}
 
-        switch (op.tag)
-        {
-        case node_tag::FORALL:
-        {
-            std::optional<std::string> before;
-
-            if (op.args[0]->node.index() != 0)
-            {
-                assert(false);
-                return;
-            }
-
-            auto const old_name = std::get<0>(op.args[0]->node).name;
-
-            {
-                auto it = get_rename_map().find(old_name);
-                if (it != get_rename_map().end())
-                {
-                    before = std::move(it->second);
-                    get_rename_map().erase(it);
-                }
-            }
-
-            run_substitutions(*op.args[0], true);
-            run_substitutions(*op.args[1]);
-
-            {
-                auto it = get_rename_map().find(old_name);
-                if (before)
-                    it->second = *before;
-                else
-                {
-                    assert(it != get_rename_map().end());
-                    get_rename_map().erase(it);
-                }
-            }
+/**
+ * Call by name reduction on the Krivine machine: arguments are not shared,
+ * so the step count may be larger than run_named's
+ */
+static inline
+void run_krivine(rendering_ast_rec_ptr parsed, symbol_table const& symbols, size_t m, size_t k,
+                 std::ostream& out)
+{
+    auto code = to_de_bruijn(*parsed);
+    parsed.reset();
 
-            break;
-        }
-        case node_tag::APPLICATION:
-            run_substitutions(*op.args[0]);
-            run_substitutions(*op.args[1]);
-            break;
+    krivine_machine machine(*code, symbols);
+    machine.print(out);
+    out << std::endl;
+
+    size_t done = 0;
+    while (done < m
+           && machine.step())
+    {
+        done++;
+        if (done % k == 0)
+        {
+            machine.print(out);
+            out << '\n';
         }
-        break;
     }
-    case 2:
+
+    if (done % k != 0)
     {
-        return;
-    }
-    default:
-        assert(false);
+        machine.print(out);
+        out << std::endl;
     }
 }
 
+/**
+ * Reduces one task in context, the De Bruijn and Krivine engines print
+ * to text_out and the others to out. Their reduction and printing is
+ * traced as one phase. The memo engine uses cache, which belongs to context.
+ */
 static inline
-void resolve_referrals(empty_ast_rec_ptr& rec_ptr)
+task_result run_task(reduction_context& context, normal_form_cache& cache, task_input const& task,
+                     reduction_options const& options, output_buffer& out, std::ostream& text_out,
+                     std::ostream& log, phase_tracer& trace)
 {
-    switch (rec_ptr->node.index())
+    context.reset();
+
+    // Workers of the parallel engine free nodes made on other threads
+    context.use_heap_nodes(options.engine == engine_type::PARALLEL);
+    auto from = trace.start();
+    auto result = context.parse(task.term);
+    trace.finish("parse", from);
+
+    switch (options.engine)
     {
-    case 0:
-        return;
-    case 1:
+    case engine_type::NAMED:
+    case engine_type::ZIPPER:
+    case engine_type::GRAPH:
+        return run_named(context, std::move(result), options, task.m, task.k, out, log, trace);
+    case engine_type::DE_BRUIJN:
     {
-        auto& rec = std::get<1>(rec_ptr->node);
-        resolve_referrals(rec.args[0]);
-        resolve_referrals(rec.args[1]);
-        break;
+        phase_tracer::span span(trace, "de_bruijn");
+        run_de_bruijn(std::move(result), context.symbols(), task.m, task.k, text_out);
+        return {};
     }
-    case 2:
+    case engine_type::KRIVINE:
     {
-        auto& ptr = std::get<2>(rec_ptr->node);
-        rec_ptr = ptr->deep_copy();
-        run_substitutions(*rec_ptr);
-        break;
+        phase_tracer::span span(trace, "krivine");
+        run_krivine(std::move(result), context.symbols(), task.m, task.k, text_out);
+        return {};
     }
-    default:
-        assert(false);
-        return;
+    case engine_type::PARALLEL:
+        return run_parallel(context, std::move(result), options, task.m, out, log, trace);
+    case engine_type::MEMO:
+        return run_memo(context, std::move(result), cache, options, task.m, out, log, trace);
     }
+
+    return {};
 }
 
-static inline void
-substitute_with_referral(empty_ast_rec_ptr& rec_ptr, std::string const& varname,
-                         std::shared_ptr<empty_ast_rec>& lazy_link)
+/**
+ * @return  false if the trace could not be written
+ */
+[[nodiscard]]
+static inline
+bool write_trace(std::string const& path, std::vector<phase_tracer::event> const& events, bool counters)
 {
-    switch (rec_ptr->node.index())
+    std::ofstream file(path);
+    phase_tracer::write_chrome_trace(file, events, counters);
+    file.close();
+
+    if (!file)
     {
-    case 0:
+        std::cerr << "Error writing " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @return  false if the report could not be written
+ */
+[[nodiscard]]
+static inline
+bool write_stats(std::string const& path, reduction_stats const& stats)
+{
+    std::ofstream file(path);
+    stats.write_json(file);
+    file.close();
+
+    if (!file)
     {
-        auto& rec = std::get<0>(rec_ptr->node);
-        if (rec.name == varname)
-            rec_ptr->node = lazy_link;
-        break;
+        std::cerr << "Error writing " << path << std::endl;
+        return false;
     }
-    case 1:
+
+    return true;
+}
+
+struct batch_job
+{
+    task_input      task;
+    std::string     output;
+    std::string     log;
+    reduction_stats stats;
+    budget_limit    stopped{budget_limit::NONE};
+    bool            finished{false};
+};
+
+/**
+ * Jobs of a batch, taken by the workers in input order
+ */
+struct batch_queue
+{
+    explicit batch_queue(reduction_options const& options)
+            : options(options)
+    {}
+
+    reduction_options const&            options;
+    std::vector<batch_job>              jobs;
+    std::atomic<size_t>                 next{0};
+    std::mutex                          lock;
+    std::condition_variable             job_finished;
+    /**
+     * Phases of all workers, added by each one when it is done
+     */
+    std::atomic<uint32_t>               tracers{0};
+    std::vector<phase_tracer::event>    trace_events;
+    bool                                trace_counters{true};
+};
+
+static
+void batch_worker(batch_queue& queue)
+{
+    reduction_context context(reduction_context::name_storage::BORROW);
+    normal_form_cache cache;
+    phase_tracer trace(!queue.options.trace_file.empty(), queue.tracers++);
+
+    for (size_t i = queue.next++; i < queue.jobs.size(); i = queue.next++)
     {
-        auto& rec = std::get<1>(rec_ptr->node);
-        if (rec.tag == node_tag::APPLICATION)
-            substitute_with_referral(rec.args[0], varname, lazy_link);
-        else
+        auto& job = queue.jobs[i];
+
+        output_buffer out(output_buffer::in_memory, 0);
+        std::ostringstream text_out, log;
+        auto result = run_task(context, cache, job.task, queue.options, out, text_out, log, trace);
+
+        auto output = out.release();
+        output += text_out.str();
+
         {
-            auto& lhs = rec_ptr->child(0);
-            if (lhs.node.index() != 0)
-            {
-                assert(false);
-                return;
-            }
-
-            auto& abstraction_name = std::get<0>(lhs.node).name;
-            if (abstraction_name == varname)
-                return;
+            std::lock_guard<std::mutex> guard(queue.lock);
+            job.output = std::move(output);
+            job.log = log.str();
+            job.stats = std::move(result.stats);
+            job.stopped = result.stopped;
+            job.finished = true;
         }
-        substitute_with_referral(rec.args[1], varname, lazy_link);
-        break;
+        queue.job_finished.notify_all();
     }
-    case 2:
+
+    if (trace.is_enabled())
     {
-        assert(false && "Unresolved referral");
-    }
-    default:
-        assert(false && "Unexpected node type!");
-        return;
+        std::lock_guard<std::mutex> guard(queue.lock);
+        auto const& events = trace.recorded();
+        queue.trace_events.insert(queue.trace_events.end(), events.begin(), events.end());
+        queue.trace_counters = queue.trace_counters && trace.has_counters();
     }
-}
 
-size_t done = 0;
+}
 
-template<typename SmartPtr>
+/**
+ * Reduces every task of input on worker threads, the output of each one
+ * is printed in input order and followed by an empty line
+ */
+[[nodiscard]]
 static inline
-bool reduce(empty_ast_rec_ptr& root,
-            SmartPtr& rec_ptr)
+int run_batch(std::string_view input, reduction_options const& options)
 {
-    switch (rec_ptr->node.index())
-    {
-    case 0: return false;
-    case 1:
+    batch_queue queue(options);
+    while (input.find_first_not_of(" \t\n\v\f\r") != std::string_view::npos)
     {
-        auto& parent_op = std::get<1>(rec_ptr->node);
-        if (parent_op.tag == node_tag::APPLICATION
-            && (rec_ptr->child(0).has_node_tag(node_tag::FORALL)
-                || (parent_op.args[0]->node.index() == 2
-                    && std::get<2>(parent_op.args[0]->node)->has_node_tag(node_tag::FORALL))))
+        task_input task;
+        if (!split_task_input(input, task) || task.term.empty())
         {
-            resolve_referrals(rec_ptr->child_ptr(0));
+            std::cerr << "Expected m, k and the term of task " << queue.jobs.size() + 1 << std::endl;
+            return -1;
+        }
+
+        if (options.engine == engine_type::MEMO
+            && task.k < task.m)
+        {
+            std::cerr << "The memo engine prints only the normal form, task " << queue.jobs.size() + 1
+                      << " needs k >= m" << std::endl;
+            return -1;
+        }
 
-            std::shared_ptr ptr = std::move(parent_op.args[1]);
+        input = task.rest;
+        queue.jobs.push_back({task, {}, {}, {}, budget_limit::NONE, false});
+    }
 
-            auto& name_holder_rec = rec_ptr->child(0).child(0);
-            if (name_holder_rec.node.index() != 0)
-            {
-                assert(false);
-                return false;
-            }
-            std::string const& varname = std::get<0>(name_holder_rec.node).name;
+    size_t const threads = std::min(thread_count(options), std::max<size_t>(queue.jobs.size(), 1));
 
-            substitute_with_referral(rec_ptr->child(0).child_ptr(1), varname, ptr);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        try
+        {
+            workers.emplace_back(batch_worker, std::ref(queue));
+        }
+        catch (std::system_error const& err)
+        {
+            std::cerr << "Error starting worker: " << err.what() << std::endl;
+            break;
+        }
+    }
 
-            auto newnode = std::move(rec_ptr->child(0).child(1).node);
+    if (workers.empty())
+        batch_worker(queue);
 
-            rec_ptr->node = std::move(newnode);
-            return true;
+    output_buffer out;
+    reduction_stats stats;
+    bool stopped = false;
+    for (auto& job : queue.jobs)
+    {
+        std::string output, log;
+        {
+            std::unique_lock<std::mutex> guard(queue.lock);
+            queue.job_finished.wait(guard, [&job] { return job.finished; });
+            output.swap(job.output);
+            log.swap(job.log);
+            stats.merge(job.stats);
+            stopped = stopped || job.stopped != budget_limit::NONE;
         }
 
-        if (reduce(root, parent_op.args[0]))
-            return true;
-        return reduce(root, parent_op.args[1]);
+        out.append(output).put('\n');
+        std::cerr << log;
     }
-    case 2:
+
+    for (auto& worker : workers)
+        worker.join();
+
+    if (!out.flush())
     {
-        auto& ptr = std::get<2>(rec_ptr->node);
-        return reduce(root, ptr);
-    }
-    default:
-        assert(false && "Unexpected node type");
-        return false;
+        std::cerr << "Error writing stdout: " << strerror(errno) << std::endl;
+        return -1;
     }
+
+    if (!options.stats_file.empty()
+        && !write_stats(options.stats_file, stats))
+        return -1;
+
+    if (!options.trace_file.empty()
+        && !write_trace(options.trace_file, queue.trace_events, queue.trace_counters))
+        return -1;
+
+    return stopped ? kBudgetExceeded : 0;
 }
 
-int main()
+int main(int argc, char** argv)
 {
     std::ios_base::sync_with_stdio(false);
 
-    if (int err = set_stack_lim())
-        return err;
+    reduction_options options;
+    if (!parse_options(argc, argv, options))
+    {
+        std::cerr << "Usage: task2 [--engine=named|zipper|graph|de-bruijn|krivine|parallel|memo] [--hash-cons] [--dedup-every=N] [--render-cache]" << std::endl
+                  << "             [--batch] [--threads=N] [--stats=FILE] [--stats-every=N] [--trace=FILE]" << std::endl
+                  << "             [--max-nodes=N] [--max-bytes=N] [--max-time=MS]" << std::endl
+                  << "    --hash-cons, --dedup-every and --render-cache do not work with the De Bruijn and Krivine engines" << std::endl
+                  << "    --batch reads tasks until the end of input and prints their outputs in order, separated by empty lines" << std::endl
+                  << "    --engine=parallel prints only the normal form, it needs k >= m and takes no other options but --threads and --stats" << std::endl
+                  << "    --engine=memo prints only the normal form, it needs k >= m; closed subterms seen before in the task" << std::endl
+                  << "    or in an earlier task of a batch worker are replaced with their cached normal form in one step" << std::endl
+                  << "    --stats writes reduction counters to FILE as JSON, sampled after each N reductions with --stats-every;" << std::endl
+                  << "    a batch reports the sums over its tasks without samples. Not available with the De Bruijn and Krivine engines" << std::endl
+                  << "    --trace writes the time and hardware counters of each phase to FILE as a Chrome trace" << std::endl
+                  << "    --max-nodes, --max-bytes (live nodes and output) and --max-time stop a task early: its last term is printed," << std::endl
+                  << "    cut at the byte limit, and task2 exits with status " << kBudgetExceeded << ". Only for the named, zipper, graph" << std::endl
+                  << "    and memo engines; the normal forms cached by the memo engine count as live nodes and take at most half of the limits" << std::endl;
+        return -1;
+    }
 
-    /**
-     * @m   Number of reductions
-     * @k   Output lambda after each k reductions
-     */
-    size_t m, k;
-    std::cin >> m >> k;
+    input_buffer input;
+    if (!input.load())
+    {
+        std::cerr << "Error reading stdin: " << strerror(errno) << std::endl;
+        return -1;
+    }
 
-    std::string line;
-    while (line.empty())
-        std::getline(std::cin, line);
+    if (options.batch)
+        return run_batch(input.view(), options);
 
-    parsing_context<empty_userdata> contxt{};
+    task_input task;
+    if (!split_task_input(input.view(), task) || task.term.empty())
+    {
+        std::cerr << "Expected m, k and the term" << std::endl;
+        return -1;
+    }
 
-    auto result = contxt.parse_lambda({line.data(), line.size()});
+    if ((options.engine == engine_type::PARALLEL || options.engine == engine_type::MEMO)
+        && task.k < task.m)
+    {
+        std::cerr << "The parallel and memo engines print only the normal form, they need k >= m" << std::endl;
+        return -1;
+    }
 
-    run_substitutions(*result);
-    assert(get_rename_map().empty());
-    std::cout << *result << std::endl;
+    reduction_context context(reduction_context::name_storage::BORROW);
+    normal_form_cache cache;
 
-    while (done < m
-           && reduce(result, result))
+    output_buffer out;
+    phase_tracer trace(!options.trace_file.empty());
+    auto const result = run_task(context, cache, task, options, out, std::cout, std::cerr, trace);
+    if (result.write_error != 0)
     {
-        done++;
-        if (done % k == 0)
-            std::cout << *result << '\n';
+        std::cerr << "Error writing stdout: " << strerror(result.write_error) << std::endl;
+        return -1;
     }
 
-    if (done % k != 0)
-        std::cout << *result << std::endl;
+    if (!options.stats_file.empty()
+        && !write_stats(options.stats_file, result.stats))
+        return -1;
+
+    if (!options.trace_file.empty()
+        && !write_trace(options.trace_file, trace.recorded(), trace.has_counters()))
+        return -1;
 
-    return 0;
+    return result.stopped != budget_limit::NONE ? kBudgetExceeded : 0;
 }